@@ -0,0 +1,482 @@
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/options.h"
+
+namespace file_sys = std::filesystem;
+
+// Замер производительности my_backup и my_restore на синтетических наборах
+// данных. Наборы строятся из зерна генератора, поэтому одинаковы от запуска
+// к запуску. Для каждого набора замеряются full backup, incremental backup
+// и восстановление, результат печатается в JSON
+
+// Параметры запуска бенчмарка
+struct BenchOptions {
+  size_t scale = 1;
+  uint64_t seed = 42;
+  file_sys::path work = file_sys::temp_directory_path() / "backup_bench";
+  file_sys::path bin;
+  file_sys::path output;
+  std::set<std::string> datasets;
+  std::vector<std::string> tool_options;
+  bool count_syscalls = true;
+};
+
+// Результат одного запуска утилиты
+struct RunResult {
+  double seconds = 0;
+  long peak_rss_kb = 0;
+  int64_t syscalls = -1;  // -1 — не удалось посчитать
+};
+
+// Строка итогового отчёта
+struct Measurement {
+  std::string dataset;
+  std::string operation;
+  uint64_t files = 0;
+  uint64_t bytes = 0;
+  RunResult run{};
+};
+
+// Пишет файл заданного размера со случайным содержимым
+void WriteRandomFile(const file_sys::path& path, uint64_t size,
+                     std::mt19937_64& rng) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  std::vector<uint64_t> block(64 * 1024);
+  while (size > 0) {
+    for (uint64_t& word : block) {
+      word = rng();
+    }
+    uint64_t chunk = std::min<uint64_t>(size, block.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char*>(block.data()), chunk);
+    size -= chunk;
+  }
+  if (!file) {
+    throw std::runtime_error(
+        "Не удалось записать файл набора данных " + path.string() +
+        "\nПроверьте свободное место в рабочей директории");
+  }
+}
+
+// Много мелких файлов: здесь всё решает задержка системных вызовов
+void GenerateTinyFiles(const file_sys::path& root, size_t scale,
+                       std::mt19937_64& rng) {
+  size_t dirs = 100 * scale;
+  size_t files = 5000 * scale;
+  std::uniform_int_distribution<uint64_t> size(0, 4096);
+  for (size_t i = 0; i < files; ++i) {
+    file_sys::path dir = root / ("dir" + std::to_string(i % dirs));
+    file_sys::create_directories(dir);
+    WriteRandomFile(dir / ("file" + std::to_string(i)), size(rng), rng);
+  }
+}
+
+// Несколько больших файлов: проверяет пропускную способность копирования
+void GenerateHugeFiles(const file_sys::path& root, size_t scale,
+                       std::mt19937_64& rng) {
+  file_sys::create_directories(root);
+  for (size_t i = 0; i < 4; ++i) {
+    WriteRandomFile(root / ("huge" + std::to_string(i) + ".bin"),
+                    (32ull << 20) * scale, rng);
+  }
+}
+
+// Глубокие цепочки директорий с файлами на каждом уровне
+void GenerateDeepTree(const file_sys::path& root, size_t scale,
+                      std::mt19937_64& rng) {
+  std::uniform_int_distribution<uint64_t> size(1, 16 * 1024);
+  for (size_t chain = 0; chain < 8 * scale; ++chain) {
+    file_sys::path dir = root / ("chain" + std::to_string(chain));
+    for (size_t level = 0; level < 64; ++level) {
+      dir /= "level" + std::to_string(level);
+      file_sys::create_directories(dir);
+      for (size_t i = 0; i < 4; ++i) {
+        WriteRandomFile(dir / ("file" + std::to_string(i)), size(rng), rng);
+      }
+    }
+  }
+}
+
+// Смешанное дерево: размеры от байт до мегабайт, до четырёх уровней
+// вложенности
+void GenerateMixedTree(const file_sys::path& root, size_t scale,
+                       std::mt19937_64& rng) {
+  std::uniform_int_distribution<int> depth(0, 3);
+  std::uniform_int_distribution<int> branch(0, 7);
+  std::uniform_real_distribution<double> log_size(0, 22);
+  for (size_t i = 0; i < 1000 * scale; ++i) {
+    file_sys::path dir = root;
+    for (int level = depth(rng); level > 0; --level) {
+      dir /= "d" + std::to_string(branch(rng));
+    }
+    file_sys::create_directories(dir);
+    WriteRandomFile(dir / ("file" + std::to_string(i)),
+                    static_cast<uint64_t>(std::exp2(log_size(rng))), rng);
+  }
+}
+
+// Изменения между full и incremental: часть файлов переписывается,
+// дописывается, удаляется или только меняет время, добавляются новые файлы
+void ApplyChurn(const file_sys::path& root, std::mt19937_64& rng) {
+  std::vector<file_sys::path> files;
+  for (const auto& entry : file_sys::recursive_directory_iterator(root)) {
+    if (entry.is_regular_file()) {
+      files.push_back(entry.path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  std::uniform_real_distribution<double> chance(0, 1);
+  size_t added = 0;
+  for (const file_sys::path& path : files) {
+    double roll = chance(rng);
+    if (roll < 0.10) {
+      WriteRandomFile(path, file_sys::file_size(path), rng);
+    } else if (roll < 0.15) {
+      std::ofstream(path, std::ios::binary | std::ios::app) << "appended";
+    } else if (roll < 0.20) {
+      file_sys::remove(path);
+    } else if (roll < 0.25) {
+      file_sys::last_write_time(
+          path, file_sys::last_write_time(path) + std::chrono::hours(1));
+    } else if (roll < 0.30) {
+      WriteRandomFile(path.parent_path() / ("new" + std::to_string(added++)),
+                      4096, rng);
+    }
+  }
+}
+
+// Наборы данных по именам
+struct Dataset {
+  std::string name;
+  void (*generate)(const file_sys::path&, size_t, std::mt19937_64&);
+  bool churn;
+};
+
+const std::vector<Dataset>& Datasets() {
+  static const std::vector<Dataset> datasets = {
+      {"tiny", GenerateTinyFiles, false},
+      {"huge", GenerateHugeFiles, false},
+      {"deep", GenerateDeepTree, false},
+      {"churn", GenerateMixedTree, true},
+  };
+  return datasets;
+}
+
+// Число обычных файлов и их суммарный размер. Манифесты и служебные файлы
+// бэкапа не учитываются
+void CountFiles(const file_sys::path& root, uint64_t& files, uint64_t& bytes) {
+  files = 0;
+  bytes = 0;
+  for (const auto& entry : file_sys::recursive_directory_iterator(root)) {
+    if (entry.is_regular_file() && entry.path().extension() != ".manifest" &&
+        entry.path().filename() != "last_full.txt") {
+      ++files;
+      bytes += entry.file_size();
+    }
+  }
+}
+
+// Считает системные вызовы процесса и всех его потоков через ptrace.
+// Возвращает код завершения процесса
+int TraceSyscalls(pid_t pid, int64_t& syscalls) {
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+  ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+
+  // Каждый вызов даёт две остановки, вход и выход: считаются только входы
+  std::unordered_map<pid_t, bool> in_syscall;
+  int exit_code = -1;
+  syscalls = 0;
+  while (true) {
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      break;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (tid == pid) {
+        exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+      }
+      in_syscall.erase(tid);
+      continue;
+    }
+    int signal = WSTOPSIG(status);
+    int inject = 0;
+    if (signal == (SIGTRAP | 0x80)) {
+      bool& inside = in_syscall[tid];
+      if (!inside) {
+        ++syscalls;
+      }
+      inside = !inside;
+    } else if (signal != SIGTRAP && signal != SIGSTOP) {
+      inject = signal;
+    }
+    ptrace(PTRACE_SYSCALL, tid, nullptr, inject);
+  }
+  return exit_code;
+}
+
+// Разрешён ли ptrace в этой среде: в контейнерах его часто запрещают
+bool CanTrace() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) == 0 ? 0 : 1);
+  }
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+// Запускает утилиту и замеряет время и пиковую память. С trace вместо
+// замера времени считает системные вызовы
+RunResult RunTool(const std::vector<std::string>& args, bool trace) {
+  std::vector<char*> argv;
+  for (const std::string& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("Не удалось запустить " + args[0] +
+                             "\nПроверьте ограничения на число процессов");
+  }
+  if (pid == 0) {
+    // Вывод утилит не нужен в отчёте
+    freopen("/dev/null", "w", stdout);
+    if (trace) {
+      ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+      raise(SIGSTOP);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  RunResult result;
+  int exit_code;
+  if (trace) {
+    exit_code = TraceSyscalls(pid, result.syscalls);
+  } else {
+    int status;
+    struct rusage usage {};
+    wait4(pid, &status, 0, &usage);
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    result.peak_rss_kb = usage.ru_maxrss;
+    exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+  if (exit_code != 0) {
+    throw std::runtime_error("Команда " + args[0] + " завершилась с кодом " +
+                             std::to_string(exit_code) +
+                             "\nЗапустите её вручную, чтобы увидеть ошибку");
+  }
+  return result;
+}
+
+// Ждёт начала следующей секунды: имена бэкапов различаются по секундам
+void WaitNextSecond() {
+  std::time_t now = std::time(nullptr);
+  while (std::time(nullptr) == now) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+}
+
+// Самая новая директория бэкапа в корне
+file_sys::path NewestBackup(const file_sys::path& root) {
+  file_sys::path newest;
+  for (const auto& entry : file_sys::directory_iterator(root)) {
+    if (entry.is_directory() && entry.path().filename() > newest.filename()) {
+      newest = entry.path();
+    }
+  }
+  return newest;
+}
+
+// Команда утилиты с дополнительными параметрами из --tool-option
+std::vector<std::string> ToolCommand(const BenchOptions& options,
+                                     const std::string& tool,
+                                     std::vector<std::string> args) {
+  std::vector<std::string> command = {(options.bin / tool).string()};
+  command.insert(command.end(), options.tool_options.begin(),
+                 options.tool_options.end());
+  command.insert(command.end(), args.begin(), args.end());
+  return command;
+}
+
+// Прогон одного набора: full, incremental, восстановление цепочки. При trace
+// все шаги выполняются под ptrace и дают только число системных вызовов
+std::vector<Measurement> RunScenario(const Dataset& dataset,
+                                     const BenchOptions& options, bool trace) {
+  file_sys::path base = options.work / dataset.name;
+  file_sys::path source = base / "source";
+  file_sys::path backup = base / "backup";
+  file_sys::path restored = base / "restored";
+  file_sys::remove_all(base);
+  file_sys::create_directories(backup);
+  file_sys::create_directories(restored);
+
+  std::mt19937_64 rng(options.seed);
+  dataset.generate(source, options.scale, rng);
+  std::vector<Measurement> results;
+
+  Measurement full{dataset.name, "full"};
+  full.run = RunTool(ToolCommand(options, "my_backup",
+                                 {"full", source.string(), backup.string()}),
+                     trace);
+  CountFiles(NewestBackup(backup), full.files, full.bytes);
+  results.push_back(full);
+
+  if (dataset.churn) {
+    ApplyChurn(source, rng);
+  }
+  WaitNextSecond();
+  Measurement incremental{dataset.name, "incremental"};
+  incremental.run = RunTool(
+      ToolCommand(options, "my_backup",
+                  {"incremental", source.string(), backup.string()}),
+      trace);
+  CountFiles(NewestBackup(backup), incremental.files, incremental.bytes);
+  results.push_back(incremental);
+
+  Measurement restore{dataset.name, "restore"};
+  restore.run = RunTool(
+      ToolCommand(options, "my_restore",
+                  {"--chain", NewestBackup(backup).string(),
+                   restored.string()}),
+      trace);
+  CountFiles(restored, restore.files, restore.bytes);
+  results.push_back(restore);
+
+  file_sys::remove_all(base);
+  return results;
+}
+
+// Печатает отчёт в JSON
+void WriteJson(std::ostream& out, const BenchOptions& options,
+               const std::vector<Measurement>& results) {
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"seed\": " << options.seed << ",\n  \"scale\": "
+      << options.scale << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Measurement& item = results[i];
+    double seconds = item.run.seconds > 0 ? item.run.seconds : 1e-9;
+    out << (i == 0 ? "\n" : ",\n") << "    {\"dataset\": \"" << item.dataset
+        << "\", \"operation\": \"" << item.operation
+        << "\", \"files\": " << item.files << ", \"bytes\": " << item.bytes
+        << ", \"seconds\": " << item.run.seconds
+        << ", \"files_per_second\": " << item.files / seconds
+        << ", \"mb_per_second\": " << item.bytes / seconds / (1 << 20)
+        << ", \"syscalls\": ";
+    if (item.run.syscalls < 0) {
+      out << "null";
+    } else {
+      out << item.run.syscalls;
+    }
+    out << ", \"peak_rss_kb\": " << item.run.peak_rss_kb << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+// Разбирает параметры бенчмарка
+BenchOptions ParseBenchOptions(int argc, char* argv[]) {
+  BenchOptions options;
+  options.bin = file_sys::read_symlink("/proc/self/exe").parent_path();
+  for (int i = 1; i < argc; ++i) {
+    std::string name = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Не передано значение параметра " + name +
+                                 "\nУкажите значение после имени параметра");
+      }
+      return argv[++i];
+    };
+    if (name == "--scale") {
+      options.scale = ParseCount(name, value());
+    } else if (name == "--seed") {
+      options.seed = ParseCount(name, value());
+    } else if (name == "--work") {
+      options.work = value();
+    } else if (name == "--bin") {
+      options.bin = value();
+    } else if (name == "--output") {
+      options.output = value();
+    } else if (name == "--dataset") {
+      options.datasets.insert(value());
+    } else if (name == "--tool-option") {
+      options.tool_options.push_back(value());
+    } else if (name == "--no-syscalls") {
+      options.count_syscalls = false;
+    } else {
+      throw std::runtime_error("Передан неизвестный параметр " + name +
+                               "\nПроверьте правильность введённой команды");
+    }
+  }
+  return options;
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    BenchOptions options = ParseBenchOptions(argc, argv);
+    if (options.count_syscalls && !CanTrace()) {
+      std::cerr << "ptrace недоступен, системные вызовы не считаются" << '\n';
+      options.count_syscalls = false;
+    }
+    std::vector<Measurement> results;
+    for (const Dataset& dataset : Datasets()) {
+      if (!options.datasets.empty() &&
+          options.datasets.count(dataset.name) == 0) {
+        continue;
+      }
+      std::cerr << "Набор " << dataset.name << "..." << '\n';
+      std::vector<Measurement> timed = RunScenario(dataset, options, false);
+      // Подсчёт системных вызовов под ptrace замедляет утилиты, поэтому он
+      // идёт отдельным прогоном на том же наборе
+      if (options.count_syscalls) {
+        std::vector<Measurement> traced = RunScenario(dataset, options, true);
+        for (size_t i = 0; i < timed.size(); ++i) {
+          timed[i].run.syscalls = traced[i].run.syscalls;
+        }
+      }
+      results.insert(results.end(), timed.begin(), timed.end());
+    }
+
+    if (options.output.empty()) {
+      WriteJson(std::cout, options, results);
+    } else {
+      std::ofstream out(options.output);
+      WriteJson(out, options, results);
+    }
+  } catch (const std::exception& error) {
+    std::cerr << error.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "copy_backend.h"
+#include "lz4.h"
+#include "throttle.h"
+
+namespace file_sys = std::filesystem;
+
+// Архив бэкапа — один файл вместо дерева директорий:
+//
+//   "BRARCH01"
+//   для каждого элемента: заголовок элемента, затем блоки данных файла
+//   индекс: число элементов и записи ArchiveIndexEntry, отсортированные по
+//   пути
+//   хвост: смещение индекса (8 байт) и "BRINDEX1"
+//
+// Данные файла режутся на блоки по kArchiveBlockSize, каждый блок сжимается
+// LZ4 независимо от остальных: сжатие идёт параллельно, а запись — строго
+// последовательно. Блок хранится как сырой размер, сохранённый размер и
+// данные; если сжатие не помогло, блок хранится как есть
+
+inline constexpr char kArchiveMagic[8] = {'B', 'R', 'A', 'R',
+                                          'C', 'H', '0', '1'};
+inline constexpr char kArchiveIndexMagic[8] = {'B', 'R', 'I', 'N',
+                                               'D', 'E', 'X', '1'};
+inline constexpr uint32_t kArchiveEntryMagic = 0x454c4946;  // "FILE"
+inline constexpr size_t kArchiveBlockSize = 1 << 20;
+inline constexpr char kArchiveExtension[] = ".bra";
+
+// Описание элемента архива: заголовок элемента и запись индекса
+struct ArchiveEntry {
+  std::string path;
+  bool directory = false;
+  uint32_t mode = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  uint64_t header_offset = 0;
+};
+
+// Последовательная запись значений в буфер
+class ByteWriter {
+ public:
+  template <typename T>
+  void Put(const T& value) {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(value));
+  }
+  void PutBytes(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+  std::vector<char>& Data() { return data_; }
+
+ private:
+  std::vector<char> data_;
+};
+
+// Число блоков данных файла
+inline uint64_t ArchiveBlockCount(uint64_t size) {
+  return (size + kArchiveBlockSize - 1) / kArchiveBlockSize;
+}
+
+// Заголовок элемента в потоке архива
+inline std::vector<char> EncodeArchiveHeader(const ArchiveEntry& entry) {
+  ByteWriter writer;
+  writer.Put(kArchiveEntryMagic);
+  writer.Put(static_cast<uint8_t>(entry.directory));
+  writer.Put(entry.mode);
+  writer.Put(entry.size);
+  writer.Put(entry.mtime_ns);
+  writer.Put(static_cast<uint32_t>(entry.path.size()));
+  writer.PutBytes(entry.path.data(), entry.path.size());
+  return std::move(writer.Data());
+}
+
+// Сжимает блок данных в формат хранения
+inline std::vector<char> EncodeArchiveBlock(const uint8_t* data, size_t size) {
+  std::vector<uint8_t> compressed;
+  Lz4Compress(data, size, compressed);
+  ByteWriter writer;
+  writer.Put(static_cast<uint32_t>(size));
+  if (compressed.size() < size) {
+    writer.Put(static_cast<uint32_t>(compressed.size()));
+    writer.PutBytes(compressed.data(), compressed.size());
+  } else {
+    writer.Put(static_cast<uint32_t>(size));
+    writer.PutBytes(data, size);
+  }
+  return std::move(writer.Data());
+}
+
+// Индекс архива и хвост со смещением индекса
+inline std::vector<char> EncodeArchiveIndex(
+    std::vector<ArchiveEntry>& entries, uint64_t index_offset) {
+  std::sort(entries.begin(), entries.end(),
+            [](const ArchiveEntry& lhs, const ArchiveEntry& rhs) {
+              return lhs.path < rhs.path;
+            });
+  ByteWriter writer;
+  writer.Put(static_cast<uint64_t>(entries.size()));
+  for (const ArchiveEntry& entry : entries) {
+    writer.Put(entry.header_offset);
+    writer.Put(static_cast<uint8_t>(entry.directory));
+    writer.Put(entry.mode);
+    writer.Put(entry.size);
+    writer.Put(entry.mtime_ns);
+    writer.Put(static_cast<uint32_t>(entry.path.size()));
+    writer.PutBytes(entry.path.data(), entry.path.size());
+  }
+  writer.Put(index_offset);
+  writer.PutBytes(kArchiveIndexMagic, sizeof(kArchiveIndexMagic));
+  return std::move(writer.Data());
+}
+
+[[noreturn]] inline void ThrowCorruptedArchive(const file_sys::path& path) {
+  throw std::runtime_error("Архив " + path.string() +
+                           " повреждён\nВыберите другой бэкап");
+}
+
+// Проверяет, что файл является архивом бэкапа
+inline bool IsArchiveFile(const file_sys::path& path) {
+  FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  char magic[sizeof(kArchiveMagic)];
+  return fd.IsValid() &&
+         pread(fd.Get(), magic, sizeof(magic), 0) ==
+             static_cast<ssize_t>(sizeof(magic)) &&
+         std::memcmp(magic, kArchiveMagic, sizeof(magic)) == 0;
+}
+
+// Последовательное чтение архива с буферизацией
+class ArchiveStream {
+ public:
+  ArchiveStream(const file_sys::path& path, uint64_t offset)
+      : path_(path), fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)),
+        offset_(offset) {
+    if (!fd_.IsValid()) {
+      ThrowCopyError(path, path, errno);
+    }
+  }
+
+  const file_sys::path& Path() const { return path_; }
+  uint64_t Offset() const { return offset_; }
+
+  void Read(void* out, size_t size) {
+    char* bytes = static_cast<char*>(out);
+    while (size > 0) {
+      ssize_t result = pread(fd_.Get(), bytes, size, offset_);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        ThrowCorruptedArchive(path_);
+      }
+      bytes += result;
+      size -= result;
+      offset_ += result;
+    }
+  }
+
+  template <typename T>
+  T Get() {
+    T value;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  // Читает заголовок элемента
+  ArchiveEntry ReadHeader() {
+    ArchiveEntry entry;
+    entry.header_offset = offset_;
+    if (Get<uint32_t>() != kArchiveEntryMagic) {
+      ThrowCorruptedArchive(path_);
+    }
+    entry.directory = Get<uint8_t>() != 0;
+    entry.mode = Get<uint32_t>();
+    entry.size = Get<uint64_t>();
+    entry.mtime_ns = Get<int64_t>();
+    uint32_t path_size = Get<uint32_t>();
+    if (path_size > PATH_MAX) {
+      ThrowCorruptedArchive(path_);
+    }
+    entry.path.resize(path_size);
+    Read(entry.path.data(), path_size);
+    return entry;
+  }
+
+  // Читает и распаковывает очередной блок данных
+  void ReadBlock(std::vector<uint8_t>& out) {
+    ThrottledIo io(kArchiveBlockSize);
+    uint32_t raw_size = Get<uint32_t>();
+    uint32_t stored_size = Get<uint32_t>();
+    if (raw_size > kArchiveBlockSize || stored_size > raw_size) {
+      ThrowCorruptedArchive(path_);
+    }
+    out.resize(raw_size);
+    if (stored_size == raw_size) {
+      Read(out.data(), raw_size);
+      return;
+    }
+    stored_.resize(stored_size);
+    Read(stored_.data(), stored_size);
+    if (!Lz4Decompress(stored_.data(), stored_size, out.data(), raw_size)) {
+      ThrowCorruptedArchive(path_);
+    }
+  }
+
+  // Распаковывает данные файла из архива в открытый дескриптор
+  void ExtractData(const ArchiveEntry& entry, int out_fd,
+                   const file_sys::path& out_path) {
+    std::vector<uint8_t> block;
+    SparseWriter writer(out_fd);
+    for (uint64_t i = 0; i < ArchiveBlockCount(entry.size); ++i) {
+      ReadBlock(block);
+      int error = writer.Write(block.data(), block.size());
+      if (error != 0) {
+        ThrowCopyError(path_, out_path, error);
+      }
+    }
+    int error = writer.Finish();
+    if (error != 0) {
+      ThrowCopyError(path_, out_path, error);
+    }
+  }
+
+  // Пропускает данные файла, не распаковывая их
+  void SkipData(const ArchiveEntry& entry) {
+    for (uint64_t i = 0; i < ArchiveBlockCount(entry.size); ++i) {
+      Get<uint32_t>();
+      uint32_t stored_size = Get<uint32_t>();
+      offset_ += stored_size;
+    }
+  }
+
+  // Достигнут ли индекс в конце архива
+  bool AtIndex(uint64_t index_offset) const { return offset_ >= index_offset; }
+
+ private:
+  file_sys::path path_;
+  FileDescriptor fd_;
+  uint64_t offset_;
+  std::vector<uint8_t> stored_;
+};
+
+// Смещение индекса из хвоста архива
+inline uint64_t ReadArchiveIndexOffset(const file_sys::path& path) {
+  uint64_t size = file_sys::file_size(path);
+  if (size < sizeof(kArchiveMagic) + sizeof(uint64_t) +
+                 sizeof(kArchiveIndexMagic)) {
+    ThrowCorruptedArchive(path);
+  }
+  ArchiveStream stream(path, size - sizeof(uint64_t) -
+                                 sizeof(kArchiveIndexMagic));
+  uint64_t index_offset = stream.Get<uint64_t>();
+  char magic[sizeof(kArchiveIndexMagic)];
+  stream.Read(magic, sizeof(magic));
+  if (std::memcmp(magic, kArchiveIndexMagic, sizeof(magic)) != 0 ||
+      index_offset < sizeof(kArchiveMagic) || index_offset >= size) {
+    ThrowCorruptedArchive(path);
+  }
+  return index_offset;
+}
+
+// Читает индекс архива: элементы отсортированы по пути и хранят смещение
+// своего заголовка, поэтому нужный файл читается без просмотра данных
+inline std::vector<ArchiveEntry> ReadArchiveIndex(const file_sys::path& path) {
+  uint64_t index_offset = ReadArchiveIndexOffset(path);
+  ArchiveStream stream(path, index_offset);
+  uint64_t count = stream.Get<uint64_t>();
+  if (count > file_sys::file_size(path) - index_offset) {
+    ThrowCorruptedArchive(path);
+  }
+  std::vector<ArchiveEntry> entries(count);
+  for (ArchiveEntry& entry : entries) {
+    entry.header_offset = stream.Get<uint64_t>();
+    entry.directory = stream.Get<uint8_t>() != 0;
+    entry.mode = stream.Get<uint32_t>();
+    entry.size = stream.Get<uint64_t>();
+    entry.mtime_ns = stream.Get<int64_t>();
+    uint32_t path_size = stream.Get<uint32_t>();
+    if (path_size > PATH_MAX || entry.header_offset >= index_offset) {
+      ThrowCorruptedArchive(path);
+    }
+    entry.path.resize(path_size);
+    stream.Read(entry.path.data(), path_size);
+  }
+  return entries;
+}
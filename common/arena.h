@@ -0,0 +1,294 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+namespace file_sys = std::filesystem;
+
+// Память под список обхода и манифест: большие блоки, из которых записи и
+// пути выделяются подряд, без отдельного выделения на каждую строку. Пока
+// занято меньше лимита, блоки берутся из обычной памяти, дальше —
+// отображаются на удалённый временный файл. Страницы такого блока ядро
+// может выгрузить в файл, поэтому обычной памяти занято не больше лимита
+// при любом размере дерева. Память освобождается только целиком, вместе с
+// арендой
+class Arena {
+ public:
+  // memory_limit — сколько обычной памяти можно занять, 0 — без лимита
+  explicit Arena(uint64_t memory_limit = 0) : memory_limit_(memory_limit) {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  ~Arena() {
+    for (const Region& region : regions_) {
+      munmap(region.data, region.size);
+    }
+    if (spill_fd_ >= 0) {
+      close(spill_fd_);
+    }
+  }
+
+  void* Allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    size_t offset = (used_ + align - 1) & ~(align - 1);
+    if (current_ == nullptr || offset + size > current_size_) {
+      NewBlock(std::max(size + align, kBlockSize));
+      offset = (used_ + align - 1) & ~(align - 1);
+    }
+    used_ = offset + size;
+    return current_ + offset;
+  }
+
+  // Копирует строку в аренду. За строкой хранится '\0', поэтому data()
+  // результата можно передавать в системные вызовы
+  std::string_view Copy(std::string_view text) {
+    char* data = static_cast<char*>(Allocate(text.size() + 1, 1));
+    std::memcpy(data, text.data(), text.size());
+    data[text.size()] = '\0';
+    return std::string_view(data, text.size());
+  }
+
+  // Сколько занято обычной памяти и сколько вытеснено во временный файл
+  uint64_t MemoryBytes() const { return memory_bytes_; }
+  uint64_t SpilledBytes() const { return spilled_bytes_; }
+
+ private:
+  static constexpr size_t kBlockSize = 4 << 20;
+
+  struct Region {
+    void* data;
+    size_t size;
+  };
+
+  void NewBlock(size_t size) {
+    size = (size + kPageSize - 1) & ~(kPageSize - 1);
+    void* data = nullptr;
+    if (memory_limit_ == 0 || memory_bytes_ + size <= memory_limit_) {
+      data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      memory_bytes_ += size;
+    } else {
+      data = MapSpill(size);
+    }
+    regions_.push_back({data, size});
+    current_ = static_cast<char*>(data);
+    current_size_ = size;
+    used_ = 0;
+  }
+
+  void* MapSpill(size_t size) {
+    if (spill_fd_ < 0) {
+      OpenSpill();
+    }
+    // Заполненный блок записывается в файл и вытесняется сразу, не
+    // дожидаясь нехватки памяти: грязные страницы файла ядро само не
+    // вытесняет по madvise
+    if (!regions_.empty() && regions_.back().data == last_spill_) {
+      msync(last_spill_, regions_.back().size, MS_SYNC);
+#ifdef MADV_PAGEOUT
+      madvise(last_spill_, regions_.back().size, MADV_PAGEOUT);
+#endif
+    }
+    if (ftruncate(spill_fd_, spilled_bytes_ + size) != 0) {
+      ThrowSpillError(errno);
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      spill_fd_, spilled_bytes_);
+    if (data == MAP_FAILED) {
+      ThrowSpillError(errno);
+    }
+    spilled_bytes_ += size;
+    last_spill_ = data;
+    return data;
+  }
+
+  // Временный файл без имени: исчезает сам, даже если процесс упадёт
+  void OpenSpill() {
+    file_sys::path dir = file_sys::temp_directory_path();
+    spill_fd_ = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (spill_fd_ >= 0) {
+      return;
+    }
+    std::string name = (dir / "my_backup-XXXXXX").string();
+    spill_fd_ = mkostemp(name.data(), O_CLOEXEC);
+    if (spill_fd_ < 0) {
+      ThrowSpillError(errno);
+    }
+    unlink(name.c_str());
+  }
+
+  [[noreturn]] static void ThrowSpillError(int error) {
+    throw file_sys::filesystem_error(
+        "cannot spill to temporary file", file_sys::temp_directory_path(),
+        std::error_code(error, std::generic_category()));
+  }
+
+  static constexpr size_t kPageSize = 4096;
+
+  uint64_t memory_limit_;
+  uint64_t memory_bytes_ = 0;
+  uint64_t spilled_bytes_ = 0;
+  int spill_fd_ = -1;
+  void* last_spill_ = nullptr;
+  std::vector<Region> regions_;
+  char* current_ = nullptr;
+  size_t current_size_ = 0;
+  size_t used_ = 0;
+};
+
+// Последовательность записей в аренде. Записи выделяются кусками и не
+// перемещаются, поэтому ссылки на них остаются действительными, пока жива
+// аренда
+template <typename T>
+class ArenaVector {
+  static_assert(std::is_trivially_destructible_v<T>,
+                "записи аренды не разрушаются");
+
+ public:
+  explicit ArenaVector(Arena& arena) : arena_(&arena) {}
+
+  T& PushBack(const T& value) {
+    if (size_ % kChunkSize == 0) {
+      chunks_.push_back(static_cast<T*>(
+          arena_->Allocate(sizeof(T) * kChunkSize, alignof(T))));
+    }
+    T* slot = new (chunks_.back() + size_ % kChunkSize) T(value);
+    ++size_;
+    return *slot;
+  }
+
+  T& operator[](size_t index) {
+    return chunks_[index / kChunkSize][index % kChunkSize];
+  }
+  const T& operator[](size_t index) const {
+    return chunks_[index / kChunkSize][index % kChunkSize];
+  }
+
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+
+  class ConstIterator {
+   public:
+    ConstIterator(const ArenaVector* vector, size_t index)
+        : vector_(vector), index_(index) {}
+    const T& operator*() const { return (*vector_)[index_]; }
+    const T* operator->() const { return &(*vector_)[index_]; }
+    ConstIterator& operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const ConstIterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const ConstIterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    const ArenaVector* vector_;
+    size_t index_;
+  };
+
+  ConstIterator begin() const { return ConstIterator(this, 0); }
+  ConstIterator end() const { return ConstIterator(this, size_); }
+
+  // Итератор произвольного доступа: записи можно сортировать std::sort и
+  // искать в них std::lower_bound, не копируя в обычную память
+  class Iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+
+    Iterator() = default;
+    Iterator(ArenaVector* vector, size_t index)
+        : vector_(vector), index_(index) {}
+    T& operator*() const { return (*vector_)[index_]; }
+    T* operator->() const { return &(*vector_)[index_]; }
+    T& operator[](difference_type offset) const {
+      return (*vector_)[index_ + offset];
+    }
+    Iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+    Iterator operator++(int) { return Iterator(vector_, index_++); }
+    Iterator& operator--() {
+      --index_;
+      return *this;
+    }
+    Iterator operator--(int) { return Iterator(vector_, index_--); }
+    Iterator& operator+=(difference_type offset) {
+      index_ += offset;
+      return *this;
+    }
+    Iterator& operator-=(difference_type offset) {
+      index_ -= offset;
+      return *this;
+    }
+    Iterator operator+(difference_type offset) const {
+      return Iterator(vector_, index_ + offset);
+    }
+    friend Iterator operator+(difference_type offset, const Iterator& it) {
+      return it + offset;
+    }
+    Iterator operator-(difference_type offset) const {
+      return Iterator(vector_, index_ - offset);
+    }
+    difference_type operator-(const Iterator& other) const {
+      return static_cast<difference_type>(index_) -
+             static_cast<difference_type>(other.index_);
+    }
+    bool operator==(const Iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const Iterator& other) const {
+      return index_ != other.index_;
+    }
+    bool operator<(const Iterator& other) const {
+      return index_ < other.index_;
+    }
+    bool operator>(const Iterator& other) const {
+      return index_ > other.index_;
+    }
+    bool operator<=(const Iterator& other) const {
+      return index_ <= other.index_;
+    }
+    bool operator>=(const Iterator& other) const {
+      return index_ >= other.index_;
+    }
+
+   private:
+    ArenaVector* vector_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  Iterator begin() { return Iterator(this, 0); }
+  Iterator end() { return Iterator(this, size_); }
+
+ private:
+  static constexpr size_t kChunkSize = 4096;
+
+  Arena* arena_;
+  std::vector<T*> chunks_;
+  size_t size_ = 0;
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "delta.h"
+#include "manifest.h"
+#include "path_filter.h"
+
+namespace file_sys = std::filesystem;
+
+// Разбор цепочки бэкапов: full backup и инкрементные бэкапы после него.
+// Для каждого пути находится самая новая версия, чтобы при восстановлении
+// скопировать каждый файл ровно один раз
+
+// Проверяет, что имя имеет вид YYYY-MM-DD-HH-MM-SS, как у CreateBackupDir
+inline bool IsBackupDirName(const std::string& name) {
+  static constexpr char kPattern[] = "dddd-dd-dd-dd-dd-dd";
+  if (name.size() != sizeof(kPattern) - 1) {
+    return false;
+  }
+  for (size_t i = 0; i < name.size(); ++i) {
+    bool digit = std::isdigit(static_cast<unsigned char>(name[i])) != 0;
+    if ((kPattern[i] == 'd') != digit || (!digit && name[i] != '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Имена директорий бэкапов в корне, по возрастанию времени
+inline std::vector<std::string> ListBackupDirs(const file_sys::path& root) {
+  std::vector<std::string> names;
+  for (const auto& entry : file_sys::directory_iterator(root)) {
+    std::string name = entry.path().filename().string();
+    if (entry.is_directory() && IsBackupDirName(name)) {
+      names.push_back(name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// Имя последнего full backup из last_full.txt
+inline std::string ReadLastFull(const file_sys::path& root) {
+  std::string name;
+  std::ifstream last_full_file(root / "last_full.txt");
+  std::getline(last_full_file, name);
+  return name;
+}
+
+// Итог разбора цепочки: откуда брать каждый путь. Записи хранятся в
+// обычной памяти и --memory-limit не ограничены
+struct ResolvedEntry {
+  std::string path;
+  bool directory = false;
+  // Откуда копировать файл. У директории — откуда брать метаданные, может
+  // быть пуст
+  file_sys::path source;
+  // Если не пуст, source — патч, который применяется к этой копии файла
+  file_sys::path base;
+  // Хеш содержимого из манифеста, 0 — неизвестен
+  uint64_t hash = 0;
+};
+
+[[noreturn]] inline void ThrowBrokenChain(const std::string& name) {
+  throw std::runtime_error("Цепочка бэкапов неполна: не найден бэкап " + name +
+                           "\nПроверьте, что директории бэкапов и их "
+                           "манифесты не удалены");
+}
+
+// Приводит путь к директории бэкапа к виду без завершающего '/'
+inline file_sys::path NormalizeBackupDir(const file_sys::path& dir) {
+  file_sys::path normal = file_sys::absolute(dir).lexically_normal();
+  if (normal.filename().empty()) {
+    normal = normal.parent_path();
+  }
+  return normal;
+}
+
+// Разбор по манифестам: берутся пути из манифеста целевого бэкапа, данные
+// ищутся от целевого бэкапа к full backup по ссылкам на базовый бэкап.
+// Из манифеста читаются только записи, подходящие под фильтр
+inline std::vector<ResolvedEntry> ResolveChainByManifest(
+    const file_sys::path& target_dir, const PathFilter& filter) {
+  file_sys::path root = target_dir.parent_path();
+  std::vector<file_sys::path> dirs;
+  std::vector<std::unique_ptr<Manifest>> manifests;
+  std::set<std::string> visited;
+  file_sys::path dir = target_dir;
+  while (true) {
+    auto manifest = std::make_unique<Manifest>();
+    if (!visited.insert(dir.filename().string()).second ||
+        !file_sys::is_directory(dir) || !manifest->Open(ManifestPath(dir))) {
+      ThrowBrokenChain(dir.filename().string());
+    }
+    BackupKind kind = manifest->Kind();
+    std::string base(manifest->Base());
+    dirs.push_back(dir);
+    manifests.push_back(std::move(manifest));
+    if (kind == BackupKind::kFull) {
+      break;
+    }
+    dir = root / base;
+  }
+
+  const Manifest& target = *manifests.front();
+  std::vector<ResolvedEntry> resolved;
+  ForEachMatch(target, filter, [&](const ManifestEntry& entry) {
+    ResolvedEntry item;
+    item.path = std::string(target.Path(entry));
+    if ((entry.flags & kManifestDirectory) != 0) {
+      // Метаданные директории берутся из самого нового бэкапа, где она есть
+      item.directory = true;
+      for (const file_sys::path& link_dir : dirs) {
+        if (file_sys::is_directory(link_dir / item.path)) {
+          item.source = link_dir / item.path;
+          break;
+        }
+      }
+      resolved.push_back(std::move(item));
+      return;
+    }
+    // Для патча дальше по цепочке ищется копия, к которой он применяется
+    bool delta = false;
+    for (size_t link = 0; link < manifests.size(); ++link) {
+      const ManifestEntry* found = manifests[link]->Find(item.path);
+      if (found == nullptr || (found->flags & kManifestStored) == 0) {
+        continue;
+      }
+      if (!item.source.empty()) {
+        item.base = dirs[link] / item.path;
+        break;
+      }
+      item.hash = entry.hash != 0 ? entry.hash : found->hash;
+      item.source = dirs[link] / item.path;
+      if ((found->flags & kManifestDelta) == 0) {
+        break;
+      }
+      item.source += kDeltaExtension;
+      delta = true;
+    }
+    if (item.source.empty() || (delta && item.base.empty())) {
+      ThrowBrokenChain(dirs.back().filename().string());
+    }
+    resolved.push_back(std::move(item));
+  });
+  return resolved;
+}
+
+// Обходит директории бэкапов от новых к старым и для каждого пути берёт
+// первую, то есть самую новую, найденную версию
+inline std::vector<ResolvedEntry> ResolveNewest(
+    const file_sys::path& root, const std::vector<std::string>& chain,
+    const PathFilter& filter) {
+  std::map<std::string, ResolvedEntry> newest;
+  for (auto name = chain.rbegin(); name != chain.rend(); ++name) {
+    file_sys::path dir = root / *name;
+    for (const auto& component : file_sys::recursive_directory_iterator(dir)) {
+      std::string path =
+          file_sys::relative(component.path(), dir).generic_string();
+      if (newest.count(path) != 0 || !filter.Matches(path)) {
+        continue;
+      }
+      ResolvedEntry item;
+      item.path = path;
+      if (component.is_directory()) {
+        item.directory = true;
+      } else if (!component.is_regular_file()) {
+        continue;
+      }
+      item.source = component.path();
+      newest.emplace(std::move(path), std::move(item));
+    }
+  }
+
+  std::vector<ResolvedEntry> resolved;
+  resolved.reserve(newest.size());
+  for (auto& [path, item] : newest) {
+    resolved.push_back(std::move(item));
+  }
+  return resolved;
+}
+
+// Разбор бэкапов без манифестов: цепочка — последний full backup и все
+// бэкапы после него до целевого, для каждого пути берётся самая новая версия
+inline std::vector<ResolvedEntry> ResolveChainByTree(
+    const file_sys::path& target_dir, const PathFilter& filter) {
+  file_sys::path root = target_dir.parent_path();
+  std::string target_name = target_dir.filename().string();
+  std::string full_name = ReadLastFull(root);
+  if (full_name.empty() || full_name > target_name) {
+    full_name = target_name;
+  }
+
+  std::vector<std::string> chain;
+  for (const std::string& name : ListBackupDirs(root)) {
+    if (name >= full_name && name <= target_name) {
+      chain.push_back(name);
+    }
+  }
+  if (chain.empty() || chain.back() != target_name) {
+    chain.push_back(target_name);
+  }
+  return ResolveNewest(root, chain, filter);
+}
+
+// Находит самую новую версию каждого пути в цепочке, которая заканчивается
+// бэкапом target_dir. Записи отсортированы по пути, поэтому директория идёт
+// раньше вложенных в неё элементов
+inline std::vector<ResolvedEntry> ResolveChain(
+    file_sys::path target_dir, const PathFilter& filter = PathFilter()) {
+  target_dir = NormalizeBackupDir(target_dir);
+  if (file_sys::exists(ManifestPath(target_dir))) {
+    return ResolveChainByManifest(target_dir, filter);
+  }
+  return ResolveChainByTree(target_dir, filter);
+}
+
+// Есть ли в бэкапе файлы, сохранённые патчем к full backup
+inline bool HasDeltaEntries(file_sys::path dir) {
+  Manifest manifest;
+  if (!manifest.Open(ManifestPath(NormalizeBackupDir(dir)))) {
+    return false;
+  }
+  for (size_t i = 0; i < manifest.Size(); ++i) {
+    if ((manifest.Entry(i).flags & kManifestDelta) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Разбор одной директории бэкапа без учёта цепочки: только то, что лежит
+// в ней самой. Если есть манифест, пути ищутся по нему, а не обходом дерева
+inline std::vector<ResolvedEntry> ResolveBackupDir(file_sys::path dir,
+                                                   const PathFilter& filter) {
+  dir = NormalizeBackupDir(dir);
+  Manifest manifest;
+  if (!manifest.Open(ManifestPath(dir))) {
+    return ResolveNewest(dir.parent_path(), {dir.filename().string()}, filter);
+  }
+  std::vector<ResolvedEntry> resolved;
+  ForEachMatch(manifest, filter, [&](const ManifestEntry& entry) {
+    ResolvedEntry item;
+    item.path = std::string(manifest.Path(entry));
+    if ((entry.flags & kManifestDirectory) != 0) {
+      // В инкрементном бэкапе есть не все директории источника
+      if (manifest.Kind() != BackupKind::kFull &&
+          !file_sys::is_directory(dir / item.path)) {
+        return;
+      }
+      item.directory = true;
+      item.source = dir / item.path;
+    } else if ((entry.flags & kManifestDelta) != 0) {
+      // Патч применяется к копии из full backup, на который ссылается бэкап
+      item.source = dir / item.path;
+      item.source += kDeltaExtension;
+      item.base = dir.parent_path() / std::string(manifest.Base()) / item.path;
+      item.hash = entry.hash;
+    } else if ((entry.flags & kManifestStored) != 0) {
+      item.source = dir / item.path;
+      item.hash = entry.hash;
+    } else {
+      return;
+    }
+    resolved.push_back(std::move(item));
+  });
+  return resolved;
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "copy_backend.h"
+#include "delta.h"
+#include "journal.h"
+#include "manifest.h"
+
+namespace file_sys = std::filesystem;
+
+// Журнал контрольных точек бэкапа: пока бэкап не завершён, рядом с его
+// директорией лежит <имя бэкапа>.checkpoint со строками
+//
+//   H <режим> <база или -> <источник> — заголовок
+//   F <флаги> <размер> <время> <хеш> <путь> — файл готов
+//
+// Данные готового файла сбрасываются на диск потоком, который его
+// скопировал, а строки о готовых файлах дописываются пачками: перед записью
+// пачки сбрасываются записи директорий, где лежат файлы пачки, поэтому в
+// журнал попадают только файлы, которые переживут перезагрузку. Бэкап
+// завершается в таком порядке: манифест (он и есть отметка о завершении),
+// last_full.txt, удаление журнала. Если журнал остался, бэкап не завершён,
+// и его можно продолжить с --resume
+
+inline constexpr char kCheckpointExtension[] = ".checkpoint";
+
+// Путь к журналу контрольных точек бэкапа, лежащего в backup_dir
+inline file_sys::path CheckpointPath(const file_sys::path& backup_dir) {
+  return backup_dir.parent_path() /
+         (backup_dir.filename().string() + kCheckpointExtension);
+}
+
+// С чем был запущен бэкап: продолжить его можно только той же командой
+struct CheckpointHeader {
+  std::string option;
+  std::string base;
+  std::string source;
+};
+
+[[noreturn]] inline void ThrowCheckpointError(const file_sys::path& path,
+                                              int error) {
+  throw file_sys::filesystem_error(
+      "cannot write checkpoint", path,
+      std::error_code(error, std::generic_category()));
+}
+
+// Разбирает заголовок журнала. Возвращает false, если строка — не заголовок
+inline bool ParseCheckpointHeader(std::string_view line,
+                                  CheckpointHeader& header) {
+  size_t option_end = line.find(' ', 2);
+  size_t base_end = option_end == std::string_view::npos
+                        ? std::string_view::npos
+                        : line.find(' ', option_end + 1);
+  if (line.size() < 2 || line.compare(0, 2, "H ") != 0 ||
+      base_end == std::string_view::npos) {
+    return false;
+  }
+  header.option = std::string(line.substr(2, option_end - 2));
+  header.base =
+      std::string(line.substr(option_end + 1, base_end - option_end - 1));
+  if (header.base == "-") {
+    header.base.clear();
+  }
+  header.source = UnescapeJournalPath(line.substr(base_end + 1));
+  return true;
+}
+
+// Читает заголовок журнала бэкапа backup_dir
+inline CheckpointHeader ReadCheckpointHeader(const file_sys::path& backup_dir) {
+  file_sys::path path = CheckpointPath(backup_dir);
+  std::ifstream file(path);
+  std::string line;
+  CheckpointHeader header;
+  if (!std::getline(file, line) || !ParseCheckpointHeader(line, header)) {
+    throw std::runtime_error("Журнал контрольных точек " + path.string() +
+                             " повреждён\nУдалите директорию " +
+                             backup_dir.string() + " и повторите бэкап");
+  }
+  return header;
+}
+
+// Последний незавершённый бэкап в корне root или пустой путь, если таких
+// нет
+inline file_sys::path FindInterruptedBackup(const file_sys::path& root) {
+  file_sys::path found;
+  for (const auto& component : file_sys::directory_iterator(root)) {
+    const file_sys::path& path = component.path();
+    if (path.extension() != kCheckpointExtension) {
+      continue;
+    }
+    file_sys::path backup_dir = root / path.stem();
+    if (file_sys::is_directory(backup_dir) &&
+        (found.empty() || backup_dir.filename() > found.filename())) {
+      found = backup_dir;
+    }
+  }
+  return found;
+}
+
+// Журнал контрольных точек одного бэкапа. Если журнал уже есть, бэкап
+// продолжается: записанные файлы доступны через Completed. Done можно
+// вызывать из потоков копирования. Готовые файлы лежат в аренде с лимитом
+// memory_limit
+class Checkpoint {
+ public:
+  Checkpoint(const file_sys::path& backup_dir, const CheckpointHeader& header,
+             uint64_t memory_limit = 0)
+      : backup_dir_(backup_dir),
+        path_(CheckpointPath(backup_dir)),
+        arena_(memory_limit),
+        completed_(arena_) {
+    fd_.Reset(open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0644));
+    if (!fd_.IsValid()) {
+      ThrowCheckpointError(path_, errno);
+    }
+    std::string content;
+    std::vector<char> buffer(1 << 20);
+    ssize_t result;
+    while ((result = read(fd_.Get(), buffer.data(), buffer.size())) > 0) {
+      content.append(buffer.data(), result);
+    }
+    if (content.empty()) {
+      std::string line = "H " + header.option + ' ' +
+                         (header.base.empty() ? "-" : header.base) + ' ' +
+                         EscapeJournalPath(header.source) + '\n';
+      // Новые журнал и директория бэкапа должны пережить перезагрузку
+      int error = WriteAll(fd_.Get(), line.data(), line.size());
+      if (error == 0) {
+        error = SyncPath(path_.parent_path(), true);
+      }
+      if (error != 0) {
+        ThrowCheckpointError(path_, error);
+      }
+      return;
+    }
+    Load(content);
+  }
+
+  Checkpoint(const Checkpoint&) = delete;
+  Checkpoint& operator=(const Checkpoint&) = delete;
+
+  // Если бэкап прервался ошибкой, готовые файлы всё равно записываются
+  ~Checkpoint() {
+    if (fd_.IsValid()) {
+      try {
+        Flush();
+      } catch (...) {
+      }
+    }
+  }
+
+  // Запись о файле, готовом до прерывания, или nullptr
+  const ManifestEntry* Completed(std::string_view path) const {
+    // Ищется последняя запись о пути, она самая свежая
+    size_t low = 0;
+    size_t high = completed_.Size();
+    while (low < high) {
+      size_t middle = low + (high - low) / 2;
+      if (completed_[middle].path <= path) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    if (low == 0 || completed_[low - 1].path != path) {
+      return nullptr;
+    }
+    return &completed_[low - 1].entry;
+  }
+
+  // Отмечает файл готовым: его данные сразу сбрасываются на диск, а в
+  // журнал он попадает со следующей пачкой
+  void Done(std::string_view path, const ManifestEntry& entry) {
+    if ((entry.flags & (kManifestStored | kManifestDelta)) != 0) {
+      file_sys::path stored = backup_dir_ / path;
+      if ((entry.flags & kManifestDelta) != 0) {
+        stored += kDeltaExtension;
+      }
+      int error = SyncPath(stored, false);
+      if (error != 0) {
+        ThrowCheckpointError(stored, error);
+      }
+    }
+    std::ostringstream line;
+    line << "F " << entry.flags << ' ' << entry.size << ' ' << entry.mtime_ns
+         << ' ' << entry.hash << ' ' << EscapeJournalPath(path) << '\n';
+    bool flush = false;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      AddPendingDirectory(path.substr(0, ParentLength(path)));
+      pending_ += line.str();
+      ++pending_files_;
+      auto now = std::chrono::steady_clock::now();
+      if (pending_files_ >= kBatchFiles || now - last_flush_ >= kBatchTime) {
+        flush = true;
+        last_flush_ = now;
+      }
+    }
+    if (flush) {
+      Flush();
+    }
+  }
+
+  // Отмечает изменённой директорию бэкапа: её записи и записи её
+  // родителей сбросятся на диск со следующей пачкой
+  void DirectoryChanged(std::string_view path) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    AddPendingDirectory(path);
+  }
+
+  // Сбрасывает на диск изменённые директории и дописывает пачку готовых
+  // файлов. Пачку пишет поток копирования, который её заполнил
+  void Flush() {
+    std::string lines;
+    std::set<std::string> directories;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      lines.swap(pending_);
+      directories.swap(pending_directories_);
+      pending_files_ = 0;
+    }
+    // Порядок строк не важен, поэтому пачки пишутся под отдельной
+    // блокировкой, и другие потоки копирования могут отмечать файлы
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    for (const std::string& directory : directories) {
+      // Incremental backup создаёт только директории с изменёнными файлами
+      int error = SyncPath(backup_dir_ / directory, true);
+      if (error != 0 && error != ENOENT) {
+        ThrowCheckpointError(backup_dir_ / directory, error);
+      }
+    }
+    if (lines.empty()) {
+      return;
+    }
+    int error = WriteAll(fd_.Get(), lines.data(), lines.size());
+    if (error == 0 && fdatasync(fd_.Get()) != 0) {
+      error = errno;
+    }
+    if (error != 0) {
+      ThrowCheckpointError(path_, error);
+    }
+  }
+
+  // Бэкап завершён: журнал больше не нужен
+  void Remove() {
+    fd_.Reset();
+    file_sys::remove(path_);
+  }
+
+ private:
+  static constexpr size_t kBatchFiles = 4096;
+  static constexpr std::chrono::seconds kBatchTime{1};
+
+  // Длина пути родительской директории, для файла в корне бэкапа — 0
+  static size_t ParentLength(std::string_view path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string_view::npos ? 0 : slash;
+  }
+
+  // Добавляет директорию и её родителей в пачку. Если директория уже в
+  // пачке, её родители тоже там. Вызывается под pending_mutex_
+  void AddPendingDirectory(std::string_view path) {
+    while (pending_directories_.emplace(path).second && !path.empty()) {
+      path = path.substr(0, ParentLength(path));
+    }
+  }
+
+  // Загружает готовые файлы прерванного бэкапа. Недописанная последняя
+  // строка отбрасывается
+  void Load(const std::string& content) {
+    size_t begin = content.find('\n') + 1;
+    size_t complete = begin;
+    while (begin < content.size()) {
+      size_t end = content.find('\n', begin);
+      if (end == std::string::npos) {
+        break;
+      }
+      std::istringstream line(content.substr(begin, end - begin));
+      char kind = 0;
+      ManifestEntry entry{};
+      line >> kind >> entry.flags >> entry.size >> entry.mtime_ns >>
+          entry.hash;
+      line.get();
+      std::string path;
+      std::getline(line, path);
+      if (kind == 'F' && line) {
+        completed_.PushBack({arena_.Copy(UnescapeJournalPath(path)),
+                             completed_.Size(), entry});
+      }
+      begin = end + 1;
+      complete = begin;
+    }
+    // Строки пишутся в порядке готовности, поиск идёт по отсортированным
+    std::sort(completed_.begin(), completed_.end(),
+              [](const CompletedFile& lhs, const CompletedFile& rhs) {
+                return lhs.path != rhs.path ? lhs.path < rhs.path
+                                            : lhs.order < rhs.order;
+              });
+    if (complete < content.size() && ftruncate(fd_.Get(), complete) != 0) {
+      ThrowCheckpointError(path_, errno);
+    }
+  }
+
+  struct CompletedFile {
+    std::string_view path;
+    size_t order;  // номер строки: файл мог быть скопирован повторно
+    ManifestEntry entry;
+  };
+
+  file_sys::path backup_dir_;
+  file_sys::path path_;
+  FileDescriptor fd_;
+  Arena arena_;
+  ArenaVector<CompletedFile> completed_;
+  std::mutex pending_mutex_;
+  std::string pending_;
+  std::set<std::string> pending_directories_;
+  size_t pending_files_ = 0;
+  std::chrono::steady_clock::time_point last_flush_ =
+      std::chrono::steady_clock::now();
+  std::mutex write_mutex_;
+};
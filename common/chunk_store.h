@@ -0,0 +1,245 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "copy_backend.h"
+#include "sha256.h"
+
+namespace file_sys = std::filesystem;
+
+// Хранилище дедупликации:
+//   <корень>/chunks/ab/abcdef...  — уникальные блоки, имя — SHA-256 блока
+//   <корень>/snapshots/<время>.snapshot — списки ссылок на блоки
+
+using ChunkHash = Sha256::Digest;
+
+struct SnapshotChunk {
+  ChunkHash hash;
+  uint32_t size;
+};
+
+// Запись снимка: директория или файл со списком блоков
+struct SnapshotRecord {
+  std::string path;
+  bool directory = false;
+  uint32_t mode = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  std::vector<SnapshotChunk> chunks;
+};
+
+class ChunkStore {
+ public:
+  explicit ChunkStore(file_sys::path root) : root_(std::move(root)) {}
+
+  const file_sys::path& Root() const { return root_; }
+
+  file_sys::path ChunkPath(const ChunkHash& hash) const {
+    std::string hex = ToHex(hash);
+    return root_ / hex.substr(0, 2) / hex;
+  }
+
+  // Сохраняет блок, если его ещё нет. Возвращает true для нового блока.
+  // Блок пишется во временный файл, сбрасывается на диск и только потом
+  // переименовывается, поэтому параллельная запись одинаковых блоков, в том
+  // числе из разных процессов, безопасна. Блок другого размера — остаток
+  // сбоя до этой проверки — перезаписывается
+  bool Put(const ChunkHash& hash, const uint8_t* data, size_t size) {
+    file_sys::path chunk_path = ChunkPath(hash);
+    struct stat chunk_stat;
+    if (stat(chunk_path.c_str(), &chunk_stat) == 0 &&
+        static_cast<uint64_t>(chunk_stat.st_size) == size) {
+      return false;
+    }
+    file_sys::create_directories(chunk_path.parent_path());
+
+    file_sys::path temp_path = chunk_path;
+    temp_path += ".tmp." + std::to_string(getpid()) + '.' +
+                 std::to_string(gettid());
+    FileDescriptor fd(
+        open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd.IsValid()) {
+      ThrowCopyError(temp_path, chunk_path, errno);
+    }
+    int error = WriteAll(fd.Get(), data, size);
+    if (error == 0 && fdatasync(fd.Get()) != 0) {
+      error = errno;
+    }
+    if (error != 0) {
+      ThrowCopyError(temp_path, chunk_path, error);
+    }
+    fd.Reset();
+    file_sys::rename(temp_path, chunk_path);
+    changed_[hash[0]].store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Сбрасывает на диск записи директорий, в которые попали новые блоки,
+  // и корня хранилища. Вызывается перед записью снимка, который на них
+  // ссылается
+  void Sync() {
+    std::vector<file_sys::path> dirs;
+    for (size_t i = 0; i < changed_.size(); ++i) {
+      if (changed_[i].exchange(false)) {
+        ChunkHash hash{};
+        hash[0] = static_cast<uint8_t>(i);
+        dirs.push_back(ChunkPath(hash).parent_path());
+      }
+    }
+    if (dirs.empty()) {
+      return;
+    }
+    dirs.push_back(root_);
+    for (const file_sys::path& dir : dirs) {
+      int error = SyncPath(dir, true);
+      if (error != 0) {
+        ThrowCopyError(dir, dir, error);
+      }
+    }
+  }
+
+  // Читает блок и проверяет, что его содержимое совпадает с адресом
+  std::vector<uint8_t> Get(const SnapshotChunk& chunk) const {
+    file_sys::path chunk_path = ChunkPath(chunk.hash);
+    std::vector<uint8_t> data(chunk.size);
+    std::ifstream file(chunk_path, std::ios::binary);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!file || file.peek() != std::ifstream::traits_type::eof() ||
+        Sha256::Hash(data.data(), data.size()) != chunk.hash) {
+      throw std::runtime_error("Блок " + chunk_path.string() +
+                               " отсутствует или повреждён\nВосстановите "
+                               "хранилище блоков из другой копии");
+    }
+    return data;
+  }
+
+ private:
+  file_sys::path root_;
+  // Директории по первому байту хеша, в которых появились новые блоки
+  std::array<std::atomic<bool>, 256> changed_{};
+};
+
+inline constexpr char kSnapshotMagic[8] = {'B', 'R', 'S', 'N',
+                                           'A', 'P', '0', '1'};
+
+// Записывает снимок, отсортированный по пути, атомарно через временный файл
+inline void WriteSnapshot(const file_sys::path& snapshot_path,
+                          std::vector<SnapshotRecord>& records) {
+  std::sort(records.begin(), records.end(),
+            [](const SnapshotRecord& lhs, const SnapshotRecord& rhs) {
+              return lhs.path < rhs.path;
+            });
+  file_sys::path temp_path = snapshot_path;
+  temp_path += ".tmp";
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  auto put = [&file](const auto& value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  file.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+  put(static_cast<uint64_t>(records.size()));
+  for (const SnapshotRecord& record : records) {
+    put(static_cast<uint8_t>(record.directory));
+    put(record.mode);
+    put(record.size);
+    put(record.mtime_ns);
+    put(static_cast<uint32_t>(record.path.size()));
+    file.write(record.path.data(), record.path.size());
+    put(static_cast<uint32_t>(record.chunks.size()));
+    for (const SnapshotChunk& chunk : record.chunks) {
+      file.write(reinterpret_cast<const char*>(chunk.hash.data()),
+                 chunk.hash.size());
+      put(chunk.size);
+    }
+  }
+  file.close();
+  if (!file) {
+    throw std::runtime_error(
+        "Не удалось записать снимок " + snapshot_path.string() +
+        "\nПроверьте свободное место и права на директорию для бэкапа");
+  }
+  int error = SyncPath(temp_path, false);
+  if (error == 0) {
+    file_sys::rename(temp_path, snapshot_path);
+    error = SyncPath(snapshot_path.parent_path(), true);
+  }
+  if (error != 0) {
+    ThrowCopyError(temp_path, snapshot_path, error);
+  }
+}
+
+// Проверяет, что файл является снимком хранилища дедупликации
+inline bool IsSnapshotFile(const file_sys::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(kSnapshotMagic)];
+  file.read(magic, sizeof(magic));
+  return file && std::memcmp(magic, kSnapshotMagic, sizeof(magic)) == 0;
+}
+
+inline std::vector<SnapshotRecord> ReadSnapshot(
+    const file_sys::path& snapshot_path) {
+  std::ifstream file(snapshot_path, std::ios::binary);
+  auto get = [&file](auto& value) {
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+  };
+  auto corrupted = [&snapshot_path]() {
+    return std::runtime_error("Снимок " + snapshot_path.string() +
+                              " повреждён\nВыберите другой снимок");
+  };
+
+  char magic[sizeof(kSnapshotMagic)];
+  file.read(magic, sizeof(magic));
+  uint64_t count = 0;
+  get(count);
+  if (!file || std::memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0) {
+    throw corrupted();
+  }
+  std::vector<SnapshotRecord> records;
+  for (uint64_t i = 0; i < count; ++i) {
+    SnapshotRecord record;
+    uint8_t directory = 0;
+    uint32_t path_size = 0;
+    uint32_t chunk_count = 0;
+    get(directory);
+    get(record.mode);
+    get(record.size);
+    get(record.mtime_ns);
+    get(path_size);
+    if (!file || path_size > PATH_MAX) {
+      throw corrupted();
+    }
+    record.directory = directory != 0;
+    record.path.resize(path_size);
+    file.read(record.path.data(), path_size);
+    get(chunk_count);
+    if (!file) {
+      throw corrupted();
+    }
+    for (uint32_t j = 0; j < chunk_count; ++j) {
+      SnapshotChunk chunk;
+      file.read(reinterpret_cast<char*>(chunk.hash.data()), chunk.hash.size());
+      get(chunk.size);
+      if (!file) {
+        throw corrupted();
+      }
+      record.chunks.push_back(chunk);
+    }
+    records.push_back(std::move(record));
+  }
+  return records;
+}
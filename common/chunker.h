@@ -0,0 +1,123 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "throttle.h"
+
+// Разбиение на блоки по содержимому алгоритмом FastCDC (gear-хеш с
+// нормализацией размера). Границы блоков зависят только от соседних байт,
+// поэтому вставка в середину файла меняет лишь пару блоков вокруг неё
+
+// Таблица gear-хеша: 256 псевдослучайных чисел, одинаковых при каждой сборке
+constexpr std::array<uint64_t, 256> MakeGearTable() {
+  std::array<uint64_t, 256> table{};
+  uint64_t state = 0x6a09e667f3bcc908ull;
+  for (auto& value : table) {
+    state += 0x9e3779b97f4a7c15ull;
+    uint64_t mixed = state;
+    mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ull;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebull;
+    value = mixed ^ (mixed >> 31);
+  }
+  return table;
+}
+
+inline constexpr std::array<uint64_t, 256> kGearTable = MakeGearTable();
+
+struct ChunkerLimits {
+  size_t min_size = 16 * 1024;
+  size_t average_size = 64 * 1024;
+  size_t max_size = 256 * 1024;
+};
+
+// Маска из старших бит: в них gear-хеш накапливает влияние последних байт
+constexpr uint64_t TopBitsMask(int bits) {
+  return bits == 0 ? 0 : ~0ull << (64 - bits);
+}
+
+constexpr int Log2(size_t value) {
+  int bits = 0;
+  while (value > 1) {
+    value >>= 1;
+    ++bits;
+  }
+  return bits;
+}
+
+// Длина первого блока в data[0, size)
+inline size_t FindChunkBoundary(const uint8_t* data, size_t size,
+                                const ChunkerLimits& limits) {
+  if (size <= limits.min_size) {
+    return size;
+  }
+  if (size > limits.max_size) {
+    size = limits.max_size;
+  }
+  size_t normal_size = std::min(limits.average_size, size);
+  int bits = Log2(limits.average_size);
+  // До среднего размера граница ставится реже, после — чаще
+  uint64_t small_mask = TopBitsMask(bits + 2);
+  uint64_t large_mask = TopBitsMask(bits - 2);
+
+  uint64_t hash = 0;
+  size_t i = limits.min_size;
+  for (; i < normal_size; ++i) {
+    hash = (hash << 1) + kGearTable[data[i]];
+    if ((hash & small_mask) == 0) {
+      return i + 1;
+    }
+  }
+  for (; i < size; ++i) {
+    hash = (hash << 1) + kGearTable[data[i]];
+    if ((hash & large_mask) == 0) {
+      return i + 1;
+    }
+  }
+  return size;
+}
+
+// Читает файл потоком и передаёт обработчику блоки. Памяти требуется
+// не больше двух максимальных блоков. Возвращает 0 или код ошибки чтения
+template <typename Handler>
+int ChunkFile(int fd, const ChunkerLimits& limits, Handler&& handler) {
+  std::vector<uint8_t> buffer(limits.max_size * 2);
+  size_t begin = 0;
+  size_t end = 0;
+  bool eof = false;
+  while (true) {
+    if (!eof && end - begin < limits.max_size) {
+      std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+      while (!eof && end < buffer.size()) {
+        ThrottledIo io(buffer.size() - end);
+        ssize_t result = read(fd, buffer.data() + end, buffer.size() - end);
+        if (result < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return errno;
+        }
+        if (result == 0) {
+          eof = true;
+        }
+        end += result;
+      }
+    }
+    if (begin == end) {
+      return 0;
+    }
+    size_t length =
+        FindChunkBoundary(buffer.data() + begin, end - begin, limits);
+    handler(buffer.data() + begin, length);
+    begin += length;
+  }
+}
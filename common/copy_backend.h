@@ -0,0 +1,616 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include "metrics.h"
+#include "throttle.h"
+#include "xxhash.h"
+
+namespace file_sys = std::filesystem;
+
+// Способ, которым были скопированы данные файла
+enum class CopyStrategy {
+  kReflink,        // FICLONE: общие блоки на btrfs/xfs, данные не копируются
+  kCopyFileRange,  // copy_file_range: копирование внутри ядра
+  kSendfile,       // sendfile: копирование внутри ядра через page cache
+  kReadWrite,      // обычный цикл read/write через буфер
+  kIoUring,        // read/write пачками через io_uring
+  kSparse,         // только участки с данными, дыры сохраняются
+  kDelta,          // патч к копии из full backup или сборка файла по патчу
+  kDirect,         // O_DIRECT: крупные блоки мимо page cache
+};
+
+inline constexpr size_t kCopyStrategyCount = 8;
+
+inline const char* CopyStrategyName(CopyStrategy strategy) {
+  switch (strategy) {
+    case CopyStrategy::kReflink:
+      return "reflink";
+    case CopyStrategy::kCopyFileRange:
+      return "copy_file_range";
+    case CopyStrategy::kSendfile:
+      return "sendfile";
+    case CopyStrategy::kReadWrite:
+      return "read_write";
+    case CopyStrategy::kIoUring:
+      return "io_uring";
+    case CopyStrategy::kSparse:
+      return "sparse";
+    case CopyStrategy::kDelta:
+      return "delta";
+    case CopyStrategy::kDirect:
+      return "direct";
+  }
+  return "unknown";
+}
+
+// Закрывает дескриптор при выходе из области видимости
+class FileDescriptor {
+ public:
+  explicit FileDescriptor(int fd = -1) : fd_(fd) {}
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+  FileDescriptor(FileDescriptor&& other) noexcept : fd_(other.fd_) {
+    other.fd_ = -1;
+  }
+  FileDescriptor& operator=(FileDescriptor&& other) noexcept {
+    if (this != &other) {
+      Reset(other.fd_);
+      other.fd_ = -1;
+    }
+    return *this;
+  }
+  ~FileDescriptor() { Reset(); }
+
+  int Get() const { return fd_; }
+  bool IsValid() const { return fd_ >= 0; }
+  void Reset(int fd = -1) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = fd;
+  }
+
+ private:
+  int fd_;
+};
+
+// Ошибка копирования в том же виде, что и у std::filesystem::copy_file
+[[noreturn]] inline void ThrowCopyError(const file_sys::path& from,
+                                        const file_sys::path& to, int error) {
+  throw file_sys::filesystem_error(
+      "cannot copy file", from, to,
+      std::error_code(error, std::generic_category()));
+}
+
+// Расширение временного файла копии до переименования в готовый
+inline constexpr char kPartialExtension[] = ".brpart";
+
+// Путь временного файла, в который пишется копия to
+inline file_sys::path PartialPath(const file_sys::path& to) {
+  file_sys::path partial = to;
+  partial += kPartialExtension;
+  return partial;
+}
+
+// Сбрасывает на диск данные файла или записи директории. Возвращает 0 или
+// код ошибки
+inline int SyncPath(const file_sys::path& path, bool directory) {
+  FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC |
+                                           (directory ? O_DIRECTORY : 0)));
+  if (!fd.IsValid()) {
+    return errno;
+  }
+  int result = directory ? fsync(fd.Get()) : fdatasync(fd.Get());
+  return result == 0 ? 0 : errno;
+}
+
+// Ошибки, после которых имеет смысл попробовать следующий способ копирования
+inline bool IsUnsupportedCopy(int error) {
+  return error == ENOSYS || error == EXDEV || error == EINVAL ||
+         error == EOPNOTSUPP || error == ENOTTY || error == EBADF ||
+         error == EPERM;
+}
+
+// Цикл copy_file_range. Возвращает 0 или код ошибки
+inline int CopyWithCopyFileRange(int src, int dst, off_t size, off_t& copied) {
+  while (copied < size) {
+    off_t in_offset = copied;
+    off_t out_offset = copied;
+    size_t want = Throttle().Chunk(size - copied);
+    ThrottledIo io(want);
+    ssize_t result =
+        copy_file_range(src, &in_offset, dst, &out_offset, want, 0);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (result == 0) {
+      break;
+    }
+    copied += result;
+    CountMetric(Metric::kBytesCopied, result);
+  }
+  return 0;
+}
+
+// Цикл sendfile. Возвращает 0 или код ошибки
+inline int CopyWithSendfile(int src, int dst, off_t size, off_t& copied) {
+  if (lseek(dst, copied, SEEK_SET) < 0) {
+    return errno;
+  }
+  while (copied < size) {
+    off_t offset = copied;
+    size_t want = Throttle().Chunk(size - copied);
+    ThrottledIo io(want);
+    ssize_t result = sendfile(dst, src, &offset, want);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (result == 0) {
+      break;
+    }
+    copied += result;
+    CountMetric(Metric::kBytesCopied, result);
+  }
+  return 0;
+}
+
+// Записывает буфер целиком. Возвращает 0 или код ошибки
+inline int WriteAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t result = write(fd, bytes, size);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    bytes += result;
+    size -= result;
+  }
+  return 0;
+}
+
+// Обычное копирование через буфер в пользовательском пространстве до
+// смещения end или до конца файла. Возвращает 0 или код ошибки
+inline int CopyWithReadWrite(int src, int dst, off_t& copied,
+                             off_t end = std::numeric_limits<off_t>::max()) {
+  std::vector<char> buffer(1 << 20);
+  while (copied < end) {
+    size_t want = std::min<off_t>(buffer.size(), end - copied);
+    ThrottledIo io(want);
+    ssize_t read_bytes = pread(src, buffer.data(), want, copied);
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (read_bytes == 0) {
+      return 0;
+    }
+    ssize_t written = 0;
+    while (written < read_bytes) {
+      ssize_t result = pwrite(dst, buffer.data() + written,
+                              read_bytes - written, copied + written);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      written += result;
+    }
+    copied += read_bytes;
+    CountMetric(Metric::kBytesCopied, read_bytes);
+  }
+  return 0;
+}
+
+// Файлы меньше этого размера не резервируются: их блоки и так выделяются
+// одним куском, когда страницы сбрасываются на диск
+inline constexpr off_t kPreallocateMin = 1 << 20;
+
+// Резервирует место под весь файл до записи данных, чтобы большой файл
+// лёг на диск непрерывно, а не кусками по мере сброса страниц. Размер
+// файла не меняется. Если файловая система не умеет fallocate, файл
+// пишется как обычно, а нехватка места проявится при записи
+inline void PreallocateFile(int fd, off_t size) {
+  if (size >= kPreallocateMin) {
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+  }
+}
+
+// Выравнивание буфера, смещений и размеров запросов для O_DIRECT: подходит
+// дискам и с блоком 512 байт, и с блоком 4 КиБ
+inline constexpr size_t kDirectAlignment = 4096;
+// Без page cache нет упреждающего чтения, поэтому запросы крупные: диск
+// не простаивает между ними
+inline constexpr size_t kDirectBufferSize = 8 << 20;
+// Мелкие файлы идут через page cache: им O_DIRECT только добавил бы
+// синхронную запись на каждый файл
+inline constexpr off_t kDirectMinSize = 1 << 20;
+
+// Включает или выключает O_DIRECT на открытом дескрипторе. Возвращает 0
+// или код ошибки; EINVAL — файловая система не поддерживает O_DIRECT
+inline int SetDirectIo(int fd, bool enable) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    return errno;
+  }
+  flags = enable ? flags | O_DIRECT : flags & ~O_DIRECT;
+  return fcntl(fd, F_SETFL, flags) == 0 ? 0 : errno;
+}
+
+// Копирование мимо page cache: большой файл не вытесняет из памяти кеш
+// работающих рядом сервисов, а запись идёт крупными блоками через
+// выровненный буфер. Последний неполный блок пишется целиком, дополненный
+// нулями, и лишнее обрезает ftruncate. Возвращает 0 или код ошибки
+inline int CopyWithDirectIo(int src, int dst, off_t size) {
+  std::unique_ptr<char, decltype(&std::free)> buffer(
+      static_cast<char*>(std::aligned_alloc(kDirectAlignment,
+                                            kDirectBufferSize)),
+      &std::free);
+  if (buffer == nullptr) {
+    return ENOMEM;
+  }
+  int error = SetDirectIo(src, true);
+  if (error == 0) {
+    error = SetDirectIo(dst, true);
+  }
+  off_t copied = 0;
+  while (error == 0 && copied < size) {
+    size_t want = Throttle().Chunk(kDirectBufferSize);
+    ThrottledIo io(want);
+    ssize_t read_bytes = pread(src, buffer.get(), want, copied);
+    if (read_bytes < 0) {
+      error = errno == EINTR ? 0 : errno;
+      continue;
+    }
+    if (read_bytes == 0) {
+      break;
+    }
+    // Неполное чтение посреди файла (FUSE, сетевая файловая система):
+    // пишется выровненная часть, остальное читается заново. Дополняется
+    // нулями только последний блок файла или файла, который укоротился
+    size_t padded = read_bytes & ~(kDirectAlignment - 1);
+    bool last = copied + read_bytes >= size || padded == 0;
+    if (last) {
+      padded = (read_bytes + kDirectAlignment - 1) & ~(kDirectAlignment - 1);
+      std::memset(buffer.get() + read_bytes, 0, padded - read_bytes);
+    }
+    size_t written = 0;
+    while (error == 0 && written < padded) {
+      ssize_t result = pwrite(dst, buffer.get() + written, padded - written,
+                              copied + written);
+      if (result < 0) {
+        error = errno == EINTR ? 0 : errno;
+        continue;
+      }
+      written += result;
+    }
+    if (error != 0) {
+      break;
+    }
+    size_t done = last ? read_bytes : padded;
+    copied += done;
+    CountMetric(Metric::kBytesCopied, done);
+    if (last) {
+      break;
+    }
+  }
+  if (error == 0 && ftruncate(dst, copied) != 0) {
+    error = errno;
+  }
+  return error;
+}
+
+// Есть ли в файле дыры: выделено меньше места, чем его размер
+inline bool IsSparse(uint64_t size, uint64_t blocks) {
+  return blocks * 512 < size;
+}
+
+// Копирует только участки с данными, найденные через SEEK_DATA/SEEK_HOLE,
+// а размер выставляет ftruncate, поэтому дыры остаются дырами и не
+// читаются. Возвращает 0 или код ошибки; EINVAL — файловая система не
+// умеет искать дыры
+inline int CopySparseData(int src, int dst, off_t size) {
+  off_t data = 0;
+  while (data < size) {
+    data = lseek(src, data, SEEK_DATA);
+    if (data < 0) {
+      // ENXIO: дальше до конца файла только дыра
+      if (errno == ENXIO) {
+        break;
+      }
+      return errno;
+    }
+    off_t hole = lseek(src, data, SEEK_HOLE);
+    if (hole < 0) {
+      return errno;
+    }
+    hole = std::min(hole, size);
+    off_t copied = data;
+    int error = CopyWithCopyFileRange(src, dst, hole, copied);
+    if (error != 0 && IsUnsupportedCopy(error)) {
+      error = CopyWithReadWrite(src, dst, copied, hole);
+    }
+    if (error != 0) {
+      return error;
+    }
+    data = hole;
+  }
+  if (ftruncate(dst, size) != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+// Запись файла с пропуском блоков из одних нулей: на их месте остаются
+// дыры. Используется там, где данные проходят через память: копирование с
+// хешированием и восстановление из снимка или архива
+class SparseWriter {
+ public:
+  explicit SparseWriter(int fd) : fd_(fd) {}
+
+  // Пишет буфер с текущего смещения. Возвращает 0 или код ошибки
+  int Write(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    size_t begin = 0;
+    while (begin < size) {
+      // Пропускаем нулевые блоки, затем пишем подряд идущие ненулевые
+      size_t block = std::min(kBlockSize, size - begin);
+      if (IsZero(bytes + begin, block)) {
+        begin += block;
+        continue;
+      }
+      size_t end = begin + block;
+      while (end < size) {
+        size_t next = std::min(kBlockSize, size - end);
+        if (IsZero(bytes + end, next)) {
+          break;
+        }
+        end += next;
+      }
+      int error = WriteAt(bytes + begin, end - begin, offset_ + begin);
+      if (error != 0) {
+        return error;
+      }
+      begin = end;
+    }
+    offset_ += size;
+    return 0;
+  }
+
+  // Выставляет размер файла: хвостовая дыра тоже должна войти в размер
+  int Finish() { return ftruncate(fd_, offset_) == 0 ? 0 : errno; }
+
+ private:
+  static constexpr size_t kBlockSize = 4096;
+
+  static bool IsZero(const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      if (data[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int WriteAt(const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+      ssize_t result = pwrite(fd_, data, size, offset);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      data += result;
+      size -= result;
+      offset += result;
+    }
+    return 0;
+  }
+
+  int fd_;
+  off_t offset_ = 0;
+};
+
+// Открывает исходный файл и создаёт файл назначения с теми же правами.
+// Возвращает stat исходного файла
+inline struct stat OpenCopyFiles(const file_sys::path& from,
+                                 const file_sys::path& to, bool overwrite,
+                                 FileDescriptor& src, FileDescriptor& dst) {
+  src.Reset(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!src.IsValid()) {
+    ThrowCopyError(from, to, errno);
+  }
+  struct stat src_stat;
+  if (fstat(src.Get(), &src_stat) != 0) {
+    ThrowCopyError(from, to, errno);
+  }
+  if (!S_ISREG(src_stat.st_mode)) {
+    ThrowCopyError(from, to, EINVAL);
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  flags |= overwrite ? O_TRUNC : O_EXCL;
+  dst.Reset(open(to.c_str(), flags, src_stat.st_mode & 07777));
+  if (!dst.IsValid()) {
+    ThrowCopyError(from, to, errno);
+  }
+  if (fchmod(dst.Get(), src_stat.st_mode & 07777) != 0) {
+    ThrowCopyError(from, to, errno);
+  }
+  return src_stat;
+}
+
+// Копирует файл, начиная с самого дешёвого способа: reflink, затем
+// copy_file_range, sendfile и, наконец, обычный read/write. Права доступа
+// переносятся так же, как в std::filesystem::copy_file
+inline CopyStrategy CopyFileData(const file_sys::path& from,
+                                 const file_sys::path& to, bool overwrite,
+                                 bool direct = false) {
+  FileDescriptor src;
+  FileDescriptor dst;
+  struct stat src_stat = OpenCopyFiles(from, to, overwrite, src, dst);
+
+  {
+    // reflink не читает и не пишет данные, но это тоже операция
+    ThrottledIo io(0);
+    if (ioctl(dst.Get(), FICLONE, src.Get()) == 0) {
+      CountMetric(Metric::kBytesCopied, src_stat.st_size);
+      return CopyStrategy::kReflink;
+    }
+  }
+
+  if (IsSparse(src_stat.st_size, src_stat.st_blocks)) {
+    int error = CopySparseData(src.Get(), dst.Get(), src_stat.st_size);
+    if (error == 0) {
+      return CopyStrategy::kSparse;
+    }
+    if (!IsUnsupportedCopy(error)) {
+      ThrowCopyError(from, to, error);
+    }
+  }
+
+  PreallocateFile(dst.Get(), src_stat.st_size);
+  if (direct && src_stat.st_size >= kDirectMinSize) {
+    int error = CopyWithDirectIo(src.Get(), dst.Get(), src_stat.st_size);
+    if (error == 0) {
+      return CopyStrategy::kDirect;
+    }
+    // Файловая система без O_DIRECT или с более крупным блоком: файл
+    // копируется заново обычными способами
+    if (error != EINVAL || SetDirectIo(src.Get(), false) != 0 ||
+        SetDirectIo(dst.Get(), false) != 0 || ftruncate(dst.Get(), 0) != 0) {
+      ThrowCopyError(from, to, error);
+    }
+  }
+
+  // Каждый следующий способ продолжает с того места, где остановился
+  // предыдущий, поэтому уже скопированные данные не копируются повторно
+  off_t copied = 0;
+  int error = CopyWithCopyFileRange(src.Get(), dst.Get(), src_stat.st_size,
+                                    copied);
+  if (error == 0) {
+    return CopyStrategy::kCopyFileRange;
+  }
+  if (!IsUnsupportedCopy(error)) {
+    ThrowCopyError(from, to, error);
+  }
+  error = CopyWithSendfile(src.Get(), dst.Get(), src_stat.st_size, copied);
+  if (error == 0) {
+    return CopyStrategy::kSendfile;
+  }
+  if (!IsUnsupportedCopy(error)) {
+    ThrowCopyError(from, to, error);
+  }
+  error = CopyWithReadWrite(src.Get(), dst.Get(), copied);
+  if (error != 0) {
+    ThrowCopyError(from, to, error);
+  }
+  return CopyStrategy::kReadWrite;
+}
+
+// Читает файл блоками и передаёт каждый блок обработчику. Ядру сообщается о
+// последовательном чтении: упреждающее чтение следующих блоков идёт, пока
+// обрабатывается текущий. Возвращает 0 или код ошибки
+template <typename Handler>
+int ReadFileBlocks(int fd, Handler&& handler) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::vector<char> buffer(1 << 20);
+  off_t offset = 0;
+  while (true) {
+    ssize_t result;
+    int error = 0;
+    {
+      ThrottledIo io(buffer.size());
+      result = pread(fd, buffer.data(), buffer.size(), offset);
+      error = result < 0 ? errno : 0;
+    }
+    if (error == EINTR) {
+      continue;
+    }
+    if (error != 0) {
+      return error;
+    }
+    if (result == 0) {
+      return 0;
+    }
+    error = handler(buffer.data(), static_cast<size_t>(result));
+    if (error != 0) {
+      return error;
+    }
+    offset += result;
+  }
+}
+
+// Хеш содержимого файла для манифеста
+inline uint64_t HashFile(const file_sys::path& path) {
+  FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd.IsValid()) {
+    ThrowCopyError(path, path, errno);
+  }
+  Xxh64 hasher;
+  int error = ReadFileBlocks(fd.Get(), [&](const char* data, size_t size) {
+    hasher.Update(data, size);
+    return 0;
+  });
+  if (error != 0) {
+    ThrowCopyError(path, path, error);
+  }
+  return ContentHash(hasher);
+}
+
+// Копирует файл через буфер и хеширует тот же буфер, поэтому данные
+// читаются с диска один раз. reflink и копирование внутри ядра здесь не
+// подходят: данные должны пройти через память процесса
+inline uint64_t CopyFileDataHashed(const file_sys::path& from,
+                                   const file_sys::path& to, bool overwrite) {
+  FileDescriptor src;
+  FileDescriptor dst;
+  struct stat src_stat = OpenCopyFiles(from, to, overwrite, src, dst);
+  // Нулевые блоки файла с дырами не пишутся, чтобы копия тоже была с дырами
+  bool sparse = IsSparse(src_stat.st_size, src_stat.st_blocks);
+  if (!sparse) {
+    PreallocateFile(dst.Get(), src_stat.st_size);
+  }
+  SparseWriter writer(dst.Get());
+  Xxh64 hasher;
+  int error = ReadFileBlocks(src.Get(), [&](const char* data, size_t size) {
+    hasher.Update(data, size);
+    CountMetric(Metric::kBytesCopied, size);
+    return sparse ? writer.Write(data, size) : WriteAll(dst.Get(), data, size);
+  });
+  if (error == 0 && sparse) {
+    error = writer.Finish();
+  }
+  if (error != 0) {
+    ThrowCopyError(from, to, error);
+  }
+  return ContentHash(hasher);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "copy_backend.h"
+#include "delta.h"
+#include "io_uring.h"
+#include "metrics.h"
+#include "options.h"
+#include "thread_pool.h"
+#include "uring_copier.h"
+
+namespace file_sys = std::filesystem;
+
+// Общий движок копирования для my_backup и my_restore. Обход дерева ведёт
+// вызывающий код: директории создаются сразу, в потоке обхода, поэтому они
+// всегда появляются раньше вложенных файлов, а копирование файлов уходит в
+// пул потоков. С --io-uring директории и файлы копятся до Wait и выполняются
+// там одним потоком через кольцо io_uring
+class CopyEngine {
+ public:
+  explicit CopyEngine(const Options& options)
+      : report_(options.copy_report),
+        direct_(options.direct),
+        pool_(JobsCount(options)) {
+    // На старых ядрах io_uring или нужных операций нет: тогда файлы
+    // копируются пулом потоков, как без --io-uring
+    if (options.io_uring &&
+        ring_.Init(options.queue_depth,
+                   {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+                    IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_MKDIRAT})) {
+      uring_ = std::make_unique<UringCopier>(
+          ring_, [this](CopyStrategy strategy, const file_sys::path& to) {
+            // В отчёт попадает имя готового файла, а не временного
+            CountCopy(strategy,
+                      atomic_ ? file_sys::path(to).replace_extension() : to);
+          });
+    }
+  }
+
+  // Создаёт директорию вместе с недостающими родителями. С io_uring
+  // директории создаются пачкой в Wait, раньше всех файлов
+  void CreateDirectory(const file_sys::path& path) {
+    if (uring_ != nullptr) {
+      uring_->AddDirectory(path);
+      return;
+    }
+    file_sys::create_directories(path);
+  }
+
+  // Файлы и патчи пишутся во временный файл рядом и переименовываются,
+  // только когда записаны целиком: под готовым именем никогда не лежит
+  // недописанная копия. Существующая копия при этом заменяется
+  void EnableAtomicWrites() { atomic_ = true; }
+
+  // Ставит копирование файла в очередь. Если передан hash, файл копируется
+  // через буфер, а хеш содержимого записывается по этому указателю. done,
+  // если передан, вызывается из потока копирования, когда файл готов
+  void CopyFile(file_sys::path from, file_sys::path to,
+                file_sys::copy_options copy_options, uint64_t* hash = nullptr,
+                std::function<void()> done = nullptr) {
+    bool overwrite = (copy_options & file_sys::copy_options::overwrite_existing) !=
+                     file_sys::copy_options::none;
+    if (uring_ != nullptr) {
+      if (atomic_) {
+        file_sys::path partial = PartialPath(to);
+        done = [to = std::move(to), partial, done = std::move(done)]() {
+          file_sys::rename(partial, to);
+          if (done) {
+            done();
+          }
+        };
+        to = std::move(partial);
+        overwrite = true;
+      }
+      uring_->AddFile(std::move(from), std::move(to), overwrite, hash,
+                      std::move(done));
+      if (uring_->PendingFiles() >= kMaxQueued) {
+        uring_->Run();
+      }
+      return;
+    }
+    pool_.WaitPending(kMaxQueued);
+    pool_.Submit([this, from = std::move(from), to = std::move(to), overwrite,
+                  hash, done = std::move(done)]() {
+      CopyFileNow(from, to, overwrite, hash);
+      if (done) {
+        done();
+      }
+    });
+  }
+
+  // Ставит в очередь произвольную работу, например проверку хеша перед
+  // копированием
+  void Submit(std::function<void()> task) {
+    pool_.WaitPending(kMaxQueued);
+    pool_.Submit(std::move(task));
+  }
+
+  // Копирует файл в текущем потоке. Вызывается из задач пула
+  void CopyFileNow(const file_sys::path& from, const file_sys::path& to,
+                   bool overwrite, uint64_t* hash = nullptr) {
+    LatencyTimer timer(LatencyMetric::kCopy);
+    const file_sys::path& target = atomic_ ? PartialPath(to) : to;
+    overwrite = overwrite || atomic_;
+    CopyStrategy strategy = CopyStrategy::kReadWrite;
+    if (hash != nullptr) {
+      *hash = CopyFileDataHashed(from, target, overwrite);
+    } else {
+      strategy = CopyFileData(from, target, overwrite, direct_);
+    }
+    if (atomic_) {
+      file_sys::rename(target, to);
+    }
+    CountCopy(strategy, to);
+  }
+
+  // Сохраняет файл патчем к копии base, а если патч выходит не намного
+  // меньше файла — копирует целиком. Вызывается из задач пула. Возвращает
+  // true, если записан патч to + kDeltaExtension
+  bool StoreDeltaNow(const file_sys::path& base, const file_sys::path& from,
+                     const file_sys::path& to, uint64_t* hash = nullptr) {
+    file_sys::path patch = to;
+    patch += kDeltaExtension;
+    bool stored = false;
+    {
+      LatencyTimer timer(LatencyMetric::kCopy);
+      stored = WriteDelta(base, from, atomic_ ? PartialPath(patch) : patch,
+                          hash);
+    }
+    if (!stored) {
+      CopyFileNow(from, to, true, hash);
+      return false;
+    }
+    if (atomic_) {
+      file_sys::rename(PartialPath(patch), patch);
+    }
+    CountCopy(CopyStrategy::kDelta, patch);
+    return true;
+  }
+
+  // Собирает файл из копии base и патча. Вызывается из задач пула
+  void ApplyDeltaNow(const file_sys::path& base, const file_sys::path& patch,
+                     const file_sys::path& to, bool overwrite) {
+    LatencyTimer timer(LatencyMetric::kCopy);
+    ApplyDelta(base, patch, to, overwrite);
+    CountCopy(CopyStrategy::kDelta, to);
+  }
+
+  // Дожидается окончания копирования, ошибка копирования пробрасывается
+  // так же, как при последовательном копировании
+  void Wait() {
+    if (uring_ != nullptr) {
+      uring_->Run();
+    }
+    pool_.Wait();
+    if (report_) {
+      PrintReport();
+    }
+  }
+
+  // Сколько файлов скопировано указанным способом
+  size_t StrategyCount(CopyStrategy strategy) const {
+    return strategy_counts_[static_cast<size_t>(strategy)].load();
+  }
+
+ private:
+  // Сколько файлов может ждать копирования. Дальше обход дерева ждёт
+  // копирование, поэтому очередь не растёт с размером дерева
+  static constexpr size_t kMaxQueued = 4096;
+
+  void CountCopy(CopyStrategy strategy, const file_sys::path& to) {
+    ++strategy_counts_[static_cast<size_t>(strategy)];
+    CountMetric(Metric::kFilesCopied);
+    if (report_) {
+      std::lock_guard<std::mutex> lock(report_mutex_);
+      std::cout << CopyStrategyName(strategy) << ' ' << to.string() << '\n';
+    }
+  }
+
+  void PrintReport() {
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    std::cout << "Итого:";
+    for (size_t i = 0; i < kCopyStrategyCount; ++i) {
+      std::cout << ' ' << CopyStrategyName(static_cast<CopyStrategy>(i))
+                << '=' << strategy_counts_[i].load();
+    }
+    std::cout << '\n';
+  }
+
+  bool report_;
+  bool direct_;
+  bool atomic_ = false;
+  std::mutex report_mutex_;
+  std::array<std::atomic<size_t>, kCopyStrategyCount> strategy_counts_{};
+  IoUring ring_;
+  std::unique_ptr<UringCopier> uring_;
+  ThreadPool pool_;
+};
@@ -0,0 +1,622 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "copy_backend.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "xxhash.h"
+
+namespace file_sys = std::filesystem;
+
+// Патч к копии файла из full backup, как в rsync:
+//
+//   "BRDELTA1", размер результата (8 байт), права (4 байта), размер копии,
+//   к которой применяется патч (8 байт)
+//   операции: kDeltaCopy — смещение в копии и длина (по 8 байт),
+//   kDeltaLiteral — длина (8 байт) и сами данные, kDeltaEnd — конец патча
+//
+// Копия режется на блоки одного размера, для каждого считаются слабая
+// скользящая сумма и XXH64. Новый файл просматривается окном размером с
+// блок, которое сдвигается на байт: слабая сумма пересчитывается за O(1),
+// а XXH64 считается, только если слабая сумма нашлась среди блоков копии.
+// Поэтому совпавшие блоки находятся и после вставок и удалений, которые
+// сдвигают данные файла
+
+inline constexpr char kDeltaMagic[8] = {'B', 'R', 'D', 'E', 'L', 'T', 'A', '1'};
+inline constexpr char kDeltaExtension[] = ".brdelta";
+
+enum DeltaOp : uint8_t {
+  kDeltaEnd = 0,
+  kDeltaCopy = 1,
+  kDeltaLiteral = 2,
+};
+
+// Размер блока: не меньше 64 КБ и не больше миллиона блоков на файл, чтобы
+// суммы копии большой базы данных занимали десятки мегабайт
+inline size_t DeltaBlockSize(uint64_t size) {
+  size_t block = 64 << 10;
+  while (size / block > (1u << 20)) {
+    block *= 2;
+  }
+  return block;
+}
+
+// Слабая сумма окна как в rsync: при сдвиге окна на байт пересчитывается
+// по уходящему и приходящему байту
+class RollingChecksum {
+ public:
+  void Reset(const uint8_t* data, size_t size) {
+    a_ = 0;
+    b_ = 0;
+    size_ = static_cast<uint32_t>(size);
+    for (size_t i = 0; i < size; ++i) {
+      a_ += data[i];
+      b_ += static_cast<uint32_t>(size - i) * data[i];
+    }
+  }
+
+  void Roll(uint8_t out, uint8_t in) {
+    a_ = a_ - out + in;
+    b_ = b_ - size_ * out + a_;
+  }
+
+  uint32_t Value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+ private:
+  uint32_t a_ = 0;
+  uint32_t b_ = 0;
+  uint32_t size_ = 0;
+};
+
+// Суммы блоков копии из full backup
+class DeltaSignature {
+ public:
+  struct Block {
+    uint32_t weak;
+    uint32_t index;
+    uint64_t strong;
+  };
+
+  explicit DeltaSignature(size_t block_size)
+      : block_size_(block_size), filter_(kFilterBits / 64) {}
+
+  // Читает копию и считает суммы всех полных блоков. Возвращает 0 или код
+  // ошибки
+  int Build(int fd) {
+    std::vector<uint8_t> buffer(block_size_);
+    off_t offset = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (true) {
+      size_t filled = 0;
+      while (filled < buffer.size()) {
+        ThrottledIo io(buffer.size() - filled);
+        ssize_t result = pread(fd, buffer.data() + filled,
+                               buffer.size() - filled, offset + filled);
+        if (result < 0 && errno == EINTR) {
+          continue;
+        }
+        if (result < 0) {
+          return errno;
+        }
+        if (result == 0) {
+          break;
+        }
+        filled += result;
+      }
+      // Неполный хвост копии не сравнивается: он уйдёт в патч данными
+      if (filled < buffer.size()) {
+        break;
+      }
+      RollingChecksum rolling;
+      rolling.Reset(buffer.data(), filled);
+      Block block{rolling.Value(), static_cast<uint32_t>(blocks_.size()),
+                  Xxh64::Hash(buffer.data(), filled)};
+      blocks_.push_back(block);
+      SetFilter(block.weak);
+      offset += filled;
+    }
+    std::sort(blocks_.begin(), blocks_.end(),
+              [](const Block& lhs, const Block& rhs) {
+                return lhs.weak < rhs.weak;
+              });
+    return 0;
+  }
+
+  // Ищет блок копии с тем же содержимым, что и окно data. Среди нескольких
+  // одинаковых блоков предпочитает блок hint, чтобы соседние совпадения
+  // склеивались в одну операцию копирования
+  const Block* Find(uint32_t weak, const uint8_t* data, uint32_t hint) const {
+    if (!HasFilter(weak)) {
+      return nullptr;
+    }
+    auto range = std::equal_range(
+        blocks_.begin(), blocks_.end(), Block{weak, 0, 0},
+        [](const Block& lhs, const Block& rhs) { return lhs.weak < rhs.weak; });
+    if (range.first == range.second) {
+      return nullptr;
+    }
+    uint64_t strong = Xxh64::Hash(data, block_size_);
+    const Block* found = nullptr;
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->strong != strong) {
+        continue;
+      }
+      if (it->index == hint) {
+        return &*it;
+      }
+      if (found == nullptr) {
+        found = &*it;
+      }
+    }
+    return found;
+  }
+
+ private:
+  // Битовый фильтр по слабой сумме отсекает почти все позиции окна без
+  // двоичного поиска
+  static constexpr uint32_t kFilterBits = 1u << 24;
+
+  static uint32_t FilterBit(uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> 8;
+  }
+  void SetFilter(uint32_t weak) {
+    uint32_t bit = FilterBit(weak);
+    filter_[bit / 64] |= 1ull << (bit % 64);
+  }
+  bool HasFilter(uint32_t weak) const {
+    uint32_t bit = FilterBit(weak);
+    return (filter_[bit / 64] >> (bit % 64) & 1) != 0;
+  }
+
+  size_t block_size_;
+  std::vector<Block> blocks_;
+  std::vector<uint64_t> filter_;
+};
+
+// Буферизованная запись операций патча. Соседние копирования склеиваются
+class DeltaWriter {
+ public:
+  explicit DeltaWriter(int fd) : fd_(fd) {}
+
+  void Header(uint64_t size, uint32_t mode, uint64_t base_size) {
+    Put(kDeltaMagic, sizeof(kDeltaMagic));
+    PutValue(size);
+    PutValue(mode);
+    PutValue(base_size);
+  }
+
+  int Copy(uint64_t offset, uint64_t length) {
+    if (copy_length_ > 0 && copy_offset_ + copy_length_ == offset) {
+      copy_length_ += length;
+      return 0;
+    }
+    int error = FlushCopy();
+    copy_offset_ = offset;
+    copy_length_ = length;
+    return error;
+  }
+
+  int Literal(const uint8_t* data, size_t size) {
+    if (size == 0) {
+      return 0;
+    }
+    int error = FlushCopy();
+    if (error != 0) {
+      return error;
+    }
+    PutValue(static_cast<uint8_t>(kDeltaLiteral));
+    PutValue(static_cast<uint64_t>(size));
+    Put(data, size);
+    literal_bytes_ += size;
+    CountMetric(Metric::kBytesCopied, size);
+    return MaybeFlush();
+  }
+
+  // Завершает патч. size — сколько байт нового файла на самом деле
+  // прочитано: файл мог сократиться после Header, и размер в заголовке
+  // переписывается, чтобы патч применялся
+  int Finish(uint64_t size) {
+    int error = FlushCopy();
+    if (error != 0) {
+      return error;
+    }
+    PutValue(static_cast<uint8_t>(kDeltaEnd));
+    error = Flush();
+    if (error != 0) {
+      return error;
+    }
+    ssize_t result = pwrite(fd_, &size, sizeof(size), sizeof(kDeltaMagic));
+    if (result < 0) {
+      return errno;
+    }
+    return result == sizeof(size) ? 0 : EIO;
+  }
+
+  // Сколько данных нового файла попало в патч как есть
+  uint64_t LiteralBytes() const { return literal_bytes_; }
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 20;
+
+  void Put(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+  }
+  template <typename T>
+  void PutValue(T value) {
+    Put(&value, sizeof(value));
+  }
+
+  int FlushCopy() {
+    if (copy_length_ == 0) {
+      return 0;
+    }
+    PutValue(static_cast<uint8_t>(kDeltaCopy));
+    PutValue(copy_offset_);
+    PutValue(copy_length_);
+    copy_length_ = 0;
+    return MaybeFlush();
+  }
+
+  int MaybeFlush() { return buffer_.size() >= kFlushSize ? Flush() : 0; }
+
+  int Flush() {
+    int error = WriteAll(fd_, buffer_.data(), buffer_.size());
+    buffer_.clear();
+    return error;
+  }
+
+  int fd_;
+  std::vector<char> buffer_;
+  uint64_t copy_offset_ = 0;
+  uint64_t copy_length_ = 0;
+  uint64_t literal_bytes_ = 0;
+};
+
+// Пишет патч, который превращает копию base в файл source. Если данных как
+// есть в патче больше половины файла, патч удаляется и возвращается false:
+// тогда выгоднее сохранить файл целиком. hash, если передан, получает хеш
+// содержимого source
+inline bool WriteDelta(const file_sys::path& base, const file_sys::path& source,
+                       const file_sys::path& patch, uint64_t* hash) {
+  FileDescriptor base_fd(open(base.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat base_stat;
+  if (!base_fd.IsValid() || fstat(base_fd.Get(), &base_stat) != 0) {
+    ThrowCopyError(base, patch, errno);
+  }
+  size_t block = DeltaBlockSize(base_stat.st_size);
+  DeltaSignature signature(block);
+  int error = signature.Build(base_fd.Get());
+  if (error != 0) {
+    ThrowCopyError(base, patch, error);
+  }
+
+  FileDescriptor src;
+  FileDescriptor dst;
+  struct stat src_stat = OpenCopyFiles(source, patch, true, src, dst);
+  uint64_t limit = static_cast<uint64_t>(src_stat.st_size) / 2;
+  DeltaWriter writer(dst.Get());
+  writer.Header(src_stat.st_size, src_stat.st_mode & 07777,
+                base_stat.st_size);
+
+  // В буфере лежат ещё не записанные в патч данные [literal, end): окно
+  // [pos, pos + block) и всё, что перед ним не совпало с копией. Данные
+  // перед окном сбрасываются в патч не реже чем раз в kMaxLiteral байт,
+  // поэтому буфер ограничен
+  constexpr size_t kMaxLiteral = 1 << 20;
+  constexpr size_t kReadSize = 4 << 20;
+  std::vector<uint8_t> buffer(kMaxLiteral + 2 * block + kReadSize);
+  size_t literal = 0;
+  size_t pos = 0;
+  size_t end = 0;
+  off_t read_offset = 0;
+  bool eof = false;
+  Xxh64 hasher;
+  RollingChecksum rolling;
+  bool rolling_valid = false;
+  uint32_t hint = 0;
+  posix_fadvise(src.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  auto fill = [&]() {
+    std::memmove(buffer.data(), buffer.data() + literal, end - literal);
+    pos -= literal;
+    end -= literal;
+    literal = 0;
+    while (end < buffer.size()) {
+      // Читается не дальше размера на момент открытия: иначе чтение
+      // растущего журнала или базы гналось бы за дописанными данными
+      uint64_t left = static_cast<uint64_t>(src_stat.st_size) - read_offset;
+      if (left == 0) {
+        eof = true;
+        break;
+      }
+      size_t want = std::min<uint64_t>(buffer.size() - end, left);
+      ThrottledIo io(want);
+      ssize_t result =
+          pread(src.Get(), buffer.data() + end, want, read_offset);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result < 0) {
+        return errno;
+      }
+      if (result == 0) {
+        eof = true;
+        break;
+      }
+      hasher.Update(buffer.data() + end, result);
+      end += result;
+      read_offset += result;
+    }
+    return 0;
+  };
+  auto flush_literal = [&](size_t until) {
+    int result = writer.Literal(buffer.data() + literal, until - literal);
+    literal = until;
+    return result;
+  };
+
+  while (error == 0 && writer.LiteralBytes() <= limit) {
+    if (end - pos < block + (rolling_valid ? 1 : 0)) {
+      if (!eof) {
+        error = fill();
+        continue;
+      }
+      if (end - pos < block) {
+        break;
+      }
+    }
+    if (!rolling_valid) {
+      rolling.Reset(buffer.data() + pos, block);
+      rolling_valid = true;
+    }
+    const DeltaSignature::Block* match =
+        signature.Find(rolling.Value(), buffer.data() + pos, hint);
+    if (match != nullptr) {
+      error = flush_literal(pos);
+      if (error == 0) {
+        error = writer.Copy(static_cast<uint64_t>(match->index) * block, block);
+      }
+      hint = match->index + 1;
+      pos += block;
+      literal = pos;
+      rolling_valid = false;
+      continue;
+    }
+    if (end - pos == block) {
+      // Окно дошло до конца файла и не совпало
+      break;
+    }
+    rolling.Roll(buffer[pos], buffer[pos + block]);
+    ++pos;
+    if (pos - literal >= kMaxLiteral) {
+      error = flush_literal(pos);
+    }
+  }
+  // Хвост короче блока и всё несовпавшее уходит в патч как есть
+  if (error == 0 && writer.LiteralBytes() <= limit) {
+    error = flush_literal(end);
+  }
+  if (error == 0) {
+    error = writer.Finish(read_offset);
+  }
+  if (error != 0) {
+    ThrowCopyError(source, patch, error);
+  }
+  if (writer.LiteralBytes() > limit) {
+    dst.Reset();
+    file_sys::remove(patch);
+    return false;
+  }
+  if (hash != nullptr) {
+    *hash = ContentHash(hasher);
+  }
+  return true;
+}
+
+[[noreturn]] inline void ThrowCorruptedDelta(const file_sys::path& path) {
+  throw std::runtime_error("Патч " + path.string() +
+                           " повреждён или не подходит к full backup\n"
+                           "Выберите другой бэкап");
+}
+
+// Последовательное чтение патча с буферизацией
+class DeltaReader {
+ public:
+  explicit DeltaReader(const file_sys::path& path)
+      : path_(path), fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)),
+        buffer_(1 << 20) {
+    if (!fd_.IsValid()) {
+      ThrowCopyError(path, path, errno);
+    }
+  }
+
+  void Read(void* out, size_t size) {
+    char* bytes = static_cast<char*>(out);
+    while (size > 0) {
+      if (begin_ == end_) {
+        Fill();
+      }
+      size_t take = std::min(size, end_ - begin_);
+      std::memcpy(bytes, buffer_.data() + begin_, take);
+      begin_ += take;
+      bytes += take;
+      size -= take;
+    }
+  }
+
+  template <typename T>
+  T Get() {
+    T value;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+ private:
+  void Fill() {
+    while (true) {
+      ThrottledIo io(buffer_.size());
+      ssize_t result = read(fd_.Get(), buffer_.data(), buffer_.size());
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        ThrowCorruptedDelta(path_);
+      }
+      begin_ = 0;
+      end_ = result;
+      return;
+    }
+  }
+
+  file_sys::path path_;
+  FileDescriptor fd_;
+  std::vector<char> buffer_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+// Копирует участок одного файла в другое место другого файла: внутри ядра,
+// а если нельзя — через буфер. Возвращает 0 или код ошибки
+inline int CopyFileRange(int src, off_t src_offset, int dst, off_t dst_offset,
+                         uint64_t length) {
+  while (length > 0) {
+    size_t want = Throttle().Chunk(length);
+    ThrottledIo io(want);
+    ssize_t result =
+        copy_file_range(src, &src_offset, dst, &dst_offset, want, 0);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0 && IsUnsupportedCopy(errno)) {
+      break;
+    }
+    if (result < 0) {
+      return errno;
+    }
+    if (result == 0) {
+      return EIO;
+    }
+    length -= result;
+  }
+  std::vector<char> buffer(std::min<uint64_t>(length, 1 << 20));
+  while (length > 0) {
+    size_t want = std::min<uint64_t>(length, buffer.size());
+    ThrottledIo io(want);
+    ssize_t result = pread(src, buffer.data(), want, src_offset);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      return errno;
+    }
+    if (result == 0) {
+      return EIO;
+    }
+    ssize_t written = 0;
+    while (written < result) {
+      ssize_t out = pwrite(dst, buffer.data() + written, result - written,
+                           dst_offset + written);
+      if (out < 0 && errno == EINTR) {
+        continue;
+      }
+      if (out < 0) {
+        return errno;
+      }
+      written += out;
+    }
+    src_offset += result;
+    dst_offset += result;
+    length -= result;
+  }
+  return 0;
+}
+
+// Собирает файл to из копии base и патча. Совпавшие блоки копируются из
+// base внутри ядра, на btrfs и xfs это общие блоки без копирования данных
+inline void ApplyDelta(const file_sys::path& base, const file_sys::path& patch,
+                       const file_sys::path& to, bool overwrite) {
+  FileDescriptor base_fd(open(base.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat base_stat;
+  if (!base_fd.IsValid() || fstat(base_fd.Get(), &base_stat) != 0) {
+    ThrowCopyError(base, to, errno);
+  }
+  DeltaReader reader(patch);
+  char magic[sizeof(kDeltaMagic)];
+  reader.Read(magic, sizeof(magic));
+  if (std::memcmp(magic, kDeltaMagic, sizeof(magic)) != 0) {
+    ThrowCorruptedDelta(patch);
+  }
+  uint64_t size = reader.Get<uint64_t>();
+  uint32_t mode = reader.Get<uint32_t>();
+  uint64_t base_size = reader.Get<uint64_t>();
+  if (base_size != static_cast<uint64_t>(base_stat.st_size)) {
+    ThrowCorruptedDelta(patch);
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  flags |= overwrite ? O_TRUNC : O_EXCL;
+  FileDescriptor dst(open(to.c_str(), flags, mode & 07777));
+  if (!dst.IsValid() || fchmod(dst.Get(), mode & 07777) != 0) {
+    ThrowCopyError(patch, to, errno);
+  }
+  uint64_t offset = 0;
+  std::vector<char> data;
+  while (true) {
+    uint8_t op = reader.Get<uint8_t>();
+    if (op == kDeltaEnd) {
+      break;
+    }
+    int error = 0;
+    if (op == kDeltaCopy) {
+      uint64_t from = reader.Get<uint64_t>();
+      uint64_t length = reader.Get<uint64_t>();
+      if (from > base_size || length > base_size - from ||
+          length > size - offset) {
+        ThrowCorruptedDelta(patch);
+      }
+      error = CopyFileRange(base_fd.Get(), from, dst.Get(), offset, length);
+      offset += length;
+    } else if (op == kDeltaLiteral) {
+      uint64_t length = reader.Get<uint64_t>();
+      if (length > size - offset) {
+        ThrowCorruptedDelta(patch);
+      }
+      if (lseek(dst.Get(), offset, SEEK_SET) < 0) {
+        ThrowCopyError(patch, to, errno);
+      }
+      data.resize(std::min<uint64_t>(length, 1 << 20));
+      while (error == 0 && length > 0) {
+        size_t chunk = std::min<uint64_t>(length, data.size());
+        reader.Read(data.data(), chunk);
+        error = WriteAll(dst.Get(), data.data(), chunk);
+        offset += chunk;
+        length -= chunk;
+      }
+    } else {
+      ThrowCorruptedDelta(patch);
+    }
+    if (error != 0) {
+      ThrowCopyError(patch, to, error);
+    }
+  }
+  if (offset != size) {
+    ThrowCorruptedDelta(patch);
+  }
+  if (ftruncate(dst.Get(), size) != 0) {
+    ThrowCopyError(patch, to, errno);
+  }
+  CountMetric(Metric::kBytesCopied, size);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+#include "copy_backend.h"
+#include "io_uring.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "options.h"
+#include "thread_pool.h"
+
+namespace file_sys = std::filesystem;
+
+// Создаёт в новом снимке жёсткие ссылки на неизменившиеся файлы прошлого
+// снимка. Ссылки создаются пачками: с --io-uring пачка уходит в ядро
+// запросами linkat через одно кольцо, иначе каждая пачка — одна задача пула
+// потоков. Пути относительные и разбираются от дескрипторов корней, поэтому
+// на ссылку приходится один короткий системный вызов. Если ссылку создать
+// нельзя (лимит ссылок на inode, файловая система без жёстких ссылок, файла
+// нет в прошлом снимке), файл копируется из источника
+class LinkBatch {
+ public:
+  // previous — прошлый снимок, source — источник, to — новый снимок.
+  // Директории нового снимка должны уже существовать
+  LinkBatch(const file_sys::path& previous, const file_sys::path& source,
+            const file_sys::path& to, const Options& options)
+      : previous_(previous), source_(source), to_(to),
+        pool_(JobsCount(options)) {
+    previous_fd_.Reset(
+        open(previous.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    to_fd_.Reset(open(to.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!previous_fd_.IsValid()) {
+      ThrowCopyError(previous, to, errno);
+    }
+    if (!to_fd_.IsValid()) {
+      ThrowCopyError(previous, to, errno);
+    }
+    if (options.io_uring) {
+      ring_.Init(options.queue_depth, {IORING_OP_LINKAT});
+    }
+  }
+
+  // Ставит ссылку в очередь. Путь должен жить до Wait
+  void Add(const char* path) {
+    batch_.push_back(path);
+    if (batch_.size() >= kBatchSize) {
+      Flush();
+    }
+  }
+
+  // Дожидается всех ссылок, ошибка пробрасывается так же, как у пула
+  void Wait() {
+    Flush();
+    pool_.Wait();
+  }
+
+ private:
+  static constexpr size_t kBatchSize = 1024;
+
+  void Flush() {
+    if (batch_.empty()) {
+      return;
+    }
+    std::vector<const char*> batch;
+    batch.swap(batch_);
+    if (ring_.IsReady()) {
+      LinkWithRing(batch);
+      return;
+    }
+    pool_.Submit([this, batch = std::move(batch)]() {
+      for (const char* path : batch) {
+        if (linkat(previous_fd_.Get(), path, to_fd_.Get(), path, 0) != 0) {
+          HandleLinkError(path, errno);
+        }
+      }
+    });
+  }
+
+  void LinkWithRing(const std::vector<const char*>& batch) {
+    size_t next = 0;
+    size_t done = 0;
+    while (done < batch.size()) {
+      while (next < batch.size()) {
+        io_uring_sqe* sqe = ring_.GetSqe();
+        if (sqe == nullptr) {
+          break;
+        }
+        PrepLinkat(sqe, previous_fd_.Get(), batch[next], to_fd_.Get(),
+                   batch[next], 0, next);
+        ++next;
+      }
+      int error = ring_.Submit(1);
+      if (error != 0) {
+        ThrowCopyError(previous_, to_, error);
+      }
+      uint64_t index;
+      int32_t result;
+      while (ring_.PopCompletion(index, result)) {
+        if (result < 0) {
+          HandleLinkError(batch[index], -result);
+        }
+        ++done;
+      }
+    }
+  }
+
+  // Ссылку создать не удалось: файл копируется из источника. Копия
+  // пишется во временный файл и получает имя, только когда готова, поэтому
+  // если файл уже есть, ссылка или полная копия создана до прерывания
+  // бэкапа
+  void HandleLinkError(const char* path, int error) {
+    if (error == EEXIST) {
+      return;
+    }
+    if (error != EMLINK && error != ENOENT && error != EPERM &&
+        error != EXDEV && error != EOPNOTSUPP) {
+      ThrowCopyError(previous_ / path, to_ / path, error);
+    }
+    LatencyTimer timer(LatencyMetric::kCopy);
+    file_sys::path from = source_ / path;
+    file_sys::path to = to_ / path;
+    file_sys::path partial = PartialPath(to);
+    CopyFileData(from, partial, true);
+    // Таких копий мало, поэтому метаданные переносятся сразу
+    error = CopyMetadata(from.c_str(), partial.c_str(), false);
+    if (error != 0 && error != ENOENT) {
+      ThrowCopyError(from, to, error);
+    }
+    error = SyncPath(partial, false);
+    if (error != 0) {
+      ThrowCopyError(from, to, error);
+    }
+    file_sys::rename(partial, to);
+    CountMetric(Metric::kFilesCopied);
+  }
+
+  file_sys::path previous_;
+  file_sys::path source_;
+  file_sys::path to_;
+  FileDescriptor previous_fd_;
+  FileDescriptor to_fd_;
+  IoUring ring_;
+  std::vector<const char*> batch_;
+  ThreadPool pool_;
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+// Минимальная обёртка над io_uring через системные вызовы, без liburing.
+// Запросы кладутся в кольцо отправки пачкой и уходят в ядро одним вызовом
+// io_uring_enter, поэтому много мелких операций не упираются в задержку
+// каждого системного вызова
+class IoUring {
+ public:
+  IoUring() = default;
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring() { Close(); }
+
+  // Создаёт кольцо на entries запросов и проверяет, что ядро поддерживает
+  // все операции ops. Возвращает false на старых ядрах и там, где io_uring
+  // запрещён: тогда вызывающий код работает обычными системными вызовами
+  bool Init(unsigned entries, std::initializer_list<uint8_t> ops) {
+    Close();
+    io_uring_params params{};
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      return false;
+    }
+    fd_ = fd;
+    if (!MapRings(params) || !Supports(ops)) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  bool IsReady() const { return fd_ >= 0; }
+
+  // Сколько запросов может одновременно быть в работе
+  unsigned Capacity() const { return sq_entries_; }
+  unsigned InFlight() const { return in_flight_; }
+
+  // Свободная запись в кольце отправки или nullptr, если кольцо заполнено
+  io_uring_sqe* GetSqe() {
+    if (in_flight_ + queued_ >= sq_entries_) {
+      return nullptr;
+    }
+    unsigned tail = *sq_tail_ + queued_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++queued_;
+    return sqe;
+  }
+
+  // Отправляет подготовленные запросы и ждёт, пока завершится хотя бы
+  // wait_nr из них. Возвращает 0 или код ошибки
+  int Submit(unsigned wait_nr) {
+    __atomic_store_n(sq_tail_, *sq_tail_ + queued_, __ATOMIC_RELEASE);
+    unsigned to_submit = queued_;
+    in_flight_ += queued_;
+    queued_ = 0;
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+      long result = syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr,
+                            flags, nullptr, 0);
+      if (result >= 0) {
+        return 0;
+      }
+      if (errno != EINTR) {
+        return errno;
+      }
+      to_submit = 0;
+    }
+  }
+
+  // Забирает одно завершение. Возвращает false, если готовых нет
+  bool PopCompletion(uint64_t& user_data, int32_t& result) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+    user_data = cqe.user_data;
+    result = cqe.res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    --in_flight_;
+    return true;
+  }
+
+ private:
+  bool MapRings(const io_uring_params& params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_ring_size_ > sq_ring_size_) {
+      sq_ring_size_ = cq_ring_size_;
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      sq_ring_ = nullptr;
+      return false;
+    }
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        cq_ring_ = nullptr;
+        return false;
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  bool Supports(std::initializer_list<uint8_t> ops) {
+    constexpr unsigned kProbeOps = 256;
+    std::vector<char> buffer(sizeof(io_uring_probe) +
+                             kProbeOps * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                kProbeOps) < 0) {
+      return false;
+    }
+    for (uint8_t op : ops) {
+      if (op > probe->last_op ||
+          (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Close() {
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+      sqes_ = nullptr;
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    cq_ring_ = nullptr;
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+      sq_ring_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+    in_flight_ = 0;
+    queued_ = 0;
+  }
+
+  int fd_ = -1;
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned cq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned in_flight_ = 0;
+  unsigned queued_ = 0;
+};
+
+// Заполнение запросов. Пути и буферы должны жить до завершения запроса
+
+inline void PrepStatx(io_uring_sqe* sqe, int dir_fd, const char* path,
+                      int flags, unsigned mask, struct statx* result,
+                      uint64_t user_data) {
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dir_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(path);
+  sqe->len = mask;
+  sqe->off = reinterpret_cast<uint64_t>(result);
+  sqe->statx_flags = flags;
+  sqe->user_data = user_data;
+}
+
+inline void PrepOpenat(io_uring_sqe* sqe, int dir_fd, const char* path,
+                       int flags, mode_t mode, uint64_t user_data) {
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = dir_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(path);
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  sqe->user_data = user_data;
+}
+
+inline void PrepMkdirat(io_uring_sqe* sqe, int dir_fd, const char* path,
+                        mode_t mode, uint64_t user_data) {
+  sqe->opcode = IORING_OP_MKDIRAT;
+  sqe->fd = dir_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(path);
+  sqe->len = mode;
+  sqe->user_data = user_data;
+}
+
+inline void PrepRead(io_uring_sqe* sqe, int fd, void* buffer, unsigned size,
+                     uint64_t offset, uint64_t user_data) {
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+inline void PrepWrite(io_uring_sqe* sqe, int fd, const void* buffer,
+                      unsigned size, uint64_t offset, uint64_t user_data) {
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+inline void PrepClose(io_uring_sqe* sqe, int fd, uint64_t user_data) {
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+}
+
+inline void PrepLinkat(io_uring_sqe* sqe, int old_dir_fd, const char* old_path,
+                       int new_dir_fd, const char* new_path, int flags,
+                       uint64_t user_data) {
+  sqe->opcode = IORING_OP_LINKAT;
+  sqe->fd = old_dir_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(old_path);
+  sqe->len = new_dir_fd;
+  sqe->addr2 = reinterpret_cast<uint64_t>(new_path);
+  sqe->hardlink_flags = flags;
+  sqe->user_data = user_data;
+}
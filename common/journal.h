@@ -0,0 +1,287 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "copy_backend.h"
+
+namespace file_sys = std::filesystem;
+
+// Журнал изменений источника, который ведёт my_backup watch. Лежит в корне
+// бэкапов рядом с last_full.txt, по строке на запись:
+//
+//   B <время> <источник> — журнал сброшен full backup, начатым в это время
+//   C <путь>             — путь изменился, появился или удалён
+//   T <путь>             — директория появилась целиком: её нужно обойти
+//   O                    — события потеряны, журнал непригоден до
+//                          следующего full backup
+//   S <номер>            — события до запроса синхронизации <номер>
+//                          записаны (см. SyncWatcher)
+//
+// Пока работает наблюдатель, он держит блокировку watch.lock, в которой
+// записан наблюдаемый источник. Инкрементный бэкап берёт изменения из
+// журнала, только если журнал сброшен не позже последнего full backup, в нём
+// нет O и наблюдатель за тем же источником всё ещё работает. Иначе дерево
+// обходится целиком
+
+inline constexpr char kJournalFile[] = "watch.journal";
+inline constexpr char kWatchLockFile[] = "watch.lock";
+
+// Изменённые пути из журнала: true — директорию нужно обойти целиком
+using JournalChanges = std::map<std::string, bool>;
+
+// Путь записывается в одну строку: '\\' и перевод строки экранируются
+inline std::string EscapeJournalPath(std::string_view path) {
+  std::string escaped;
+  escaped.reserve(path.size());
+  for (char symbol : path) {
+    if (symbol == '\\') {
+      escaped += "\\\\";
+    } else if (symbol == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += symbol;
+    }
+  }
+  return escaped;
+}
+
+inline std::string UnescapeJournalPath(std::string_view escaped) {
+  std::string path;
+  path.reserve(escaped.size());
+  for (size_t i = 0; i < escaped.size(); ++i) {
+    if (escaped[i] == '\\' && i + 1 < escaped.size()) {
+      path += escaped[++i] == 'n' ? '\n' : escaped[i];
+    } else {
+      path += escaped[i];
+    }
+  }
+  return path;
+}
+
+// Дописывает строки в журнал под блокировкой и сбрасывает их на диск.
+// Возвращает 0 или код ошибки
+inline int AppendJournal(int fd, const std::string& lines) {
+  if (flock(fd, LOCK_EX) != 0) {
+    return errno;
+  }
+  int error = WriteAll(fd, lines.data(), lines.size());
+  if (error == 0 && fdatasync(fd) != 0) {
+    error = errno;
+  }
+  flock(fd, LOCK_UN);
+  return error;
+}
+
+// Начинает журнал заново с заголовка. Вызывающий код держит блокировку.
+// Возвращает 0 или код ошибки
+inline int WriteJournalHeader(int fd, const std::string& stamp,
+                              const file_sys::path& source) {
+  std::string header = "B " + stamp + ' ' +
+                       EscapeJournalPath(file_sys::absolute(source).string()) +
+                       '\n';
+  if (ftruncate(fd, 0) != 0) {
+    return errno;
+  }
+  int error = WriteAll(fd, header.data(), header.size());
+  if (error == 0 && fdatasync(fd) != 0) {
+    error = errno;
+  }
+  return error;
+}
+
+[[noreturn]] inline void ThrowJournalError(const file_sys::path& root) {
+  throw std::runtime_error("Не удалось сбросить журнал изменений " +
+                           (root / kJournalFile).string() +
+                           "\nПроверьте права на директорию для бэкапа");
+}
+
+// Сбрасывает журнал перед full backup, если наблюдение когда-либо
+// запускалось. stamp — время начала бэкапа в формате имени бэкапа
+inline void ResetJournal(const file_sys::path& root, const std::string& stamp,
+                         const file_sys::path& source) {
+  FileDescriptor fd(
+      open((root / kJournalFile).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  if (!fd.IsValid()) {
+    return;
+  }
+  if (flock(fd.Get(), LOCK_EX) != 0 ||
+      WriteJournalHeader(fd.Get(), stamp, source) != 0) {
+    ThrowJournalError(root);
+  }
+}
+
+// Содержимое watch.lock: наблюдаемый источник и pid наблюдателя, по строке
+// на каждый. Пустая строка, если наблюдатель не запущен
+inline std::string ReadWatchLock(const file_sys::path& root) {
+  file_sys::path path = root / kWatchLockFile;
+  FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd.IsValid()) {
+    return "";
+  }
+  // Блокировку удалось взять — значит, её никто не держит
+  if (flock(fd.Get(), LOCK_SH | LOCK_NB) == 0) {
+    return "";
+  }
+  std::string content;
+  char buffer[4096];
+  ssize_t result;
+  while ((result = read(fd.Get(), buffer, sizeof(buffer))) > 0) {
+    content.append(buffer, result);
+  }
+  return content;
+}
+
+// Источник, за которым сейчас следит наблюдатель, или пустой путь, если
+// наблюдатель не запущен
+inline file_sys::path WatchedSource(const file_sys::path& root) {
+  std::string content = ReadWatchLock(root);
+  return UnescapeJournalPath(content.substr(0, content.find('\n')));
+}
+
+// Наблюдатель копит события до секунды, прежде чем дописать их в журнал.
+// Поэтому перед чтением журнала бэкап посылает наблюдателю этот сигнал с
+// номером запроса. Получив его, наблюдатель дочитывает очередь inotify,
+// дописывает события и ставит метку S <номер>. Всё, что случилось до
+// сигнала, оказывается в журнале раньше метки
+inline constexpr int kWatchSyncSignal = SIGUSR1;
+
+// Дожидается метки наблюдателя в журнале. Возвращает false, если
+// наблюдатель не запущен или не ответил: тогда журналу нельзя доверять
+inline bool SyncWatcher(const file_sys::path& root) {
+  constexpr auto kTimeout = std::chrono::seconds(10);
+  constexpr auto kResendInterval = std::chrono::milliseconds(200);
+  constexpr auto kPollInterval = std::chrono::milliseconds(5);
+
+  std::string lock = ReadWatchLock(root);
+  size_t line_end = lock.find('\n');
+  pid_t pid = line_end == std::string::npos
+                  ? 0
+                  : std::atoi(lock.c_str() + line_end + 1);
+  FileDescriptor journal(
+      open((root / kJournalFile).c_str(), O_RDONLY | O_CLOEXEC));
+  if (pid <= 0 || !journal.IsValid()) {
+    return false;
+  }
+  // Метка ищется только в строках, дописанных после запроса. Журнал
+  // дописывается под блокировкой, поэтому конец берётся на границе строки
+  if (flock(journal.Get(), LOCK_SH) != 0) {
+    return false;
+  }
+  off_t start = lseek(journal.Get(), 0, SEEK_END);
+  flock(journal.Get(), LOCK_UN);
+  if (start < 0) {
+    return false;
+  }
+
+  int token = getpid();
+  std::string marker = "\nS " + std::to_string(token) + '\n';
+  std::string appended = "\n";
+  char buffer[4096];
+  auto deadline = std::chrono::steady_clock::now() + kTimeout;
+  while (std::chrono::steady_clock::now() < deadline) {
+    // Сигнал мог прийти, пока наблюдатель не ждал событий, поэтому запрос
+    // повторяется
+    sigval value{};
+    value.sival_int = token;
+    if (sigqueue(pid, kWatchSyncSignal, value) != 0) {
+      return false;
+    }
+    auto resend = std::chrono::steady_clock::now() + kResendInterval;
+    while (std::chrono::steady_clock::now() < resend) {
+      ssize_t result;
+      while ((result = pread(journal.Get(), buffer, sizeof(buffer),
+                             start + appended.size() - 1)) > 0) {
+        appended.append(buffer, result);
+      }
+      if (appended.find(marker) != std::string::npos) {
+        return true;
+      }
+      std::this_thread::sleep_for(kPollInterval);
+    }
+  }
+  return false;
+}
+
+// Читает изменения из журнала. Возвращает nullopt, если журналу нельзя
+// доверять и дерево нужно обойти целиком. Если передан reset_stamp, журнал
+// под той же блокировкой начинается заново, как при ResetJournal: так ни
+// одна запись не теряется между чтением и сбросом
+inline std::optional<JournalChanges> ReadJournal(
+    const file_sys::path& root, const file_sys::path& source,
+    const std::string& last_full, const std::string& reset_stamp = "") {
+  bool reset = !reset_stamp.empty();
+  bool synced = SyncWatcher(root);
+  FileDescriptor fd(open((root / kJournalFile).c_str(),
+                         (reset ? O_RDWR | O_APPEND : O_RDONLY) | O_CLOEXEC));
+  if (!fd.IsValid() || flock(fd.Get(), reset ? LOCK_EX : LOCK_SH) != 0) {
+    return std::nullopt;
+  }
+  std::string content;
+  std::vector<char> buffer(1 << 20);
+  ssize_t result;
+  while ((result = read(fd.Get(), buffer.data(), buffer.size())) > 0) {
+    content.append(buffer.data(), result);
+  }
+  if (reset && WriteJournalHeader(fd.Get(), reset_stamp, source) != 0) {
+    ThrowJournalError(root);
+  }
+  flock(fd.Get(), LOCK_UN);
+
+  std::string watched = file_sys::absolute(source).string();
+  if (!synced || last_full.empty() || WatchedSource(root) != watched) {
+    return std::nullopt;
+  }
+
+  JournalChanges changes;
+  bool has_header = false;
+  size_t begin = 0;
+  while (begin < content.size()) {
+    size_t end = content.find('\n', begin);
+    if (end == std::string::npos) {
+      // Недописанная строка: наблюдатель упал посреди записи
+      return std::nullopt;
+    }
+    std::string_view line(content.data() + begin, end - begin);
+    begin = end + 1;
+    if (!has_header) {
+      // B <время> <источник>
+      size_t space = line.find(' ', 2);
+      if (line.size() < 2 || line.compare(0, 2, "B ") != 0 ||
+          space == std::string_view::npos ||
+          std::string(line.substr(2, space - 2)) > last_full ||
+          UnescapeJournalPath(line.substr(space + 1)) != watched) {
+        return std::nullopt;
+      }
+      has_header = true;
+      continue;
+    }
+    if (line == "O" || line.size() < 2) {
+      return std::nullopt;
+    }
+    if (line[0] == 'S') {
+      continue;
+    }
+    std::string changed = UnescapeJournalPath(line.substr(2));
+    bool tree = line[0] == 'T';
+    changes[changed] = changes[changed] || tree;
+  }
+  if (!has_header) {
+    return std::nullopt;
+  }
+  return changes;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Сжатие в формате блока LZ4 без внешних зависимостей. Компрессор жадный,
+// с хеш-таблицей на 4-байтовые последовательности: он быстрее, чем нужно
+// для диска, и совместим с любым распаковщиком блоков LZ4
+
+inline constexpr size_t kLz4MinMatch = 4;
+inline constexpr size_t kLz4LastLiterals = 5;
+inline constexpr size_t kLz4MatchFindLimit = 12;
+inline constexpr size_t kLz4MaxOffset = 65535;
+inline constexpr int kLz4HashBits = 16;
+
+// Максимальный размер сжатых данных для входа размера size
+inline size_t Lz4CompressBound(size_t size) { return size + size / 255 + 16; }
+
+inline uint32_t Lz4Read32(const uint8_t* data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+inline uint32_t Lz4Hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - kLz4HashBits);
+}
+
+inline void Lz4WriteLength(std::vector<uint8_t>& out, size_t length) {
+  while (length >= 255) {
+    out.push_back(255);
+    length -= 255;
+  }
+  out.push_back(static_cast<uint8_t>(length));
+}
+
+inline void Lz4WriteSequence(std::vector<uint8_t>& out,
+                             const uint8_t* literals, size_t literal_size,
+                             size_t offset, size_t match_size) {
+  size_t match_code = match_size == 0 ? 0 : match_size - kLz4MinMatch;
+  uint8_t token = static_cast<uint8_t>(
+      ((literal_size >= 15 ? 15 : literal_size) << 4) |
+      (match_code >= 15 ? 15 : match_code));
+  out.push_back(token);
+  if (literal_size >= 15) {
+    Lz4WriteLength(out, literal_size - 15);
+  }
+  out.insert(out.end(), literals, literals + literal_size);
+  if (match_size == 0) {
+    return;
+  }
+  out.push_back(static_cast<uint8_t>(offset));
+  out.push_back(static_cast<uint8_t>(offset >> 8));
+  if (match_code >= 15) {
+    Lz4WriteLength(out, match_code - 15);
+  }
+}
+
+// Сжимает size байт. Результат дописывается в out
+inline void Lz4Compress(const uint8_t* data, size_t size,
+                        std::vector<uint8_t>& out) {
+  out.reserve(out.size() + Lz4CompressBound(size));
+  size_t anchor = 0;
+  if (size > kLz4MatchFindLimit) {
+    // В таблице хранится позиция + 1, ноль означает пустую ячейку
+    std::vector<uint32_t> table(1u << kLz4HashBits, 0);
+    size_t match_limit = size - kLz4LastLiterals;
+    size_t position = 0;
+    while (position < size - kLz4MatchFindLimit) {
+      uint32_t sequence = Lz4Read32(data + position);
+      uint32_t& slot = table[Lz4Hash(sequence)];
+      size_t candidate = slot;
+      slot = static_cast<uint32_t>(position + 1);
+      if (candidate == 0 || position - (candidate - 1) > kLz4MaxOffset ||
+          Lz4Read32(data + candidate - 1) != sequence) {
+        ++position;
+        continue;
+      }
+      size_t reference = candidate - 1;
+      size_t match_size = kLz4MinMatch;
+      while (position + match_size < match_limit &&
+             data[reference + match_size] == data[position + match_size]) {
+        ++match_size;
+      }
+      Lz4WriteSequence(out, data + anchor, position - anchor,
+                       position - reference, match_size);
+      position += match_size;
+      anchor = position;
+    }
+  }
+  Lz4WriteSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+// Распаковывает блок ровно в out_size байт. Возвращает false для
+// повреждённых данных
+inline bool Lz4Decompress(const uint8_t* data, size_t size, uint8_t* out,
+                          size_t out_size) {
+  size_t in = 0;
+  size_t pos = 0;
+  auto read_length = [&](size_t& length) {
+    uint8_t byte;
+    do {
+      if (in >= size) {
+        return false;
+      }
+      byte = data[in++];
+      length += byte;
+    } while (byte == 255);
+    return true;
+  };
+
+  while (in < size) {
+    uint8_t token = data[in++];
+    size_t literal_size = token >> 4;
+    if (literal_size == 15 && !read_length(literal_size)) {
+      return false;
+    }
+    if (literal_size > size - in || literal_size > out_size - pos) {
+      return false;
+    }
+    std::memcpy(out + pos, data + in, literal_size);
+    in += literal_size;
+    pos += literal_size;
+    if (in == size) {
+      break;
+    }
+
+    if (size - in < 2) {
+      return false;
+    }
+    size_t offset = data[in] | (static_cast<size_t>(data[in + 1]) << 8);
+    in += 2;
+    size_t match_size = token & 15;
+    if (match_size == 15 && !read_length(match_size)) {
+      return false;
+    }
+    match_size += kLz4MinMatch;
+    if (offset == 0 || offset > pos || match_size > out_size - pos) {
+      return false;
+    }
+    // Совпадение может перекрываться с собой, поэтому копирование побайтовое
+    const uint8_t* match = out + pos - offset;
+    for (size_t i = 0; i < match_size; ++i) {
+      out[pos + i] = match[i];
+    }
+    pos += match_size;
+  }
+  return pos == out_size;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "arena.h"
+#include "copy_backend.h"
+
+namespace file_sys = std::filesystem;
+
+// Манифест бэкапа — отсортированная по пути таблица файлов источника на
+// момент бэкапа. Хранится рядом с last_full.txt в файле <имя бэкапа>.manifest
+// и открывается через mmap, поэтому инкрементный бэкап сравнивает файлы
+// источника с манифестом и не обращается к дереву прошлого бэкапа.
+//
+// Формат: ManifestHeader, затем entry_count записей ManifestEntry, затем
+// строки путей. Пути относительные, с разделителем '/'
+
+inline constexpr char kManifestMagic[8] = {'B', 'R', 'M', 'A',
+                                           'N', 'I', 'F', '1'};
+inline constexpr uint32_t kManifestVersion = 1;
+
+// Вид бэкапа, для которого записан манифест
+enum class BackupKind : uint32_t {
+  kFull = 0,
+  kIncremental = 1,
+};
+
+// Флаги записи манифеста
+enum ManifestFlags : uint32_t {
+  kManifestDirectory = 1u << 0,  // запись описывает директорию
+  kManifestStored = 1u << 1,     // данные лежат в директории этого бэкапа
+  kManifestDelta = 1u << 2,      // данные лежат патчем к копии из full backup
+};
+
+struct ManifestHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t kind;
+  uint64_t entry_count;
+  uint64_t strings_size;
+  // Имя бэкапа, относительно которого сделан инкрементный бэкап
+  uint64_t base_offset;
+  uint64_t base_size;
+};
+
+struct ManifestEntry {
+  uint64_t path_offset;
+  uint32_t path_size;
+  uint32_t flags;
+  uint64_t size;
+  int64_t mtime_ns;
+  uint64_t inode;
+  uint64_t hash;  // хеш содержимого, 0 — не вычислялся
+  uint32_t mode;
+  // Младшие 32 бита секунд времени изменения метаданных: по нему снимок
+  // видит смену владельца и расширенных атрибутов
+  uint32_t ctime_s;
+};
+
+// Путь к манифесту бэкапа, лежащего в директории backup_dir
+inline file_sys::path ManifestPath(const file_sys::path& backup_dir) {
+  return backup_dir.parent_path() / (backup_dir.filename().string() +
+                                     ".manifest");
+}
+
+// Заполняет запись манифеста по результату stat
+inline ManifestEntry MakeManifestEntry(const struct stat& file_stat) {
+  ManifestEntry entry{};
+  entry.size = S_ISDIR(file_stat.st_mode) ? 0 : file_stat.st_size;
+  entry.mtime_ns = static_cast<int64_t>(file_stat.st_mtim.tv_sec) *
+                       1000000000 +
+                   file_stat.st_mtim.tv_nsec;
+  entry.inode = file_stat.st_ino;
+  entry.mode = file_stat.st_mode;
+  entry.ctime_s = static_cast<uint32_t>(file_stat.st_ctim.tv_sec);
+  if (S_ISDIR(file_stat.st_mode)) {
+    entry.flags |= kManifestDirectory;
+  }
+  return entry;
+}
+
+// Накапливает записи во время бэкапа и записывает манифест на диск. Записи
+// лежат в аренде, пути не копируются: аренда и строки путей должны жить до
+// Write. Записи не перемещаются, поэтому потоки копирования могут заполнять
+// хеши уже добавленных записей
+class ManifestBuilder {
+ public:
+  ManifestBuilder(BackupKind kind, std::string base, Arena& arena)
+      : kind_(kind), base_(std::move(base)), arena_(arena), paths_(arena),
+        entries_(arena) {}
+
+  // Добавляет запись и возвращает её номер
+  size_t Add(std::string_view path, const ManifestEntry& entry) {
+    paths_.PushBack(path);
+    entries_.PushBack(entry);
+    return entries_.Size() - 1;
+  }
+
+  ManifestEntry& Entry(size_t index) { return entries_[index]; }
+  std::string_view Path(size_t index) const { return paths_[index]; }
+  size_t Size() const { return entries_.Size(); }
+
+  // Сортирует записи по пути и атомарно записывает манифест: сначала во
+  // временный файл, затем переименованием. Таблица и строки пишутся сразу в
+  // файл, без копии всех путей в памяти
+  void Write(const file_sys::path& manifest_path) {
+    size_t count = entries_.Size();
+    auto* order = static_cast<size_t*>(
+        arena_.Allocate(count * sizeof(size_t), alignof(size_t)));
+    uint64_t strings_size = base_.size();
+    for (size_t i = 0; i < count; ++i) {
+      order[i] = i;
+      strings_size += paths_[i].size();
+    }
+    std::sort(order, order + count, [this](size_t lhs, size_t rhs) {
+      return paths_[lhs] < paths_[rhs];
+    });
+
+    ManifestHeader header{};
+    std::memcpy(header.magic, kManifestMagic, sizeof(header.magic));
+    header.version = kManifestVersion;
+    header.kind = static_cast<uint32_t>(kind_);
+    header.entry_count = count;
+    header.strings_size = strings_size;
+    header.base_offset = 0;
+    header.base_size = base_.size();
+
+    file_sys::path temp_path = manifest_path;
+    temp_path += ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      uint64_t offset = base_.size();
+      for (size_t i = 0; i < count; ++i) {
+        ManifestEntry entry = entries_[order[i]];
+        entry.path_offset = offset;
+        entry.path_size = paths_[order[i]].size();
+        offset += entry.path_size;
+        file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+      }
+      file.write(base_.data(), base_.size());
+      for (size_t i = 0; i < count; ++i) {
+        std::string_view path = paths_[order[i]];
+        file.write(path.data(), path.size());
+      }
+      if (!file) {
+        throw std::runtime_error(
+            "Не удалось записать манифест бэкапа " + manifest_path.string() +
+            "\nПроверьте свободное место и права на директорию для бэкапа");
+      }
+    }
+    // Манифест отмечает бэкап завершённым, поэтому он должен пережить
+    // перезагрузку вместе с новым именем
+    int error = SyncPath(temp_path, false);
+    if (error == 0) {
+      file_sys::rename(temp_path, manifest_path);
+      error = SyncPath(manifest_path.parent_path(), true);
+    }
+    if (error != 0) {
+      throw file_sys::filesystem_error(
+          "cannot sync manifest", manifest_path,
+          std::error_code(error, std::generic_category()));
+    }
+  }
+
+ private:
+  BackupKind kind_;
+  std::string base_;
+  Arena& arena_;
+  ArenaVector<std::string_view> paths_;
+  ArenaVector<ManifestEntry> entries_;
+};
+
+// Манифест, отображённый в память только для чтения
+class Manifest {
+ public:
+  Manifest() = default;
+  Manifest(const Manifest&) = delete;
+  Manifest& operator=(const Manifest&) = delete;
+  ~Manifest() { Close(); }
+
+  // Открывает манифест. Возвращает false, если файла нет
+  bool Open(const file_sys::path& manifest_path) {
+    Close();
+    int fd = open(manifest_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 ||
+        static_cast<size_t>(file_stat.st_size) < sizeof(ManifestHeader)) {
+      close(fd);
+      ThrowCorrupted(manifest_path);
+    }
+    size_ = file_stat.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      size_ = 0;
+      ThrowCorrupted(manifest_path);
+    }
+    data_ = static_cast<const char*>(data);
+    header_ = reinterpret_cast<const ManifestHeader*>(data_);
+
+    uint64_t entries_size = header_->entry_count * sizeof(ManifestEntry);
+    if (std::memcmp(header_->magic, kManifestMagic, sizeof(kManifestMagic)) !=
+            0 ||
+        header_->version != kManifestVersion ||
+        header_->entry_count > size_ / sizeof(ManifestEntry) ||
+        sizeof(ManifestHeader) + entries_size + header_->strings_size !=
+            size_ ||
+        header_->base_offset + header_->base_size > header_->strings_size) {
+      Close();
+      ThrowCorrupted(manifest_path);
+    }
+    entries_ = reinterpret_cast<const ManifestEntry*>(data_ +
+                                                      sizeof(ManifestHeader));
+    strings_ = data_ + sizeof(ManifestHeader) + entries_size;
+    for (size_t i = 0; i < Size(); ++i) {
+      if (entries_[i].path_offset + entries_[i].path_size >
+          header_->strings_size) {
+        Close();
+        ThrowCorrupted(manifest_path);
+      }
+    }
+    return true;
+  }
+
+  bool IsOpen() const { return data_ != nullptr; }
+  size_t Size() const { return header_ == nullptr ? 0 : header_->entry_count; }
+  BackupKind Kind() const { return static_cast<BackupKind>(header_->kind); }
+  std::string_view Base() const {
+    return {strings_ + header_->base_offset, header_->base_size};
+  }
+
+  const ManifestEntry& Entry(size_t index) const { return entries_[index]; }
+  std::string_view Path(const ManifestEntry& entry) const {
+    return {strings_ + entry.path_offset, entry.path_size};
+  }
+
+  // Двоичный поиск записи по относительному пути
+  const ManifestEntry* Find(std::string_view path) const {
+    size_t index = LowerBound(path);
+    if (index < Size() && Path(entries_[index]) == path) {
+      return &entries_[index];
+    }
+    return nullptr;
+  }
+
+  // Номер первой записи, путь которой не меньше переданного
+  size_t LowerBound(std::string_view path) const {
+    const ManifestEntry* found = std::lower_bound(
+        entries_, entries_ + Size(), path,
+        [this](const ManifestEntry& entry, std::string_view value) {
+          return Path(entry) < value;
+        });
+    return found - entries_;
+  }
+
+ private:
+  [[noreturn]] static void ThrowCorrupted(const file_sys::path& path) {
+    throw std::runtime_error("Манифест бэкапа " + path.string() +
+                             " повреждён\nУдалите его и сделайте новый full "
+                             "backup");
+  }
+
+  void Close() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+    data_ = nullptr;
+    header_ = nullptr;
+    entries_ = nullptr;
+    strings_ = nullptr;
+    size_ = 0;
+  }
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  const ManifestHeader* header_ = nullptr;
+  const ManifestEntry* entries_ = nullptr;
+  const char* strings_ = nullptr;
+};
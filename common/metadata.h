@@ -0,0 +1,196 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "copy_backend.h"
+#include "options.h"
+#include "thread_pool.h"
+
+namespace file_sys = std::filesystem;
+
+// Метаданные копии: владелец, права, расширенные атрибуты (в них же
+// хранятся POSIX ACL) и время доступа и изменения с точностью до
+// наносекунд. Копирование их не переносит, это делает отдельный проход
+// после него
+
+// Ошибки, после которых копия остаётся годной, только без части
+// метаданных: без прав root нельзя сменить владельца и записать атрибуты
+// security.*, а файловая система может не поддерживать атрибуты
+inline bool IsIgnoredMetadataError(int error) {
+  return error == EPERM || error == EOPNOTSUPP;
+}
+
+// Переносит расширенные атрибуты. Символические ссылки разыменовываются,
+// как при обходе и копировании. Возвращает 0 или код ошибки
+inline int CopyXattrs(const char* from, const char* to) {
+  char small_names[1024];
+  std::vector<char> large_names;
+  char* names = small_names;
+  ssize_t size = listxattr(from, small_names, sizeof(small_names));
+  while (size < 0 && errno == ERANGE) {
+    size = listxattr(from, nullptr, 0);
+    if (size < 0) {
+      break;
+    }
+    large_names.resize(size);
+    names = large_names.data();
+    size = listxattr(from, names, large_names.size());
+  }
+  if (size < 0) {
+    return IsIgnoredMetadataError(errno) ? 0 : errno;
+  }
+
+  std::vector<char> value(256);
+  for (ssize_t offset = 0; offset < size;) {
+    const char* name = names + offset;
+    offset += std::char_traits<char>::length(name) + 1;
+    ssize_t value_size = getxattr(from, name, value.data(), value.size());
+    while (value_size < 0 && errno == ERANGE) {
+      value_size = getxattr(from, name, nullptr, 0);
+      if (value_size < 0) {
+        break;
+      }
+      value.resize(value_size);
+      value_size = getxattr(from, name, value.data(), value.size());
+    }
+    // Атрибут удалили после listxattr: переносить нечего
+    if (value_size < 0 && errno == ENODATA) {
+      continue;
+    }
+    if (value_size < 0) {
+      return errno;
+    }
+    if (setxattr(to, name, value.data(), value_size, 0) != 0 &&
+        !IsIgnoredMetadataError(errno)) {
+      return errno;
+    }
+  }
+  return 0;
+}
+
+// Переносит метаданные элемента from на его копию to. Обход и копирование
+// идут по символическим ссылкам, поэтому и метаданные берутся у цели
+// ссылки, а не у неё самой. Владелец меняется, только если он не тот, что
+// у процесса, права файлов выставляет уже само копирование, поэтому обычно
+// на файл приходится три системных вызова.
+// Возвращает 0 или код ошибки
+inline int CopyMetadata(const char* from, const char* to, bool directory) {
+  struct stat from_stat;
+  if (stat(from, &from_stat) != 0) {
+    return errno;
+  }
+  bool chowned = false;
+  if (from_stat.st_uid != geteuid() || from_stat.st_gid != getegid()) {
+    if (chown(to, from_stat.st_uid, from_stat.st_gid) == 0) {
+      chowned = true;
+    } else if (!IsIgnoredMetadataError(errno)) {
+      return errno;
+    }
+  }
+  // Смена владельца сбрасывает setuid и setgid
+  if ((directory || chowned) && chmod(to, from_stat.st_mode & 07777) != 0) {
+    return errno;
+  }
+  int error = CopyXattrs(from, to);
+  if (error != 0) {
+    return error;
+  }
+  struct timespec times[2] = {from_stat.st_atim, from_stat.st_mtim};
+  if (utimensat(AT_FDCWD, to, times, 0) != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+// Проход переноса метаданных. Элементы копятся, пока идёт копирование, и
+// обрабатываются в Apply, когда все файлы уже записаны: файлы — пачками в
+// пуле потоков, затем директории, от вложенных к корню. Так время
+// изменения директории выставляется после того, как в ней всё создано, а
+// права директории без записи не мешают обработать её содержимое. Пути
+// хранятся в своей аренде. Элементы, которых уже нет в источнике или не
+// оказалось в копии, пропускаются
+class MetadataPass {
+ public:
+  // Пути элементов разбираются от from_root и to_root, пустой корень —
+  // пути передаются целиком
+  MetadataPass(const file_sys::path& from_root, const file_sys::path& to_root,
+               const Options& options)
+      : from_root_(from_root.string()), to_root_(to_root.string()),
+        jobs_(JobsCount(options)), arena_(options.memory_limit),
+        items_(arena_) {}
+
+  // Директории нужно добавлять раньше вложенных в них элементов
+  void Add(std::string_view from, std::string_view to, bool directory) {
+    Item item;
+    item.from = arena_.Copy(from).data();
+    item.to = from == to ? item.from : arena_.Copy(to).data();
+    item.directory = directory;
+    items_.PushBack(item);
+  }
+  void Add(std::string_view path, bool directory) {
+    Add(path, path, directory);
+  }
+
+  // Переносит метаданные всех элементов, ошибка пробрасывается так же, как
+  // у пула
+  void Apply() {
+    {
+      ThreadPool pool(jobs_);
+      for (size_t begin = 0; begin < items_.Size(); begin += kBatchSize) {
+        pool.Submit([this, begin]() {
+          size_t end = std::min(begin + kBatchSize, items_.Size());
+          for (size_t i = begin; i < end; ++i) {
+            if (!items_[i].directory) {
+              ApplyItem(items_[i]);
+            }
+          }
+        });
+      }
+      pool.Wait();
+    }
+    for (size_t i = items_.Size(); i-- > 0;) {
+      if (items_[i].directory) {
+        ApplyItem(items_[i]);
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kBatchSize = 1024;
+
+  struct Item {
+    const char* from;
+    const char* to;
+    bool directory;
+  };
+
+  static std::string Join(const std::string& root, const char* path) {
+    return root.empty() ? std::string(path) : root + '/' + path;
+  }
+
+  void ApplyItem(const Item& item) const {
+    std::string from = Join(from_root_, item.from);
+    std::string to = Join(to_root_, item.to);
+    int error = CopyMetadata(from.c_str(), to.c_str(), item.directory);
+    if (error != 0 && error != ENOENT) {
+      ThrowCopyError(from, to, error);
+    }
+  }
+
+  std::string from_root_;
+  std::string to_root_;
+  size_t jobs_;
+  Arena arena_;
+  ArenaVector<Item> items_;
+};
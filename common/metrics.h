@@ -0,0 +1,363 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "options.h"
+
+namespace file_sys = std::filesystem;
+
+// Встроенные метрики: счётчики и гистограммы задержек. Каждый поток пишет
+// в свой блок без блокировок и атомарных операций чтения-изменения-записи,
+// а блоки суммируются только при выводе, поэтому метрики можно держать
+// включёнными всегда
+
+// Счётчики
+enum class Metric : size_t {
+  kFilesScanned,
+  kDirectoriesScanned,
+  kFilesCopied,
+  kBytesCopied,
+  kFilesChanged,
+  kFilesSkipped,
+};
+inline constexpr size_t kMetricCount = 6;
+
+// Гистограммы задержек
+enum class LatencyMetric : size_t {
+  kCopy,  // копирование одного файла
+  kStat,  // statx одного элемента при обходе
+  kIo,    // одна операция с данными, блок до 1 МиБ
+};
+inline constexpr size_t kLatencyMetricCount = 3;
+
+// Корзина k гистограммы — задержки меньше 2^k наносекунд
+inline constexpr size_t kLatencyBuckets = 64;
+
+// Блок метрик одного потока. Пишет только поток-владелец, поэтому
+// увеличение — обычные load и store, без блокировки шины
+struct alignas(64) ThreadMetrics {
+  std::array<std::atomic<uint64_t>, kMetricCount> counters{};
+  std::array<std::array<std::atomic<uint64_t>, kLatencyBuckets>,
+             kLatencyMetricCount>
+      buckets{};
+  std::array<std::atomic<uint64_t>, kLatencyMetricCount> latency_sum_ns{};
+};
+
+inline void AddRelaxed(std::atomic<uint64_t>& value, uint64_t delta) {
+  value.store(value.load(std::memory_order_relaxed) + delta,
+              std::memory_order_relaxed);
+}
+
+// Сумма блоков всех потоков на момент вызова
+struct MetricsSnapshot {
+  std::array<uint64_t, kMetricCount> counters{};
+  std::array<std::array<uint64_t, kLatencyBuckets>, kLatencyMetricCount>
+      buckets{};
+  std::array<uint64_t, kLatencyMetricCount> latency_sum_ns{};
+  uint64_t files_total = 0;
+  uint64_t bytes_total = 0;
+
+  uint64_t Get(Metric metric) const {
+    return counters[static_cast<size_t>(metric)];
+  }
+};
+
+// Реестр блоков метрик всех потоков процесса
+class MetricsRegistry {
+ public:
+  // Блок текущего потока, выдаётся при первом обращении. Пулы потоков
+  // создаются заново на каждом этапе, поэтому блок завершившегося потока
+  // возвращается в реестр и достаётся следующему: блоков не больше, чем
+  // потоков, живших одновременно. Счётчики блока при этом не сбрасываются,
+  // сумма по всем блокам не меняется
+  ThreadMetrics& Local() {
+    if (local_ == nullptr) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+          blocks_.push_back(std::make_unique<ThreadMetrics>());
+          local_ = blocks_.back().get();
+        } else {
+          local_ = free_.back();
+          free_.pop_back();
+        }
+      }
+      thread_local BlockRelease release(this);
+    }
+    return *local_;
+  }
+
+  // Сколько файлов и байт предстоит скопировать, если это известно
+  void SetTotals(uint64_t files, uint64_t bytes) {
+    files_total_ = files;
+    bytes_total_ = bytes;
+  }
+
+  MetricsSnapshot Collect() {
+    MetricsSnapshot snapshot;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& block : blocks_) {
+      for (size_t i = 0; i < kMetricCount; ++i) {
+        snapshot.counters[i] +=
+            block->counters[i].load(std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < kLatencyMetricCount; ++i) {
+        for (size_t k = 0; k < kLatencyBuckets; ++k) {
+          snapshot.buckets[i][k] +=
+              block->buckets[i][k].load(std::memory_order_relaxed);
+        }
+        snapshot.latency_sum_ns[i] +=
+            block->latency_sum_ns[i].load(std::memory_order_relaxed);
+      }
+    }
+    snapshot.files_total = files_total_;
+    snapshot.bytes_total = bytes_total_;
+    return snapshot;
+  }
+
+ private:
+  // Возвращает блок потока в реестр, когда поток завершается. Создаётся
+  // только вместе с блоком, поэтому обращения к блоку остаются обычным
+  // чтением thread_local указателя
+  class BlockRelease {
+   public:
+    explicit BlockRelease(MetricsRegistry* registry) : registry_(registry) {}
+    ~BlockRelease() {
+      std::lock_guard<std::mutex> lock(registry_->mutex_);
+      registry_->free_.push_back(local_);
+      local_ = nullptr;
+    }
+
+   private:
+    MetricsRegistry* registry_;
+  };
+
+  inline static thread_local ThreadMetrics* local_ = nullptr;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadMetrics>> blocks_;
+  std::vector<ThreadMetrics*> free_;
+  std::atomic<uint64_t> files_total_{0};
+  std::atomic<uint64_t> bytes_total_{0};
+};
+
+inline MetricsRegistry& Metrics() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+// Увеличивает счётчик в блоке текущего потока
+inline void CountMetric(Metric metric, uint64_t delta = 1) {
+  AddRelaxed(Metrics().Local().counters[static_cast<size_t>(metric)], delta);
+}
+
+// Добавляет задержку в гистограмму
+inline void RecordLatency(LatencyMetric metric, uint64_t nanoseconds) {
+  ThreadMetrics& local = Metrics().Local();
+  size_t bucket = nanoseconds == 0 ? 0 : 64 - __builtin_clzll(nanoseconds);
+  if (bucket >= kLatencyBuckets) {
+    bucket = kLatencyBuckets - 1;
+  }
+  size_t index = static_cast<size_t>(metric);
+  AddRelaxed(local.buckets[index][bucket], 1);
+  AddRelaxed(local.latency_sum_ns[index], nanoseconds);
+}
+
+// Замеряет время от создания до разрушения и пишет его в гистограмму
+class LatencyTimer {
+ public:
+  explicit LatencyTimer(LatencyMetric metric)
+      : metric_(metric), start_(std::chrono::steady_clock::now()) {}
+  ~LatencyTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    RecordLatency(
+        metric_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+
+ private:
+  LatencyMetric metric_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Метрики в текстовом формате Prometheus
+inline std::string FormatPrometheus(const MetricsSnapshot& snapshot) {
+  static const char* const kCounterNames[kMetricCount][2] = {
+      {"backup_files_scanned_total", "Файлы, найденные при обходе источника"},
+      {"backup_directories_scanned_total",
+       "Директории, найденные при обходе источника"},
+      {"backup_files_copied_total", "Скопированные файлы"},
+      {"backup_bytes_copied_total", "Скопированные байты"},
+      {"backup_files_changed_total",
+       "Файлы, изменившиеся с прошлого бэкапа"},
+      {"backup_files_skipped_total",
+       "Файлы, не изменившиеся с прошлого бэкапа"},
+  };
+  static const char* const kLatencyNames[kLatencyMetricCount][2] = {
+      {"backup_copy_latency_seconds", "Время копирования одного файла"},
+      {"backup_stat_latency_seconds", "Время statx одного элемента"},
+      {"backup_io_latency_seconds",
+       "Время одной операции чтения или записи данных"},
+  };
+  // Корзины от 1 мкс до 17 с, набор один и тот же при каждой записи
+  constexpr size_t kFirstBucket = 10;
+  constexpr size_t kLastBucket = 34;
+
+  std::ostringstream out;
+  for (size_t i = 0; i < kMetricCount; ++i) {
+    out << "# HELP " << kCounterNames[i][0] << ' ' << kCounterNames[i][1]
+        << "\n# TYPE " << kCounterNames[i][0] << " counter\n"
+        << kCounterNames[i][0] << ' ' << snapshot.counters[i] << '\n';
+  }
+  out << "# HELP backup_files_planned Файлы, которые предстоит скопировать\n"
+      << "# TYPE backup_files_planned gauge\n"
+      << "backup_files_planned " << snapshot.files_total << '\n'
+      << "# HELP backup_bytes_planned Байты, которые предстоит скопировать\n"
+      << "# TYPE backup_bytes_planned gauge\n"
+      << "backup_bytes_planned " << snapshot.bytes_total << '\n';
+  for (size_t i = 0; i < kLatencyMetricCount; ++i) {
+    const char* name = kLatencyNames[i][0];
+    out << "# HELP " << name << ' ' << kLatencyNames[i][1] << "\n# TYPE "
+        << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t k = 0; k < kLatencyBuckets; ++k) {
+      cumulative += snapshot.buckets[i][k];
+      if (k >= kFirstBucket && k <= kLastBucket) {
+        out << name << "_bucket{le=\"" << std::setprecision(6)
+            << static_cast<double>(uint64_t{1} << k) / 1e9 << "\"} "
+            << cumulative << '\n';
+      }
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << '\n'
+        << name << "_sum " << std::setprecision(9)
+        << static_cast<double>(snapshot.latency_sum_ns[i]) / 1e9 << '\n'
+        << name << "_count " << cumulative << '\n';
+  }
+  return out.str();
+}
+
+// Строка прогресса для stderr
+inline std::string FormatProgress(const MetricsSnapshot& snapshot,
+                                  double bytes_per_second) {
+  constexpr double kMiB = 1024.0 * 1024.0;
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << "Просмотрено: "
+      << snapshot.Get(Metric::kFilesScanned) << ", скопировано: "
+      << snapshot.Get(Metric::kFilesCopied);
+  if (snapshot.files_total != 0) {
+    out << '/' << snapshot.files_total;
+  }
+  out << " файлов, " << snapshot.Get(Metric::kBytesCopied) / kMiB;
+  if (snapshot.bytes_total != 0) {
+    out << '/' << snapshot.bytes_total / kMiB;
+  }
+  out << " МиБ, " << bytes_per_second / kMiB << " МиБ/с";
+  return out.str();
+}
+
+// Раз в секунду печатает строку прогресса и перезаписывает файл метрик.
+// Строка прогресса выводится с --progress или когда stderr — терминал.
+// Файл метрик пишется во временный файл и переименовывается, поэтому
+// сборщик не увидит его наполовину записанным
+class MetricsReporter {
+ public:
+  explicit MetricsReporter(const Options& options)
+      : progress_(options.progress || isatty(STDERR_FILENO) == 1),
+        metrics_file_(options.metrics_file) {
+    if (!metrics_file_.empty() && !WriteMetricsFile(Metrics().Collect())) {
+      throw std::runtime_error(
+          "Не удалось записать файл метрик " + metrics_file_.string() +
+          "\nПроверьте путь и права на директорию файла метрик");
+    }
+    if (progress_ || !metrics_file_.empty()) {
+      thread_ = std::thread([this]() { Run(); });
+    }
+  }
+
+  MetricsReporter(const MetricsReporter&) = delete;
+  MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+  // Останавливает вывод и записывает итоговые значения
+  ~MetricsReporter() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    stop_cv_.notify_all();
+    thread_.join();
+    Report();
+    if (progress_) {
+      std::cerr << '\n';
+    }
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_cv_.wait_for(lock, std::chrono::seconds(1),
+                              [this]() { return stopped_; })) {
+      lock.unlock();
+      Report();
+      lock.lock();
+    }
+  }
+
+  void Report() {
+    MetricsSnapshot snapshot = Metrics().Collect();
+    auto now = std::chrono::steady_clock::now();
+    uint64_t bytes = snapshot.Get(Metric::kBytesCopied);
+    double seconds = std::chrono::duration<double>(now - last_time_).count();
+    double rate = seconds > 0 ? (bytes - last_bytes_) / seconds : 0;
+    last_time_ = now;
+    last_bytes_ = bytes;
+    if (progress_) {
+      std::cerr << "\r\033[K" << FormatProgress(snapshot, rate) << std::flush;
+    }
+    if (!metrics_file_.empty()) {
+      WriteMetricsFile(snapshot);
+    }
+  }
+
+  bool WriteMetricsFile(const MetricsSnapshot& snapshot) {
+    file_sys::path temp_path = metrics_file_;
+    temp_path += ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::trunc);
+      file << FormatPrometheus(snapshot);
+      if (!file) {
+        return false;
+      }
+    }
+    return std::rename(temp_path.c_str(), metrics_file_.c_str()) == 0;
+  }
+
+  bool progress_;
+  file_sys::path metrics_file_;
+  std::mutex mutex_;
+  std::condition_variable stop_cv_;
+  bool stopped_ = false;
+  std::chrono::steady_clock::time_point last_time_ =
+      std::chrono::steady_clock::now();
+  uint64_t last_bytes_ = 0;
+  std::thread thread_;
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Значение Options::ionice для класса idle
+inline constexpr int kIoniceIdle = 8;
+
+// Параметры запуска, общие для my_backup и my_restore
+struct Options {
+  // Число потоков копирования, 0 — по числу ядер
+  size_t jobs = 0;
+  // Печатать способ копирования каждого файла
+  bool copy_report = false;
+  // Хешировать содержимое файлов: my_backup записывает хеши в манифест и
+  // сравнивает по ним файлы, my_restore проверяет восстановленные файлы
+  bool verify = false;
+  // Обход и копирование через io_uring, если ядро его поддерживает
+  bool io_uring = false;
+  // Сколько запросов io_uring держать в работе одновременно
+  size_t queue_depth = 64;
+  // Печатать строку прогресса в stderr, даже если это не терминал
+  bool progress = false;
+  // Файл метрик в формате Prometheus, перезаписывается раз в секунду
+  std::string metrics_file;
+  // my_backup: изменившиеся файлы не меньше этого размера сохраняются в
+  // инкрементный бэкап патчем к копии из full backup, 0 — всегда целиком
+  uint64_t delta_threshold = 0;
+  // my_backup: сколько обычной памяти занимает список обхода и манифест,
+  // остальное вытесняется во временный файл, 0 — без ограничения
+  uint64_t memory_limit = 0;
+  // Ограничение скорости чтения и записи данных в МиБ/с, 0 — без него
+  uint64_t limit_mbps = 0;
+  // Ограничение числа операций с данными в секунду, 0 — без него
+  uint64_t limit_iops = 0;
+  // Целевая задержка операции с данными в мс: выше неё скорость
+  // снижается, 0 — без подстройки
+  uint64_t latency_target_ms = 0;
+  // Приоритет ввода-вывода: -1 — не менять, 0..7 — уровень best-effort,
+  // kIoniceIdle — idle
+  int ionice = -1;
+  // Насколько понизить приоритет процесса, 0 — не менять
+  int nice = 0;
+  // my_backup: продолжить прерванный бэкап в его директории
+  bool resume = false;
+  // my_backup compact: сколько последних full backup оставить, остальные
+  // бэкапы удаляются, 0 — ничего не удалять
+  size_t keep = 0;
+  // my_restore: восстановить цепочку full + инкрементные бэкапы
+  bool chain = false;
+  // my_restore: восстановить только пути, подходящие под шаблоны
+  std::vector<std::string> includes;
+  // my_restore: копировать файлы мимо page cache через O_DIRECT
+  bool direct = false;
+};
+
+// Возвращает число потоков копирования с учётом значения по умолчанию
+inline size_t JobsCount(const Options& options) {
+  if (options.jobs != 0) {
+    return options.jobs;
+  }
+  size_t cores = std::thread::hardware_concurrency();
+  return cores == 0 ? 1 : cores;
+}
+
+// Переводит значение параметра в положительное число. Знак не принимается:
+// stoul превратил бы "-1" в огромное число
+inline size_t ParseCount(const std::string& name, const std::string& value) {
+  size_t parsed = 0;
+  size_t count = 0;
+  try {
+    if (!value.empty() && std::isdigit(static_cast<unsigned char>(value[0]))) {
+      count = std::stoul(value, &parsed);
+    }
+  } catch (std::logic_error&) {
+    parsed = 0;
+  }
+  if (parsed == 0 || parsed != value.size() || count == 0) {
+    throw std::runtime_error("Передано некорректное значение параметра " +
+                             name +
+                             "\nУкажите положительное целое число");
+  }
+  return count;
+}
+
+// Переводит размер вида 512, 64K, 100M или 2G в байты
+inline uint64_t ParseSize(const std::string& name, const std::string& value) {
+  std::string digits = value;
+  uint64_t unit = 1;
+  if (!digits.empty()) {
+    switch (digits.back()) {
+      case 'K':
+      case 'k':
+        unit = 1ull << 10;
+        break;
+      case 'M':
+      case 'm':
+        unit = 1ull << 20;
+        break;
+      case 'G':
+      case 'g':
+        unit = 1ull << 30;
+        break;
+    }
+    if (unit != 1) {
+      digits.pop_back();
+    }
+  }
+  size_t parsed = 0;
+  uint64_t count = 0;
+  try {
+    // Как и в ParseCount, знак не принимается: "-1" стал бы огромным числом
+    if (!digits.empty() &&
+        std::isdigit(static_cast<unsigned char>(digits[0]))) {
+      count = std::stoull(digits, &parsed);
+    }
+  } catch (std::logic_error&) {
+    parsed = 0;
+  }
+  if (parsed == 0 || parsed != digits.size() || count == 0 ||
+      count > UINT64_MAX / unit) {
+    throw std::runtime_error("Передано некорректное значение параметра " +
+                             name +
+                             "\nУкажите размер в байтах, например 64M");
+  }
+  return count * unit;
+}
+
+// Переводит значение --ionice: idle или уровень best-effort от 0 до 7
+inline int ParseIonice(const std::string& name, const std::string& value) {
+  if (value == "idle") {
+    return kIoniceIdle;
+  }
+  if (value.size() != 1 || value[0] < '0' || value[0] > '7') {
+    throw std::runtime_error("Передано некорректное значение параметра " +
+                             name + "\nУкажите idle или уровень от 0 до 7");
+  }
+  return value[0] - '0';
+}
+
+// Разбирает параметры вида --name value или --name=value, разрешённые для
+// утилиты, и возвращает оставшиеся позиционные аргументы
+inline std::vector<std::string> ParseOptions(
+    int argc, char* argv[], const std::set<std::string>& allowed,
+    Options& options) {
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.size() <= 2 || arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+
+    std::string name = arg;
+    std::string inline_value;
+    bool has_inline_value = false;
+    size_t equal_pos = arg.find('=');
+    if (equal_pos != std::string::npos) {
+      name = arg.substr(0, equal_pos);
+      inline_value = arg.substr(equal_pos + 1);
+      has_inline_value = true;
+    }
+    if (allowed.count(name) == 0) {
+      throw std::runtime_error("Передан неизвестный параметр " + name +
+                               "\nПроверьте правильность введённой команды");
+    }
+    auto value = [&]() -> std::string {
+      if (has_inline_value) {
+        return inline_value;
+      }
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Не передано значение параметра " + name +
+                                 "\nУкажите значение после имени параметра");
+      }
+      return argv[++i];
+    };
+
+    if (name == "--jobs") {
+      options.jobs = ParseCount(name, value());
+    } else if (name == "--copy-report") {
+      options.copy_report = true;
+    } else if (name == "--io-uring") {
+      options.io_uring = true;
+    } else if (name == "--queue-depth") {
+      options.queue_depth = ParseCount(name, value());
+    } else if (name == "--progress") {
+      options.progress = true;
+    } else if (name == "--metrics-file") {
+      options.metrics_file = value();
+    } else if (name == "--delta-threshold") {
+      options.delta_threshold = ParseSize(name, value());
+    } else if (name == "--memory-limit") {
+      options.memory_limit = ParseSize(name, value());
+    } else if (name == "--limit-mbps") {
+      options.limit_mbps = ParseCount(name, value());
+    } else if (name == "--limit-iops") {
+      options.limit_iops = ParseCount(name, value());
+    } else if (name == "--latency-target") {
+      options.latency_target_ms = ParseCount(name, value());
+    } else if (name == "--ionice") {
+      options.ionice = ParseIonice(name, value());
+    } else if (name == "--nice") {
+      options.nice = static_cast<int>(std::min<size_t>(
+          ParseCount(name, value()), 19));
+    } else if (name == "--resume") {
+      options.resume = true;
+    } else if (name == "--keep") {
+      options.keep = ParseCount(name, value());
+    } else if (name == "--verify") {
+      options.verify = true;
+    } else if (name == "--chain") {
+      options.chain = true;
+    } else if (name == "--include") {
+      options.includes.push_back(value());
+    } else if (name == "--direct") {
+      options.direct = true;
+    }
+  }
+  return positional;
+}
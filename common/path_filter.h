@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "manifest.h"
+
+// Фильтр путей для выборочного восстановления. Шаблоны задаются
+// относительно корня бэкапа: '*' и '?' не переходят через '/', '**'
+// совпадает с любым числом уровней. Путь подходит, если шаблону
+// соответствует он сам или одна из его родительских директорий
+
+// Сопоставление пути с шаблоном
+inline bool GlobMatch(std::string_view pattern, std::string_view path) {
+  while (!pattern.empty()) {
+    if (pattern.compare(0, 2, "**") == 0) {
+      pattern.remove_prefix(2);
+      // "a/**/b" совпадает и с "a/b"
+      if (!pattern.empty() && pattern.front() == '/' &&
+          GlobMatch(pattern.substr(1), path)) {
+        return true;
+      }
+      for (size_t i = 0; i <= path.size(); ++i) {
+        if (GlobMatch(pattern, path.substr(i))) {
+          return true;
+        }
+      }
+      return false;
+    }
+    if (pattern.front() == '*') {
+      pattern.remove_prefix(1);
+      for (size_t i = 0; i <= path.size(); ++i) {
+        if (GlobMatch(pattern, path.substr(i))) {
+          return true;
+        }
+        if (i < path.size() && path[i] == '/') {
+          break;
+        }
+      }
+      return false;
+    }
+    if (path.empty()) {
+      return false;
+    }
+    if (pattern.front() == '?' ? path.front() == '/'
+                               : pattern.front() != path.front()) {
+      return false;
+    }
+    pattern.remove_prefix(1);
+    path.remove_prefix(1);
+  }
+  return path.empty();
+}
+
+class PathFilter {
+ public:
+  PathFilter() = default;
+  explicit PathFilter(std::vector<std::string> patterns) {
+    for (std::string& pattern : patterns) {
+      while (pattern.size() > 1 && pattern.back() == '/') {
+        pattern.pop_back();
+      }
+      while (pattern.compare(0, 2, "./") == 0) {
+        pattern.erase(0, 2);
+      }
+      patterns_.push_back(std::move(pattern));
+    }
+  }
+
+  bool Empty() const { return patterns_.empty(); }
+
+  bool Matches(std::string_view path) const {
+    if (Empty()) {
+      return true;
+    }
+    for (const std::string& pattern : patterns_) {
+      std::string_view prefix = path;
+      while (true) {
+        if (GlobMatch(pattern, prefix)) {
+          return true;
+        }
+        size_t slash = prefix.rfind('/');
+        if (slash == std::string_view::npos) {
+          break;
+        }
+        prefix = prefix.substr(0, slash);
+      }
+    }
+    return false;
+  }
+
+  // Постоянные начала шаблонов до первого спецсимвола. Любой подходящий
+  // путь начинается с одного из них, поэтому в отсортированном индексе
+  // достаточно просмотреть соответствующие диапазоны. Начала, покрытые
+  // более коротким началом, отбрасываются
+  std::vector<std::string> Prefixes() const {
+    std::vector<std::string> prefixes;
+    for (const std::string& pattern : patterns_) {
+      prefixes.push_back(pattern.substr(0, pattern.find_first_of("*?")));
+    }
+    std::sort(prefixes.begin(), prefixes.end());
+    std::vector<std::string> result;
+    for (std::string& prefix : prefixes) {
+      if (result.empty() || prefix.compare(0, result.back().size(),
+                                           result.back()) != 0) {
+        result.push_back(std::move(prefix));
+      }
+    }
+    return result;
+  }
+
+ private:
+  std::vector<std::string> patterns_;
+};
+
+// Перебирает записи манифеста, подходящие под фильтр, не читая остальные:
+// для каждого постоянного начала шаблона диапазон находится двоичным поиском
+template <typename Callback>
+void ForEachMatch(const Manifest& manifest, const PathFilter& filter,
+                  Callback&& callback) {
+  if (filter.Empty()) {
+    for (size_t i = 0; i < manifest.Size(); ++i) {
+      callback(manifest.Entry(i));
+    }
+    return;
+  }
+  for (const std::string& prefix : filter.Prefixes()) {
+    for (size_t i = manifest.LowerBound(prefix); i < manifest.Size(); ++i) {
+      const ManifestEntry& entry = manifest.Entry(i);
+      std::string_view path = manifest.Path(entry);
+      if (path.compare(0, prefix.size(), prefix) != 0) {
+        break;
+      }
+      if (filter.Matches(path)) {
+        callback(entry);
+      }
+    }
+  }
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "arena.h"
+#include "copy_backend.h"
+#include "io_uring.h"
+#include "manifest.h"
+#include "metrics.h"
+
+namespace file_sys = std::filesystem;
+
+// Один проход по дереву источника: имена читаются пачками через getdents64,
+// метаданные — через statx относительно дескриптора директории, без разбора
+// полного пути (с --io-uring — пачкой на каждую порцию имён). Полученный
+// список используется и для оценки места, и для копирования, поэтому дерево
+// обходится один раз. Обход идёт без рекурсии, по явному стеку, а записи и
+// пути хранятся в аренде, поэтому память не зависит от глубины дерева и
+// ограничивается --memory-limit
+
+// Элемент дерева источника. Путь относительный, с разделителем '/', лежит
+// в аренде списка и заканчивается '\0'
+struct ScanEntry {
+  std::string_view path;
+  uint32_t mode = 0;
+  uint64_t size = 0;
+  // Место, реально занятое на диске: у файлов с дырами меньше size
+  uint64_t allocated = 0;
+  int64_t mtime_ns = 0;
+  // Время изменения метаданных: права, владелец, расширенные атрибуты. У
+  // записей, взятых из манифеста, с точностью до секунды
+  int64_t ctime_ns = 0;
+  uint64_t inode = 0;
+};
+
+inline bool IsDirectory(const ScanEntry& entry) { return S_ISDIR(entry.mode); }
+inline bool IsRegularFile(const ScanEntry& entry) {
+  return S_ISREG(entry.mode);
+}
+inline bool IsReadable(const ScanEntry& entry) {
+  return (entry.mode & S_IRUSR) != 0;
+}
+
+// Запись манифеста по элементу списка
+inline ManifestEntry ToManifestEntry(const ScanEntry& entry) {
+  ManifestEntry record{};
+  record.size = entry.size;
+  record.mtime_ns = entry.mtime_ns;
+  record.inode = entry.inode;
+  record.mode = entry.mode;
+  record.ctime_s = static_cast<uint32_t>(entry.ctime_ns / 1000000000);
+  if (IsDirectory(entry)) {
+    record.flags |= kManifestDirectory;
+  }
+  return record;
+}
+
+[[noreturn]] inline void ThrowScanError(const file_sys::path& path,
+                                        int error) {
+  throw file_sys::filesystem_error(
+      "cannot scan directory", path,
+      std::error_code(error, std::generic_category()));
+}
+
+// Заголовок записи getdents64
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Маска полей statx, которые нужны списку
+inline constexpr unsigned kScanStatxMask =
+    STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS | STATX_MTIME |
+    STATX_CTIME | STATX_INO;
+
+// Получает statx для имён из одной директории. С кольцом io_uring запросы
+// уходят в ядро пачками, иначе выполняются по одному. В errors — 0 или код
+// ошибки для каждого имени
+inline void StatNames(int dir_fd, const std::vector<const char*>& names,
+                      std::vector<struct statx>& results,
+                      std::vector<int>& errors, IoUring* ring) {
+  results.resize(names.size());
+  errors.assign(names.size(), 0);
+  if (ring == nullptr) {
+    for (size_t i = 0; i < names.size(); ++i) {
+      LatencyTimer timer(LatencyMetric::kStat);
+      if (statx(dir_fd, names[i], AT_NO_AUTOMOUNT, kScanStatxMask,
+                &results[i]) != 0) {
+        errors[i] = errno;
+      }
+    }
+    return;
+  }
+  size_t next = 0;
+  size_t done = 0;
+  while (done < names.size()) {
+    while (next < names.size()) {
+      io_uring_sqe* sqe = ring->GetSqe();
+      if (sqe == nullptr) {
+        break;
+      }
+      PrepStatx(sqe, dir_fd, names[next], AT_NO_AUTOMOUNT, kScanStatxMask,
+                &results[next], next);
+      ++next;
+    }
+    // Задержка statx в пачке — время от отправки до получения ответа
+    auto submitted = std::chrono::steady_clock::now();
+    int error = ring->Submit(1);
+    if (error != 0) {
+      ThrowScanError("io_uring", error);
+    }
+    uint64_t index;
+    int32_t result;
+    while (ring->PopCompletion(index, result)) {
+      errors[index] = result < 0 ? -result : 0;
+      RecordLatency(LatencyMetric::kStat,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - submitted)
+                        .count());
+      ++done;
+    }
+  }
+}
+
+// Список элементов дерева источника в порядке обхода. Записи и пути лежат
+// в одной аренде, которую можно отдать и манифесту
+class ScanList {
+ public:
+  explicit ScanList(uint64_t memory_limit = 0)
+      : arena_(std::make_unique<Arena>(memory_limit)), entries_(*arena_) {}
+
+  ScanEntry& Add(const ScanEntry& entry, std::string_view path) {
+    ScanEntry& added = entries_.PushBack(entry);
+    added.path = arena_->Copy(path);
+    return added;
+  }
+
+  Arena& GetArena() const { return *arena_; }
+  size_t Size() const { return entries_.Size(); }
+  ArenaVector<ScanEntry>::ConstIterator begin() const {
+    return entries_.begin();
+  }
+  ArenaVector<ScanEntry>::ConstIterator end() const { return entries_.end(); }
+
+ private:
+  std::unique_ptr<Arena> arena_;
+  ArenaVector<ScanEntry> entries_;
+};
+
+// Директория на стеке обхода. Дескриптор открывается, когда до директории
+// доходит очередь, и закрывается после неё и всех вложенных, поэтому
+// открытых дескрипторов не больше глубины дерева
+struct ScanFrame {
+  FileDescriptor fd;
+  // Путь директории относительно корня, "" у корня
+  std::string_view path;
+  // Номер родительской директории на стеке
+  size_t parent = 0;
+};
+
+// Поднимает мягкий лимит открытых файлов до жёсткого. Возвращает false,
+// если поднимать некуда
+inline bool RaiseOpenFilesLimit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+      limit.rlim_cur == limit.rlim_max) {
+    return false;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  return setrlimit(RLIMIT_NOFILE, &limit) == 0;
+}
+
+// Открывает директорию frame относительно дескриптора родителя. На каждый
+// уровень вложенности открыт один дескриптор, поэтому дерево глубже
+// жёсткого лимита открытых файлов не обходится
+inline void OpenScanFrame(std::vector<ScanFrame>& stack, size_t index,
+                          const file_sys::path& root) {
+  ScanFrame& frame = stack[index];
+  // Путь в аренде заканчивается '\0', поэтому имя — его хвост
+  const char* name = frame.path.data() + frame.path.rfind('/') + 1;
+  int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+  int fd = openat(stack[frame.parent].fd.Get(), name, flags);
+  if (fd < 0 && errno == EMFILE && RaiseOpenFilesLimit()) {
+    fd = openat(stack[frame.parent].fd.Get(), name, flags);
+  }
+  if (fd < 0 && errno == EMFILE) {
+    throw std::runtime_error(
+        "Вложенность директорий в " + root.string() +
+        " больше лимита открытых файлов\nПоднимите жёсткий лимит "
+        "(ulimit -Hn) или уменьшите вложенность");
+  }
+  if (fd < 0) {
+    ThrowScanError(root / std::string(frame.path), errno);
+  }
+  frame.fd.Reset(fd);
+}
+
+// Обходит дерево с корнем root_fd, добавляя элементы в entries. Имена
+// читаются порциями getdents64 в один общий буфер; каждая порция сразу
+// попадает в список, а её поддиректории кладутся на стек и обходятся до
+// следующей порции. Поэтому директория всегда стоит в списке раньше
+// вложенных в неё элементов. Как и recursive_directory_iterator, по
+// символическим ссылкам на директории обход не спускается, а битые ссылки
+// пропускаются. Если root_fd открыт не на корне, а на его поддиректории,
+// prefix — путь этой поддиректории относительно root
+inline void ScanDirectory(FileDescriptor root_fd, const file_sys::path& root,
+                          ScanList& entries, IoUring* ring = nullptr,
+                          std::string_view prefix = "") {
+  std::vector<char> buffer(64 * 1024);
+  std::vector<const char*> names;
+  std::vector<unsigned char> types;
+  std::vector<struct statx> stats;
+  std::vector<int> errors;
+  std::string path;
+  std::vector<ScanFrame> stack;
+  stack.push_back({std::move(root_fd), prefix, 0});
+  while (!stack.empty()) {
+    size_t index = stack.size() - 1;
+    if (!stack[index].fd.IsValid()) {
+      OpenScanFrame(stack, index, root);
+    }
+    int dir_fd = stack[index].fd.Get();
+    std::string_view dir_path = stack[index].path;
+    long read_bytes =
+        syscall(SYS_getdents64, dir_fd, buffer.data(), buffer.size());
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ThrowScanError(root / std::string(dir_path), errno);
+    }
+    if (read_bytes == 0) {
+      stack.pop_back();
+      continue;
+    }
+    names.clear();
+    types.clear();
+    for (long offset = 0; offset < read_bytes;) {
+      auto* dirent = reinterpret_cast<LinuxDirent64*>(buffer.data() + offset);
+      offset += dirent->d_reclen;
+      const char* name = dirent->d_name;
+      if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+        continue;
+      }
+      // Не все файловые системы заполняют d_type (XFS без ftype, FUSE, NFS),
+      // а символические ссылки нужно отличать от того, на что они указывают
+      unsigned char type = dirent->d_type;
+      struct stat link_stat;
+      if (type == DT_UNKNOWN &&
+          fstatat(dir_fd, name, &link_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = IFTODT(link_stat.st_mode);
+      }
+      names.push_back(name);
+      types.push_back(type);
+    }
+    StatNames(dir_fd, names, stats, errors, ring);
+
+    size_t first_child = stack.size();
+    for (size_t i = 0; i < names.size(); ++i) {
+      path.assign(dir_path);
+      if (!path.empty()) {
+        path += '/';
+      }
+      path += names[i];
+      if (errors[i] != 0) {
+        if (errors[i] == ENOENT && types[i] == DT_LNK) {
+          continue;
+        }
+        ThrowScanError(root / path, errors[i]);
+      }
+      const struct statx& file_statx = stats[i];
+      ScanEntry entry;
+      entry.mode = file_statx.stx_mode;
+      entry.size = file_statx.stx_size;
+      entry.allocated = file_statx.stx_blocks * 512;
+      entry.mtime_ns = static_cast<int64_t>(file_statx.stx_mtime.tv_sec) *
+                           1000000000 +
+                       file_statx.stx_mtime.tv_nsec;
+      entry.ctime_ns = static_cast<int64_t>(file_statx.stx_ctime.tv_sec) *
+                           1000000000 +
+                       file_statx.stx_ctime.tv_nsec;
+      entry.inode = file_statx.stx_ino;
+      if (!IsDirectory(entry) && !IsRegularFile(entry)) {
+        continue;
+      }
+      if (IsDirectory(entry)) {
+        entry.size = 0;
+        entry.allocated = 0;
+        CountMetric(Metric::kDirectoriesScanned);
+      } else {
+        CountMetric(Metric::kFilesScanned);
+      }
+      const ScanEntry& added = entries.Add(entry, path);
+      if (IsDirectory(added) && IsReadable(added) && types[i] != DT_LNK) {
+        stack.push_back({FileDescriptor(), added.path, index});
+      }
+    }
+    // Поддиректории снимаются со стека в том же порядке, в каком прочитаны
+    std::reverse(stack.begin() + first_child, stack.end());
+  }
+}
+
+// Строит список элементов дерева root. Директории без права на чтение
+// попадают в список, но не обходятся: проверку прав выполняет вызывающий код.
+// Если передано кольцо io_uring, statx выполняются через него. memory_limit
+// ограничивает обычную память под список, остальное вытесняется во
+// временный файл
+inline ScanList ScanTree(const file_sys::path& root, IoUring* ring = nullptr,
+                         uint64_t memory_limit = 0) {
+  FileDescriptor root_fd(
+      open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (!root_fd.IsValid()) {
+    ThrowScanError(root, errno);
+  }
+  ScanList entries(memory_limit);
+  ScanDirectory(std::move(root_fd), root, entries, ring);
+  return entries;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// SHA-256 (FIPS 180-4). Используется как адрес блока в хранилище
+// дедупликации, поэтому нужна криптографическая стойкость к коллизиям
+class Sha256 {
+ public:
+  using Digest = std::array<uint8_t, 32>;
+
+  Sha256() { Reset(); }
+
+  void Reset() {
+    state_ = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    buffer_size_ = 0;
+    total_size_ = 0;
+  }
+
+  void Update(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    total_size_ += size;
+    if (buffer_size_ > 0) {
+      size_t take = std::min(size, sizeof(buffer_) - buffer_size_);
+      std::memcpy(buffer_ + buffer_size_, bytes, take);
+      buffer_size_ += take;
+      bytes += take;
+      size -= take;
+      if (buffer_size_ < sizeof(buffer_)) {
+        return;
+      }
+      Transform(buffer_);
+      buffer_size_ = 0;
+    }
+    while (size >= sizeof(buffer_)) {
+      Transform(bytes);
+      bytes += sizeof(buffer_);
+      size -= sizeof(buffer_);
+    }
+    std::memcpy(buffer_, bytes, size);
+    buffer_size_ = size;
+  }
+
+  Digest Final() {
+    uint64_t bit_size = total_size_ * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padding_size =
+        buffer_size_ < 56 ? 56 - buffer_size_ : 120 - buffer_size_;
+    for (int i = 0; i < 8; ++i) {
+      padding[padding_size + i] = static_cast<uint8_t>(bit_size >> (56 - 8 * i));
+    }
+    Update(padding, padding_size + 8);
+
+    Digest digest;
+    for (size_t i = 0; i < state_.size(); ++i) {
+      digest[4 * i] = static_cast<uint8_t>(state_[i] >> 24);
+      digest[4 * i + 1] = static_cast<uint8_t>(state_[i] >> 16);
+      digest[4 * i + 2] = static_cast<uint8_t>(state_[i] >> 8);
+      digest[4 * i + 3] = static_cast<uint8_t>(state_[i]);
+    }
+    return digest;
+  }
+
+  static Digest Hash(const void* data, size_t size) {
+    Sha256 sha;
+    sha.Update(data, size);
+    return sha.Final();
+  }
+
+ private:
+  static uint32_t RotateRight(uint32_t value, int shift) {
+    return (value >> shift) | (value << (32 - shift));
+  }
+
+  void Transform(const uint8_t* block) {
+    static constexpr uint32_t kRound[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t words[64];
+    for (int i = 0; i < 16; ++i) {
+      words[i] = (static_cast<uint32_t>(block[4 * i]) << 24) |
+                 (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+                 (static_cast<uint32_t>(block[4 * i + 2]) << 8) |
+                 static_cast<uint32_t>(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = RotateRight(words[i - 15], 7) ^
+                    RotateRight(words[i - 15], 18) ^ (words[i - 15] >> 3);
+      uint32_t s1 = RotateRight(words[i - 2], 17) ^
+                    RotateRight(words[i - 2], 19) ^ (words[i - 2] >> 10);
+      words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+      uint32_t choice = (e & f) ^ (~e & g);
+      uint32_t temp1 = h + s1 + choice + kRound[i] + words[i];
+      uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+      uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t temp2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + temp1;
+      d = c;
+      c = b;
+      b = a;
+      a = temp1 + temp2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+  }
+
+  std::array<uint32_t, 8> state_;
+  uint8_t buffer_[64];
+  size_t buffer_size_;
+  uint64_t total_size_;
+};
+
+// Шестнадцатеричная запись хеша
+template <size_t Size>
+std::string ToHex(const std::array<uint8_t, Size>& bytes) {
+  static constexpr char kDigits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(Size * 2);
+  for (uint8_t byte : bytes) {
+    hex += kDigits[byte >> 4];
+    hex += kDigits[byte & 0xf];
+  }
+  return hex;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы: у каждого потока своя очередь, свободный
+// поток забирает задачи из начала чужих очередей. Первая ошибка задачи
+// отменяет оставшиеся задачи и пробрасывается из Wait()
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t threads) {
+    if (threads == 0) {
+      threads = 1;
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this, i]() { WorkerLoop(i); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      cancelled_ = true;
+    }
+    wake_cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t Size() const { return workers_.size(); }
+
+  // Ставит задачу в очередь. Задачи, порождённые внутри пула, попадают в
+  // очередь текущего потока, внешние распределяются по кругу
+  void Submit(std::function<void()> task) {
+    size_t index = current_pool_ == this ? current_index_
+                                          : next_queue_++ % queues_.size();
+    pending_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+      queues_[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++queued_;
+    }
+    wake_cv_.notify_one();
+  }
+
+  // Ждёт, пока невыполненных задач останется не больше limit. Так быстрый
+  // обход дерева не набивает очередь задачами на все файлы сразу. Внутри
+  // пула не ждёт: задача не должна ждать сама себя
+  void WaitPending(size_t limit) {
+    if (current_pool_ == this) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_limit_ = limit;
+    done_cv_.wait(lock, [this, limit]() { return pending_.load() <= limit; });
+    wait_limit_ = 0;
+  }
+
+  // Дожидается выполнения всех поставленных задач и пробрасывает первую ошибку
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]() { return pending_.load() == 0; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      cancelled_ = false;
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool TryTake(size_t index, std::function<void()>& task) {
+    {
+      Queue& own = *queues_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t shift = 1; shift < queues_.size(); ++shift) {
+      Queue& victim = *queues_[(index + shift) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerLoop(size_t index) {
+    current_pool_ = this;
+    current_index_ = index;
+    while (true) {
+      std::function<void()> task;
+      if (TryTake(index, task)) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          --queued_;
+        }
+        Run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_cv_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) {
+        return;
+      }
+    }
+  }
+
+  void Run(std::function<void()>& task) {
+    bool cancelled;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancelled = cancelled_;
+    }
+    if (!cancelled) {
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+        cancelled_ = true;
+      }
+    }
+    size_t left = pending_.fetch_sub(1) - 1;
+    if (left == 0 || left <= wait_limit_.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_cv_.notify_all();
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable done_cv_;
+  std::atomic<size_t> pending_{0};
+  // Порог WaitPending, 0 — никто не ждёт
+  std::atomic<size_t> wait_limit_{0};
+  size_t queued_ = 0;
+  size_t next_queue_ = 0;
+  bool stop_ = false;
+  bool cancelled_ = false;
+  std::exception_ptr error_;
+
+  inline static thread_local ThreadPool* current_pool_ = nullptr;
+  inline static thread_local size_t current_index_ = 0;
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "metrics.h"
+#include "options.h"
+
+// Ограничение ввода-вывода для работы рядом с нагруженным сервисом. Все
+// пути копирования перед каждой операцией с данными (блок до 1 МиБ)
+// получают разрешение у общего ограничителя: маркерной корзины по байтам
+// (--limit-mbps) и по операциям (--limit-iops). С --latency-target
+// ограничитель раз в 250 мс смотрит в гистограмму задержек операций и
+// подстраивает пределы как AIMD: если 99-й перцентиль выше цели, скорость
+// уменьшается вдвое, иначе растёт на шаг. Без параметров ограничитель
+// выключен, и проверка стоит одно чтение флага
+
+class IoThrottle {
+ public:
+  // Операции крупнее разбиваются на блоки, чтобы ограничитель не отдавал
+  // всю полосу одному большому файлу
+  static constexpr uint64_t kChunkSize = 1 << 20;
+
+  // Вызывается из main до запуска потоков
+  void Configure(const Options& options) {
+    bytes_.limit = static_cast<double>(options.limit_mbps) * (1 << 20);
+    bytes_.rate = bytes_.limit;
+    bytes_.minimum = 1 << 20;
+    ops_.limit = static_cast<double>(options.limit_iops);
+    ops_.rate = ops_.limit;
+    ops_.minimum = 10;
+    latency_target_ns_ = options.latency_target_ms * 1000000;
+    enabled_ =
+        bytes_.limit != 0 || ops_.limit != 0 || latency_target_ns_ != 0;
+    last_adjust_ = Clock::now();
+  }
+
+  bool Enabled() const { return enabled_; }
+
+  // Размер следующей операции, если осталось передать size байт
+  uint64_t Chunk(uint64_t size) const {
+    return enabled_ ? std::min(size, kChunkSize) : size;
+  }
+
+  // Ждёт, пока можно передать bytes байт одной операцией
+  void Acquire(uint64_t bytes) {
+    Clock::time_point start;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Clock::time_point now = Clock::now();
+      if (latency_target_ns_ != 0 &&
+          now - last_adjust_ >= kAdjustInterval) {
+        Adjust(now);
+      }
+      start = std::max(bytes_.Reserve(bytes, now), ops_.Reserve(1, now));
+    }
+    std::this_thread::sleep_until(start);
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::chrono::milliseconds kAdjustInterval{250};
+  // Сколько можно передать сверх предела разом, после простоя
+  static constexpr std::chrono::milliseconds kBurst{100};
+  // Меньше операций за окно — задержкам не хватает данных
+  static constexpr uint64_t kMinSamples = 8;
+
+  // Корзина по методу GCRA: вместо числа маркеров хранится момент, когда
+  // корзина снова станет полной
+  struct Bucket {
+    // Заданный предел в единицах в секунду, 0 — не задан
+    double limit = 0;
+    // Текущий предел, 0 — без ограничения
+    double rate = 0;
+    double minimum = 0;
+    // Предел перед последним снижением, от него считается шаг роста
+    double peak = 0;
+    Clock::time_point full{};
+    // Сколько передано с прошлой подстройки
+    double window = 0;
+
+    // Резервирует cost единиц и возвращает, когда можно начать операцию
+    Clock::time_point Reserve(double cost, Clock::time_point now) {
+      window += cost;
+      if (rate == 0) {
+        return now;
+      }
+      Clock::time_point start =
+          full - std::chrono::duration_cast<Clock::duration>(kBurst);
+      full = std::max(full, now) +
+             std::chrono::duration_cast<Clock::duration>(
+                 std::chrono::duration<double>(cost / rate));
+      return start;
+    }
+
+    void Decrease(double seconds) {
+      double observed = window / seconds;
+      double base = rate == 0 ? observed : std::min(rate, observed);
+      peak = std::max(base, minimum);
+      rate = std::max(base / 2, minimum);
+    }
+
+    void Increase() {
+      if (rate == 0) {
+        return;
+      }
+      rate += std::max(peak / 16, minimum);
+      if (limit != 0) {
+        rate = std::min(rate, limit);
+      }
+    }
+  };
+
+  // Подстраивает пределы по 99-му перцентилю задержки операций с прошлой
+  // подстройки
+  void Adjust(Clock::time_point now) {
+    double seconds = std::chrono::duration<double>(now - last_adjust_).count();
+    last_adjust_ = now;
+    MetricsSnapshot snapshot = Metrics().Collect();
+    const auto& buckets =
+        snapshot.buckets[static_cast<size_t>(LatencyMetric::kIo)];
+    std::array<uint64_t, kLatencyBuckets> window{};
+    uint64_t total = 0;
+    for (size_t k = 0; k < kLatencyBuckets; ++k) {
+      window[k] = buckets[k] - last_buckets_[k];
+      total += window[k];
+    }
+    last_buckets_ = buckets;
+    if (total < kMinSamples) {
+      bytes_.window = 0;
+      ops_.window = 0;
+      return;
+    }
+    if (Percentile(window, total, 0.99) > latency_target_ns_) {
+      bytes_.Decrease(seconds);
+      ops_.Decrease(seconds);
+    } else {
+      bytes_.Increase();
+      ops_.Increase();
+    }
+    bytes_.window = 0;
+    ops_.window = 0;
+  }
+
+  // Перцентиль по корзинам гистограммы, внутри корзины — линейно
+  static double Percentile(
+      const std::array<uint64_t, kLatencyBuckets>& window, uint64_t total,
+      double fraction) {
+    double wanted = fraction * total;
+    double cumulative = 0;
+    for (size_t k = 0; k < kLatencyBuckets; ++k) {
+      if (window[k] == 0 || cumulative + window[k] < wanted) {
+        cumulative += window[k];
+        continue;
+      }
+      double upper = static_cast<double>(uint64_t{1} << k);
+      double lower = k == 0 ? 0 : upper / 2;
+      return lower + (upper - lower) * (wanted - cumulative) / window[k];
+    }
+    return 0;
+  }
+
+  bool enabled_ = false;
+  std::mutex mutex_;
+  Bucket bytes_;
+  Bucket ops_;
+  double latency_target_ns_ = 0;
+  Clock::time_point last_adjust_{};
+  std::array<uint64_t, kLatencyBuckets> last_buckets_{};
+};
+
+inline IoThrottle& Throttle() {
+  static IoThrottle throttle;
+  return throttle;
+}
+
+// Одна синхронная операция с данными: конструктор ждёт разрешения
+// ограничителя, деструктор пишет задержку операции в гистограмму
+class ThrottledIo {
+ public:
+  explicit ThrottledIo(uint64_t bytes) {
+    if (Throttle().Enabled()) {
+      Throttle().Acquire(bytes);
+    }
+    start_ = std::chrono::steady_clock::now();
+  }
+  ~ThrottledIo() {
+    RecordLatency(LatencyMetric::kIo,
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count());
+  }
+
+  ThrottledIo(const ThrottledIo&) = delete;
+  ThrottledIo& operator=(const ThrottledIo&) = delete;
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Понижает приоритет процесса и включает ограничитель. Потоки, созданные
+// позже, наследуют приоритеты, поэтому вызывается из main до их запуска
+inline void ApplyThrottleOptions(const Options& options) {
+  if (options.nice != 0 && setpriority(PRIO_PROCESS, 0, options.nice) != 0) {
+    throw std::runtime_error(
+        "Не удалось изменить приоритет процесса\nЗапустите без параметра "
+        "--nice");
+  }
+  if (options.ionice >= 0) {
+    // Класс приоритета в старших битах: 2 — best-effort, 3 — idle
+    constexpr int kClassShift = 13;
+    int priority = options.ionice == kIoniceIdle
+                       ? 3 << kClassShift
+                       : (2 << kClassShift) | options.ionice;
+    if (syscall(SYS_ioprio_set, 1, 0, priority) != 0) {
+      throw std::runtime_error(
+          "Не удалось изменить приоритет ввода-вывода\nЗапустите без "
+          "параметра --ionice");
+    }
+  }
+  Throttle().Configure(options);
+}
@@ -0,0 +1,450 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "copy_backend.h"
+#include "io_uring.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "xxhash.h"
+
+namespace file_sys = std::filesystem;
+
+// Копирование через io_uring в одном потоке. Сначала создаются директории,
+// по уровню вложенности за пачку. Затем до Capacity() / 2 файлов
+// одновременно проходят цепочку statx → openat → read/write → close, а
+// запросы всех файлов уходят в ядро общими пачками. Так на деревьях из
+// мелких файлов устройство загружено, хотя системные вызовы не ждут друг
+// друга
+class UringCopier {
+ public:
+  // Вызывается после копирования каждого файла
+  using DoneCallback =
+      std::function<void(CopyStrategy strategy, const file_sys::path& to)>;
+
+  UringCopier(IoUring& ring, DoneCallback on_done)
+      : ring_(ring), on_done_(std::move(on_done)) {
+    // umask нужен, чтобы не делать fchmod, когда open и так выставит права
+    umask_ = umask(0);
+    umask(umask_);
+  }
+
+  // Запоминает директорию, она будет создана вместе с родителями
+  void AddDirectory(file_sys::path path) {
+    directories_.push_back(std::move(path));
+  }
+
+  // Запоминает файл для копирования. Если передан hash, туда будет
+  // записан хеш содержимого. done, если передан, вызывается после
+  // копирования раньше on_done
+  void AddFile(file_sys::path from, file_sys::path to, bool overwrite,
+               uint64_t* hash, std::function<void()> done = nullptr) {
+    files_.push_back(
+        {std::move(from), std::move(to), overwrite, hash, std::move(done)});
+  }
+
+  // Сколько файлов накоплено
+  size_t PendingFiles() const { return files_.size(); }
+
+  // Создаёт накопленные директории, затем копирует накопленные файлы
+  void Run() {
+    CreateDirectories();
+    CopyFiles();
+    directories_.clear();
+    files_.clear();
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 256 * 1024;
+  static constexpr uint64_t kTagSource = 0;
+  static constexpr uint64_t kTagTarget = 1;
+
+  struct Job {
+    file_sys::path from;
+    file_sys::path to;
+    bool overwrite;
+    uint64_t* hash;
+    std::function<void()> done;
+  };
+
+  enum class State { kIdle, kStat, kOpen, kRead, kWrite, kClose };
+
+  struct Slot {
+    State state = State::kIdle;
+    size_t job = 0;
+    unsigned pending = 0;
+    int error = 0;
+    int source = -1;
+    int target = -1;
+    struct statx stat {};
+    uint64_t offset = 0;
+    uint32_t chunk = 0;
+    uint32_t written = 0;
+    Xxh64 hasher;
+    std::chrono::steady_clock::time_point start;
+    // Когда отправлено текущее чтение
+    std::chrono::steady_clock::time_point read_start;
+    std::vector<char> buffer;
+  };
+
+  io_uring_sqe* NextSqe() {
+    io_uring_sqe* sqe = ring_.GetSqe();
+    if (sqe == nullptr) {
+      // У слота не больше двух запросов в работе, кольцо рассчитано на это
+      throw std::logic_error("io_uring submission queue overflow");
+    }
+    return sqe;
+  }
+
+  void SubmitAndWait() {
+    int error = ring_.Submit(1);
+    if (error != 0) {
+      throw file_sys::filesystem_error(
+          "io_uring_enter failed",
+          std::error_code(error, std::generic_category()));
+    }
+  }
+
+  static size_t Depth(const file_sys::path& path) {
+    return std::distance(path.begin(), path.end());
+  }
+
+  // Директории одного уровня создаются одной пачкой mkdirat. Уровни идут
+  // по порядку, поэтому родитель из списка всегда создан раньше детей. Если
+  // родителя нет в списке, директория создаётся обычным путём
+  void CreateDirectories() {
+    std::sort(directories_.begin(), directories_.end());
+    directories_.erase(std::unique(directories_.begin(), directories_.end()),
+                       directories_.end());
+    std::stable_sort(directories_.begin(), directories_.end(),
+                     [](const file_sys::path& lhs, const file_sys::path& rhs) {
+                       return Depth(lhs) < Depth(rhs);
+                     });
+
+    std::vector<std::string> names;
+    for (const file_sys::path& path : directories_) {
+      names.push_back(path.string());
+    }
+    size_t level_begin = 0;
+    while (level_begin < names.size()) {
+      size_t level_end = level_begin;
+      size_t depth = Depth(directories_[level_begin]);
+      while (level_end < names.size() &&
+             Depth(directories_[level_end]) == depth) {
+        ++level_end;
+      }
+      size_t next = level_begin;
+      size_t done = level_begin;
+      while (done < level_end) {
+        while (next < level_end) {
+          io_uring_sqe* sqe = ring_.GetSqe();
+          if (sqe == nullptr) {
+            break;
+          }
+          PrepMkdirat(sqe, AT_FDCWD, names[next].c_str(), 0777, next);
+          ++next;
+        }
+        SubmitAndWait();
+        uint64_t index;
+        int32_t result;
+        while (ring_.PopCompletion(index, result)) {
+          ++done;
+          if (result == 0 || result == -EEXIST) {
+            continue;
+          }
+          if (result == -ENOENT) {
+            file_sys::create_directories(directories_[index]);
+            continue;
+          }
+          throw file_sys::filesystem_error(
+              "cannot create directory", directories_[index],
+              std::error_code(-result, std::generic_category()));
+        }
+      }
+      level_begin = level_end;
+    }
+  }
+
+  void CopyFiles() {
+    if (files_.empty()) {
+      return;
+    }
+    size_t slot_count =
+        std::min<size_t>(std::max(1u, ring_.Capacity() / 2), files_.size());
+    slots_.assign(slot_count, Slot());
+    next_job_ = 0;
+    failed_job_ = 0;
+    failed_error_ = 0;
+    size_t active = 0;
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      slots_[i].buffer.resize(kBufferSize);
+      if (StartNext(i)) {
+        ++active;
+      }
+    }
+    while (active > 0) {
+      SubmitAndWait();
+      uint64_t user_data;
+      int32_t result;
+      while (ring_.PopCompletion(user_data, result)) {
+        size_t index = user_data >> 1;
+        if (!Complete(index, user_data & 1, result)) {
+          continue;
+        }
+        // Файл готов, слот берёт следующий
+        if (!StartNext(index)) {
+          --active;
+        }
+      }
+    }
+    if (failed_error_ != 0) {
+      const Job& job = files_[failed_job_];
+      ThrowCopyError(job.from, job.to, failed_error_);
+    }
+  }
+
+  uint64_t UserData(size_t index, uint64_t tag = kTagSource) const {
+    return (static_cast<uint64_t>(index) << 1) | tag;
+  }
+
+  // Начинает следующий файл в слоте. false, если файлов больше нет или уже
+  // была ошибка
+  bool StartNext(size_t index) {
+    if (next_job_ >= files_.size() || failed_error_ != 0) {
+      slots_[index].state = State::kIdle;
+      return false;
+    }
+    Slot& slot = slots_[index];
+    slot.job = next_job_++;
+    slot.state = State::kStat;
+    slot.pending = 1;
+    slot.error = 0;
+    slot.source = -1;
+    slot.target = -1;
+    slot.offset = 0;
+    slot.hasher.Reset();
+    slot.start = std::chrono::steady_clock::now();
+    PrepStatx(NextSqe(), AT_FDCWD, files_[slot.job].from.c_str(), 0,
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS,
+              &slot.stat, UserData(index));
+    return true;
+  }
+
+  // Обрабатывает завершение запроса слота. Возвращает true, когда файл
+  // скопирован или копирование прервано ошибкой
+  bool Complete(size_t index, uint64_t tag, int32_t result) {
+    Slot& slot = slots_[index];
+    const Job& job = files_[slot.job];
+    --slot.pending;
+    switch (slot.state) {
+      case State::kStat:
+        if (result < 0) {
+          return Fail(slot, -result);
+        }
+        if (!S_ISREG(slot.stat.stx_mode)) {
+          return Fail(slot, EINVAL);
+        }
+        if (IsSparse(slot.stat.stx_size, slot.stat.stx_blocks)) {
+          return CopySparse(slot);
+        }
+        slot.state = State::kOpen;
+        slot.pending = 2;
+        PrepOpenat(NextSqe(), AT_FDCWD, job.from.c_str(),
+                   O_RDONLY | O_CLOEXEC, 0, UserData(index, kTagSource));
+        PrepOpenat(NextSqe(), AT_FDCWD, job.to.c_str(),
+                   O_WRONLY | O_CREAT | O_CLOEXEC |
+                       (job.overwrite ? O_TRUNC : O_EXCL),
+                   slot.stat.stx_mode & 07777, UserData(index, kTagTarget));
+        return false;
+
+      case State::kOpen:
+        if (result < 0) {
+          slot.error = slot.error != 0 ? slot.error : -result;
+        } else if (tag == kTagSource) {
+          slot.source = result;
+        } else {
+          slot.target = result;
+        }
+        if (slot.pending > 0) {
+          return false;
+        }
+        if (slot.error != 0) {
+          return Fail(slot, slot.error);
+        }
+        // open применяет umask, а у существующего файла права не меняет
+        if ((job.overwrite || (slot.stat.stx_mode & umask_) != 0) &&
+            fchmod(slot.target, slot.stat.stx_mode & 07777) != 0) {
+          return Fail(slot, errno);
+        }
+        if (slot.stat.stx_size == 0) {
+          CloseFiles(index);
+          return false;
+        }
+        ReadNext(index);
+        return false;
+
+      case State::kRead:
+        RecordLatency(LatencyMetric::kIo,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - slot.read_start)
+                          .count());
+        if (result < 0) {
+          return Fail(slot, -result);
+        }
+        if (result == 0) {
+          CloseFiles(index);
+          return false;
+        }
+        slot.chunk = result;
+        slot.written = 0;
+        if (job.hash != nullptr) {
+          slot.hasher.Update(slot.buffer.data(), slot.chunk);
+        }
+        slot.state = State::kWrite;
+        WriteRest(index);
+        return false;
+
+      case State::kWrite:
+        if (result <= 0) {
+          return Fail(slot, result < 0 ? -result : EIO);
+        }
+        slot.written += result;
+        CountMetric(Metric::kBytesCopied, result);
+        if (slot.written < slot.chunk) {
+          WriteRest(index);
+          return false;
+        }
+        slot.offset += slot.chunk;
+        // Неполное чтение до размера из statx — конец файла. Иначе (FUSE,
+        // сетевая файловая система) читается остаток, до чтения 0 байт
+        if (slot.chunk < slot.buffer.size() &&
+            slot.offset >= slot.stat.stx_size) {
+          CloseFiles(index);
+        } else {
+          ReadNext(index);
+        }
+        return false;
+
+      case State::kClose:
+        if (result < 0 && slot.error == 0) {
+          slot.error = -result;
+        }
+        if (slot.pending > 0) {
+          return false;
+        }
+        if (slot.error != 0) {
+          return Fail(slot, slot.error);
+        }
+        if (job.hash != nullptr) {
+          *job.hash = ContentHash(slot.hasher);
+        }
+        RecordLatency(LatencyMetric::kCopy,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - slot.start)
+                          .count());
+        if (job.done) {
+          job.done();
+        }
+        on_done_(CopyStrategy::kIoUring, job.to);
+        return true;
+
+      case State::kIdle:
+        break;
+    }
+    return false;
+  }
+
+  // Ограничитель ввода-вывода ждёт здесь, в единственном потоке кольца,
+  // поэтому задерживает все файлы сразу
+  void ReadNext(size_t index) {
+    Slot& slot = slots_[index];
+    if (Throttle().Enabled()) {
+      Throttle().Acquire(slot.buffer.size());
+    }
+    slot.read_start = std::chrono::steady_clock::now();
+    slot.state = State::kRead;
+    slot.pending = 1;
+    PrepRead(NextSqe(), slot.source, slot.buffer.data(), slot.buffer.size(),
+             slot.offset, UserData(index));
+  }
+
+  void WriteRest(size_t index) {
+    Slot& slot = slots_[index];
+    slot.pending = 1;
+    PrepWrite(NextSqe(), slot.target, slot.buffer.data() + slot.written,
+              slot.chunk - slot.written, slot.offset + slot.written,
+              UserData(index));
+  }
+
+  void CloseFiles(size_t index) {
+    Slot& slot = slots_[index];
+    slot.state = State::kClose;
+    slot.pending = 2;
+    PrepClose(NextSqe(), slot.source, UserData(index, kTagSource));
+    PrepClose(NextSqe(), slot.target, UserData(index, kTagTarget));
+    slot.source = -1;
+    slot.target = -1;
+  }
+
+  // Файл с дырами копируется сразу, обычным путём через SEEK_DATA и
+  // SEEK_HOLE: через кольцо пришлось бы читать и дыры. Такие файлы редки,
+  // поэтому остальные запросы могут подождать
+  bool CopySparse(Slot& slot) {
+    const Job& job = files_[slot.job];
+    CopyStrategy strategy = CopyStrategy::kReadWrite;
+    try {
+      if (job.hash != nullptr) {
+        *job.hash = CopyFileDataHashed(job.from, job.to, job.overwrite);
+      } else {
+        strategy = CopyFileData(job.from, job.to, job.overwrite);
+      }
+    } catch (const file_sys::filesystem_error& error) {
+      return Fail(slot, error.code().value());
+    }
+    if (job.done) {
+      job.done();
+    }
+    on_done_(strategy, job.to);
+    return true;
+  }
+
+  // Прерывает копирование файла: дескрипторы закрываются сразу, новые
+  // файлы больше не начинаются, ошибка пробрасывается в конце Run
+  bool Fail(Slot& slot, int error) {
+    if (slot.source >= 0) {
+      close(slot.source);
+      slot.source = -1;
+    }
+    if (slot.target >= 0) {
+      close(slot.target);
+      slot.target = -1;
+    }
+    if (failed_error_ == 0) {
+      failed_error_ = error;
+      failed_job_ = slot.job;
+    }
+    return true;
+  }
+
+  IoUring& ring_;
+  DoneCallback on_done_;
+  mode_t umask_;
+  std::vector<file_sys::path> directories_;
+  std::vector<Job> files_;
+  std::vector<Slot> slots_;
+  size_t next_job_ = 0;
+  size_t failed_job_ = 0;
+  int failed_error_ = 0;
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "copy_backend.h"
+#include "journal.h"
+#include "scanner.h"
+
+namespace file_sys = std::filesystem;
+
+// Наблюдатель за источником для my_backup watch: следит за деревом через
+// inotify и записывает изменённые пути в журнал (см. journal.h). События
+// копятся в памяти не дольше секунды и дописываются в журнал одной пачкой с
+// fdatasync, повторы внутри пачки отбрасываются. Если ядро потеряло события
+// или не хватило лимита наблюдений, в журнал пишется O, и до следующего full
+// backup инкрементный бэкап обходит дерево целиком. Перед чтением журнала
+// бэкап просит наблюдателя дописать накопленное (см. SyncWatcher)
+
+// Флаг остановки по SIGINT и SIGTERM
+inline volatile std::sig_atomic_t watch_stop_requested = 0;
+
+inline void RequestWatchStop(int) { watch_stop_requested = 1; }
+
+// Номер последнего запроса синхронизации от бэкапа, 0 — запроса нет
+inline volatile std::sig_atomic_t watch_sync_requested = 0;
+
+inline void RequestWatchSync(int, siginfo_t* info, void*) {
+  watch_sync_requested = info->si_value.sival_int;
+}
+
+class ChangeWatcher {
+ public:
+  ChangeWatcher(const file_sys::path& source, const file_sys::path& root,
+                uint64_t memory_limit)
+      : source_(file_sys::absolute(source)), root_(root),
+        memory_limit_(memory_limit) {}
+
+  // Следит за источником до SIGINT или SIGTERM
+  void Run() {
+    // Обработчики ставятся до блокировки: бэкап шлёт сигнал синхронизации,
+    // как только видит, что блокировка взята
+    InstallSignalHandlers();
+    Lock();
+    journal_.Reset(open((root_ / kJournalFile).c_str(),
+                        O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+    inotify_.Reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (!journal_.IsValid() || !inotify_.IsValid()) {
+      throw std::runtime_error(
+          "Не удалось запустить наблюдение за " + source_.string() +
+          "\nПроверьте права на директорию для бэкапа");
+    }
+    AddTree("");
+    // Изменения до запуска наблюдателя неизвестны: журнал станет пригоден
+    // после следующего full backup
+    pending_.insert("O");
+    Flush();
+
+    std::vector<char> buffer(1 << 20);
+    auto last_flush = std::chrono::steady_clock::now();
+    while (!watch_stop_requested) {
+      pollfd poll_fd{inotify_.Get(), POLLIN, 0};
+      int ready = poll(&poll_fd, 1, kFlushIntervalMs);
+      if (ready < 0 && errno != EINTR) {
+        ThrowWatchError(errno);
+      }
+      if (ready > 0) {
+        ReadEvents(buffer);
+      }
+      auto now = std::chrono::steady_clock::now();
+      int sync = watch_sync_requested;
+      if (sync != 0) {
+        // События, случившиеся до запроса, уже в очереди inotify: они
+        // дочитываются и попадают в журнал раньше метки
+        watch_sync_requested = 0;
+        ReadEvents(buffer);
+        Flush();
+        last_flush = now;
+        int error = AppendJournal(journal_.Get(),
+                                  "S " + std::to_string(sync) + '\n');
+        if (error != 0) {
+          ThrowWatchError(error);
+        }
+        continue;
+      }
+      if (ready <= 0 || pending_.size() >= kMaxPending ||
+          now - last_flush >= std::chrono::milliseconds(kFlushIntervalMs)) {
+        Flush();
+        last_flush = now;
+      }
+    }
+    Flush();
+  }
+
+ private:
+  static constexpr int kFlushIntervalMs = 1000;
+  static constexpr size_t kMaxPending = 65536;
+  static constexpr uint32_t kWatchMask =
+      IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM |
+      IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
+      IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR;
+
+  // Один наблюдатель на корень бэкапов: блокировка держится, пока он жив, и
+  // снимается ядром, даже если процесс убит
+  void Lock() {
+    lock_.Reset(open((root_ / kWatchLockFile).c_str(),
+                     O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+    if (!lock_.IsValid()) {
+      ThrowWatchError(errno);
+    }
+    if (flock(lock_.Get(), LOCK_EX | LOCK_NB) != 0) {
+      throw std::runtime_error(
+          "Наблюдение за директорией для бэкапа уже запущено\nОстановите "
+          "запущенный my_backup watch");
+    }
+    std::string content = EscapeJournalPath(source_.string()) + '\n' +
+                          std::to_string(getpid()) + '\n';
+    if (ftruncate(lock_.Get(), 0) != 0 ||
+        WriteAll(lock_.Get(), content.data(), content.size()) != 0) {
+      ThrowWatchError(errno);
+    }
+  }
+
+  static void InstallSignalHandlers() {
+    // Без SA_RESTART: poll прерывается сигналом, и цикл сразу завершается
+    struct sigaction action {};
+    action.sa_handler = RequestWatchStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    struct sigaction sync_action {};
+    sync_action.sa_sigaction = RequestWatchSync;
+    sync_action.sa_flags = SA_SIGINFO;
+    sigemptyset(&sync_action.sa_mask);
+    sigaction(kWatchSyncSignal, &sync_action, nullptr);
+  }
+
+  [[noreturn]] void ThrowWatchError(int error) {
+    throw file_sys::filesystem_error(
+        "cannot watch directory", source_,
+        std::error_code(error, std::generic_category()));
+  }
+
+  // Ставит наблюдение на директорию relative и все вложенные
+  void AddTree(const std::string& relative) {
+    file_sys::path dir = relative.empty() ? source_ : source_ / relative;
+    if (!AddWatch(relative)) {
+      return;
+    }
+    ScanList entries(memory_limit_);
+    try {
+      entries = ScanTree(dir, nullptr, memory_limit_);
+    } catch (const file_sys::filesystem_error&) {
+      // Директорию уже удалили или переименовали: об этом придёт событие
+      return;
+    }
+    for (const ScanEntry& entry : entries) {
+      if (IsDirectory(entry)) {
+        AddWatch(relative.empty() ? std::string(entry.path)
+                                  : relative + '/' + std::string(entry.path));
+      }
+    }
+  }
+
+  bool AddWatch(const std::string& relative) {
+    file_sys::path dir = relative.empty() ? source_ : source_ / relative;
+    int wd = inotify_add_watch(inotify_.Get(), dir.c_str(), kWatchMask);
+    if (wd < 0) {
+      if (errno == ENOSPC || errno == ENOMEM) {
+        // Не хватило fs.inotify.max_user_watches: часть дерева без
+        // наблюдения
+        pending_.insert("O");
+      }
+      return false;
+    }
+    directories_[wd] = relative;
+    return true;
+  }
+
+  // Снимает наблюдение с директории, переехавшей за пределы источника, и
+  // со всех вложенных
+  void RemoveTree(const std::string& relative) {
+    std::string prefix = relative + '/';
+    for (auto it = directories_.begin(); it != directories_.end();) {
+      if (it->second == relative || it->second.compare(0, prefix.size(),
+                                                       prefix) == 0) {
+        inotify_rm_watch(inotify_.Get(), it->first);
+        it = directories_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void Record(char kind, const std::string& relative) {
+    pending_.insert(std::string(1, kind) + ' ' + EscapeJournalPath(relative));
+  }
+
+  void ReadEvents(std::vector<char>& buffer) {
+    while (true) {
+      ssize_t read_bytes = read(inotify_.Get(), buffer.data(), buffer.size());
+      if (read_bytes < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          return;
+        }
+        ThrowWatchError(errno);
+      }
+      for (ssize_t offset = 0; offset < read_bytes;) {
+        auto* event = reinterpret_cast<inotify_event*>(buffer.data() + offset);
+        offset += sizeof(inotify_event) + event->len;
+        HandleEvent(*event);
+      }
+    }
+  }
+
+  void HandleEvent(const inotify_event& event) {
+    if ((event.mask & IN_Q_OVERFLOW) != 0) {
+      pending_.insert("O");
+      return;
+    }
+    auto found = directories_.find(event.wd);
+    if (found == directories_.end()) {
+      return;
+    }
+    if ((event.mask & IN_IGNORED) != 0) {
+      directories_.erase(found);
+      return;
+    }
+    const std::string dir = found->second;
+    if ((event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
+      if (dir.empty()) {
+        // Удалён или переименован сам источник
+        pending_.insert("O");
+      }
+      return;
+    }
+    if (event.len == 0) {
+      Record('C', dir);
+      return;
+    }
+    std::string name(event.name);
+    std::string relative = dir.empty() ? name : dir + '/' + name;
+    if ((event.mask & IN_ISDIR) != 0 &&
+        (event.mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+      // Файлы могли появиться в директории раньше наблюдения за ней, поэтому
+      // она обходится целиком
+      AddTree(relative);
+      Record('T', relative);
+    } else {
+      if ((event.mask & IN_ISDIR) != 0 && (event.mask & IN_MOVED_FROM) != 0) {
+        RemoveTree(relative);
+      }
+      Record('C', relative);
+    }
+    if ((event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) !=
+        0) {
+      // Изменилось и время самой директории
+      Record('C', dir);
+    }
+  }
+
+  void Flush() {
+    if (pending_.empty()) {
+      return;
+    }
+    std::string lines;
+    if (pending_.count("O") != 0) {
+      lines = "O\n";
+    } else {
+      for (const std::string& line : pending_) {
+        lines += line;
+        lines += '\n';
+      }
+    }
+    int error = AppendJournal(journal_.Get(), lines);
+    if (error != 0) {
+      ThrowWatchError(error);
+    }
+    pending_.clear();
+  }
+
+  file_sys::path source_;
+  file_sys::path root_;
+  uint64_t memory_limit_;
+  FileDescriptor lock_;
+  FileDescriptor journal_;
+  FileDescriptor inotify_;
+  // Директория источника, за которой следит каждое наблюдение
+  std::unordered_map<int, std::string> directories_;
+  std::set<std::string> pending_;
+};
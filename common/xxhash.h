@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// XXH64 — быстрый некриптографический хеш для проверки содержимого файлов.
+// Данные обрабатываются полосами по 32 байта в четырёх независимых
+// аккумуляторах, поэтому процессор считает их параллельно (ILP), а
+// компилятор может векторизовать цикл. Этого хватает, чтобы хеширование
+// шло быстрее чтения с диска
+class Xxh64 {
+ public:
+  explicit Xxh64(uint64_t seed = 0) { Reset(seed); }
+
+  void Reset(uint64_t seed = 0) {
+    seed_ = seed;
+    lanes_[0] = seed + kPrime1 + kPrime2;
+    lanes_[1] = seed + kPrime2;
+    lanes_[2] = seed;
+    lanes_[3] = seed - kPrime1;
+    buffer_size_ = 0;
+    total_size_ = 0;
+  }
+
+  void Update(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    total_size_ += size;
+    if (buffer_size_ > 0) {
+      size_t take = size < kStripe - buffer_size_ ? size : kStripe - buffer_size_;
+      std::memcpy(buffer_ + buffer_size_, bytes, take);
+      buffer_size_ += take;
+      bytes += take;
+      size -= take;
+      if (buffer_size_ < kStripe) {
+        return;
+      }
+      ConsumeStripe(buffer_);
+      buffer_size_ = 0;
+    }
+    while (size >= kStripe) {
+      ConsumeStripe(bytes);
+      bytes += kStripe;
+      size -= kStripe;
+    }
+    std::memcpy(buffer_, bytes, size);
+    buffer_size_ = size;
+  }
+
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (total_size_ >= kStripe) {
+      hash = RotateLeft(lanes_[0], 1) + RotateLeft(lanes_[1], 7) +
+             RotateLeft(lanes_[2], 12) + RotateLeft(lanes_[3], 18);
+      for (uint64_t lane : lanes_) {
+        hash = MergeLane(hash, lane);
+      }
+    } else {
+      hash = seed_ + kPrime5;
+    }
+    hash += total_size_;
+
+    const uint8_t* tail = buffer_;
+    size_t size = buffer_size_;
+    while (size >= 8) {
+      hash ^= Round(0, Read64(tail));
+      hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+      tail += 8;
+      size -= 8;
+    }
+    if (size >= 4) {
+      hash ^= static_cast<uint64_t>(Read32(tail)) * kPrime1;
+      hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+      tail += 4;
+      size -= 4;
+    }
+    while (size > 0) {
+      hash ^= *tail * kPrime5;
+      hash = RotateLeft(hash, 11) * kPrime1;
+      ++tail;
+      --size;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+  static uint64_t Hash(const void* data, size_t size, uint64_t seed = 0) {
+    Xxh64 hasher(seed);
+    hasher.Update(data, size);
+    return hasher.Digest();
+  }
+
+ private:
+  static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+  static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+  static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+  static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+  static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+  static constexpr size_t kStripe = 32;
+
+  static uint64_t RotateLeft(uint64_t value, int shift) {
+    return (value << shift) | (value >> (64 - shift));
+  }
+  static uint64_t Read64(const uint8_t* data) {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+  static uint32_t Read32(const uint8_t* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+  static uint64_t Round(uint64_t lane, uint64_t input) {
+    lane += input * kPrime2;
+    lane = RotateLeft(lane, 31);
+    return lane * kPrime1;
+  }
+  static uint64_t MergeLane(uint64_t hash, uint64_t lane) {
+    hash ^= Round(0, lane);
+    return hash * kPrime1 + kPrime4;
+  }
+
+  void ConsumeStripe(const uint8_t* stripe) {
+    // Четыре аккумулятора не зависят друг от друга
+    for (int i = 0; i < 4; ++i) {
+      lanes_[i] = Round(lanes_[i], Read64(stripe + 8 * i));
+    }
+  }
+
+  uint64_t seed_;
+  uint64_t lanes_[4];
+  uint8_t buffer_[kStripe];
+  size_t buffer_size_;
+  uint64_t total_size_;
+};
+
+// Хеш содержимого для манифеста. Ноль в манифесте означает, что хеш не
+// вычислялся, поэтому настоящий нулевой хеш заменяется единицей
+inline uint64_t ContentHash(const Xxh64& hasher) {
+  uint64_t hash = hasher.Digest();
+  return hash == 0 ? 1 : hash;
+}
@@ -1,20 +1,52 @@
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 
+#include <algorithm>
+#include <chrono>
 #include <ctime>
 #include <filesystem>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/archive.h"
+#include "../common/chain.h"
+#include "../common/checkpoint.h"
+#include "../common/chunk_store.h"
+#include "../common/chunker.h"
+#include "../common/copy_engine.h"
+#include "../common/hardlink.h"
+#include "../common/journal.h"
+#include "../common/manifest.h"
+#include "../common/metadata.h"
+#include "../common/metrics.h"
+#include "../common/options.h"
+#include "../common/scanner.h"
+#include "../common/throttle.h"
+#include "../common/watcher.h"
 
 namespace file_sys = std::filesystem;
 
-// Фиксирует в файл последний бэкап
+// Фиксирует в файл последний бэкап. Файл заменяется переименованием, чтобы
+// после сбоя в нём было либо старое, либо новое имя
 void WriteLastFullBackup(file_sys::path path_to) {
   file_sys::path parent_path = path_to.parent_path();
   file_sys::path dir_name = path_to.filename();
-  std::ofstream last_full(parent_path.string() + "/last_full.txt");
+  file_sys::path temp_path = parent_path / "last_full.txt.tmp";
+  std::ofstream last_full(temp_path);
   last_full << dir_name.string();
   last_full.close();
+  file_sys::rename(temp_path, parent_path / "last_full.txt");
 }
 
 // Проверка на наличие прав доступа на чтение других пользователей
@@ -24,116 +56,852 @@ bool HasCopyPermission(file_sys::path path) {
          file_sys::perms::none;
 }
 
-// Обработка full backup
-void ProcessFull(file_sys::path path_from, file_sys::path path_to) {
+// Ошибка доступа к файлу источника
+[[noreturn]] void ThrowCopyPermissionError() {
+  throw std::runtime_error(
+      "Нет права на копирование файла в директорию, в которой вы хотите "
+      "создать "
+      "резервную копию\nПоменяйте права на файлы");
+}
+
+// Один вызов stat вместо отдельных запросов типа, прав, размера и времени
+struct stat StatFile(const file_sys::path& path) {
+  struct stat file_stat;
+  if (stat(path.c_str(), &file_stat) != 0) {
+    throw file_sys::filesystem_error(
+        "cannot stat file", path,
+        std::error_code(errno, std::generic_category()));
+  }
+  return file_stat;
+}
+
+// Обходит дерево источника один раз и проверяет права на чтение
+ScanList ScanSource(const file_sys::path& path_from, const Options& options) {
+  IoUring ring;
+  bool use_ring = options.io_uring &&
+                  ring.Init(options.queue_depth, {IORING_OP_STATX});
+  ScanList entries =
+      ScanTree(path_from, use_ring ? &ring : nullptr, options.memory_limit);
+  for (const ScanEntry& entry : entries) {
+    if (!IsReadable(entry)) {
+      ThrowCopyPermissionError();
+    }
+  }
+  return entries;
+}
+
+// Элемент списка по записи манифеста: файл не менялся с прошлого бэкапа
+ScanEntry FromManifestEntry(const ManifestEntry& record) {
+  ScanEntry entry;
+  entry.mode = record.mode;
+  entry.size = record.size;
+  entry.allocated = record.size;
+  entry.mtime_ns = record.mtime_ns;
+  entry.ctime_ns = static_cast<int64_t>(record.ctime_s) * 1000000000;
+  entry.inode = record.inode;
+  return entry;
+}
+
+// Входит ли путь в одно из поддеревьев roots (или совпадает с корнем)
+bool IsUnderAny(const std::set<std::string>& roots, const std::string& path) {
+  for (size_t slash = path.find('/'); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    if (roots.count(path.substr(0, slash)) != 0) {
+      return true;
+    }
+  }
+  return roots.count(path) != 0;
+}
+
+// Список источника по журналу наблюдателя: заново читаются только
+// изменившиеся пути, остальные записи берутся из манифеста прошлого
+// бэкапа. Поэтому время зависит от числа изменений, а не от размера дерева
+ScanList ScanChanges(const file_sys::path& path_from, const Manifest& base,
+                     const JournalChanges& changes, const Options& options) {
+  ScanList updated(options.memory_limit);
+  // Отметки и список для слияния лежат в аренде списка, как и сами записи,
+  // поэтому тоже не выходят за --memory-limit
+  ArenaVector<bool> replaced(updated.GetArena());
+  for (size_t i = 0; i < base.Size(); ++i) {
+    replaced.PushBack(false);
+  }
+  // Пути, поддеревья которых уже учтены целиком
+  std::set<std::string> trees;
+  auto replace_subtree = [&](const std::string& path) {
+    std::string prefix = path + '/';
+    // '0' идёт сразу за '/': это граница путей с префиксом path + '/'
+    size_t end = base.LowerBound(path + '0');
+    for (size_t i = base.LowerBound(prefix); i < end; ++i) {
+      replaced[i] = true;
+    }
+    trees.insert(path);
+  };
+
+  for (const auto& [path, rescan] : changes) {
+    // Корень источника в список не входит
+    if (path.empty() || IsUnderAny(trees, path)) {
+      continue;
+    }
+    size_t index = base.LowerBound(path);
+    const ManifestEntry* base_entry = base.Find(path);
+    if (base_entry != nullptr) {
+      replaced[index] = true;
+    }
+    file_sys::path source = path_from / path;
+    struct stat link_stat;
+    struct stat file_stat;
+    if (lstat(source.c_str(), &link_stat) != 0 ||
+        stat(source.c_str(), &file_stat) != 0) {
+      if (errno != ENOENT && errno != ENOTDIR) {
+        throw file_sys::filesystem_error(
+            "cannot stat file", source,
+            std::error_code(errno, std::generic_category()));
+      }
+      // Путь удалён вместе со всем, что было внутри
+      replace_subtree(path);
+      continue;
+    }
+    ScanEntry entry;
+    entry.mode = file_stat.st_mode;
+    entry.size = S_ISDIR(file_stat.st_mode) ? 0 : file_stat.st_size;
+    entry.allocated =
+        S_ISDIR(file_stat.st_mode) ? 0 : file_stat.st_blocks * 512;
+    entry.mtime_ns = MakeManifestEntry(file_stat).mtime_ns;
+    entry.ctime_ns = static_cast<int64_t>(file_stat.st_ctim.tv_sec) *
+                         1000000000 +
+                     file_stat.st_ctim.tv_nsec;
+    entry.inode = file_stat.st_ino;
+    bool was_directory = base_entry != nullptr &&
+                         (base_entry->flags & kManifestDirectory) != 0;
+    if (!IsDirectory(entry)) {
+      replace_subtree(path);
+      if (IsRegularFile(entry)) {
+        CountMetric(Metric::kFilesScanned);
+        updated.Add(entry, path);
+      }
+      continue;
+    }
+    CountMetric(Metric::kDirectoriesScanned);
+    const ScanEntry& added = updated.Add(entry, path);
+    if (!rescan && was_directory) {
+      continue;
+    }
+    // Новая директория обходится целиком, её старое содержимое забывается
+    replace_subtree(path);
+    if (IsReadable(added) && !S_ISLNK(link_stat.st_mode)) {
+      FileDescriptor fd(open(source.c_str(),
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+      if (!fd.IsValid()) {
+        ThrowScanError(source, errno);
+      }
+      ScanDirectory(std::move(fd), path_from, updated, nullptr, added.path);
+    }
+  }
+
+  // Слияние отсортированных списков: неизменённые записи манифеста и
+  // перечитанные пути
+  ArenaVector<const ScanEntry*> sorted(updated.GetArena());
+  for (const ScanEntry& entry : updated) {
+    if (!IsReadable(entry)) {
+      ThrowCopyPermissionError();
+    }
+    sorted.PushBack(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const ScanEntry* lhs, const ScanEntry* rhs) {
+              return lhs->path < rhs->path;
+            });
+  ScanList entries(options.memory_limit);
+  size_t next = 0;
+  for (size_t i = 0; i < base.Size(); ++i) {
+    if (replaced[i]) {
+      continue;
+    }
+    std::string_view path = base.Path(base.Entry(i));
+    while (next < sorted.Size() && sorted[next]->path < path) {
+      entries.Add(*sorted[next], sorted[next]->path);
+      ++next;
+    }
+    entries.Add(FromManifestEntry(base.Entry(i)), path);
+  }
+  for (; next < sorted.Size(); ++next) {
+    entries.Add(*sorted[next], sorted[next]->path);
+  }
+  return entries;
+}
+
+// Копирует дерево целиком: директории создаются сразу, файлы уходят в движок
+void CopyTree(file_sys::path path_from, file_sys::path path_to,
+              CopyEngine& engine) {
+  engine.CreateDirectory(path_to);
   for (const auto& component :
        file_sys::recursive_directory_iterator(path_from)) {
-    if (HasCopyPermission(component.path())) {
-      throw std::runtime_error(
-          "Нет права на копирование файла в директорию, в которой вы хотите "
-          "создать "
-          "резервную копию\nПоменяйте права на файлы");
+    struct stat file_stat = StatFile(component.path());
+    if ((file_stat.st_mode & S_IRUSR) == 0) {
+      ThrowCopyPermissionError();
     }
 
     auto relative_path = std::filesystem::relative(component.path(), path_from);
     auto dest_path = path_to / relative_path;
-    if (file_sys::is_regular_file(component)) {
-      file_sys::copy_file(component.path(), dest_path,
-                          file_sys::copy_options::none);
-    } else if (file_sys::is_directory(component)) {
-      file_sys::create_directory(dest_path);
+    if (S_ISREG(file_stat.st_mode)) {
+      engine.CopyFile(component.path(), dest_path,
+                      file_sys::copy_options::none);
+    } else if (S_ISDIR(file_stat.st_mode)) {
+      engine.CreateDirectory(dest_path);
+    }
+  }
+}
+
+// Если файл был готов до прерывания бэкапа и с тех пор не изменился,
+// переносит в record его запись из журнала контрольных точек
+bool ReuseCompleted(const Checkpoint& checkpoint, const ScanEntry& entry,
+                    ManifestEntry& record) {
+  const ManifestEntry* completed = checkpoint.Completed(entry.path);
+  if (completed == nullptr || completed->size != record.size ||
+      completed->mtime_ns != record.mtime_ns) {
+    return false;
+  }
+  record.flags |= completed->flags & (kManifestStored | kManifestDelta);
+  record.hash = completed->hash;
+  CountMetric(Metric::kFilesSkipped);
+  return true;
+}
+
+// Завершает бэкап: манифест записывается, только когда данные всех файлов
+// и записи всех директорий на диске, и служит отметкой о завершении. Для
+// full backup затем обновляется last_full.txt, и последним удаляется журнал
+// контрольных точек
+void CommitBackup(ManifestBuilder& manifest, const file_sys::path& path_to,
+                  Checkpoint& checkpoint, bool full) {
+  // В директориях есть и файлы, которые не проходят через журнал: жёсткие
+  // ссылки снимка и объединения
+  for (size_t i = 0; i < manifest.Size(); ++i) {
+    if ((manifest.Entry(i).flags & kManifestDirectory) != 0) {
+      checkpoint.DirectoryChanged(manifest.Path(i));
     }
   }
+  checkpoint.Flush();
+  manifest.Write(ManifestPath(path_to));
+  checkpoint.Flush();
+  if (full) {
+    WriteLastFullBackup(path_to);
+    checkpoint.Flush();
+  }
+  checkpoint.Remove();
+}
+
+// Обработка full backup
+void ProcessFull(const ScanList& entries, file_sys::path path_from,
+                 file_sys::path path_to, Checkpoint& checkpoint,
+                 const Options& options) {
+  CopyEngine engine(options);
+  engine.EnableAtomicWrites();
+  MetadataPass metadata(path_from, path_to, options);
+  ManifestBuilder manifest(BackupKind::kFull, "", entries.GetArena());
+  for (const ScanEntry& entry : entries) {
+    ManifestEntry record = ToManifestEntry(entry);
+    metadata.Add(entry.path, IsDirectory(entry));
+    if (!IsRegularFile(entry)) {
+      engine.CreateDirectory(path_to / entry.path);
+      manifest.Add(entry.path, record);
+      continue;
+    }
+    if (ReuseCompleted(checkpoint, entry, record)) {
+      manifest.Add(entry.path, record);
+      continue;
+    }
+    record.flags |= kManifestStored;
+    ManifestEntry& added = manifest.Entry(manifest.Add(entry.path, record));
+    engine.CopyFile(path_from / entry.path, path_to / entry.path,
+                    file_sys::copy_options::none,
+                    options.verify ? &added.hash : nullptr,
+                    [&checkpoint, &added, path = entry.path]() {
+                      checkpoint.Done(path, added);
+                    });
+  }
+  engine.Wait();
+  metadata.Apply();
+
+  CommitBackup(manifest, path_to, checkpoint, true);
+}
+
+// Изменился ли файл с момента бэкапа, описанного манифестом
+bool IsChanged(const Manifest& base, const ScanEntry& entry) {
+  const ManifestEntry* base_entry = base.Find(entry.path);
+  return base_entry == nullptr ||
+         (base_entry->flags & kManifestDirectory) != 0 ||
+         base_entry->size != entry.size ||
+         base_entry->mtime_ns != entry.mtime_ns;
+}
+
+// Менялись ли с прошлого бэкапа метаданные файла: права, владелец или
+// расширенные атрибуты. Права сравниваются по манифесту, остальное — по
+// времени изменения метаданных
+bool IsMetadataChanged(const Manifest& base, const ScanEntry& entry) {
+  const ManifestEntry* base_entry = base.Find(entry.path);
+  return base_entry == nullptr || base_entry->mode != entry.mode ||
+         base_entry->ctime_s !=
+             static_cast<uint32_t>(entry.ctime_ns / 1000000000);
+}
 
-  WriteLastFullBackup(path_to);
+// Есть ли у файла в прошлом бэкапе тот же размер и записанный хеш. Тогда
+// изменение времени ещё не значит, что изменилось содержимое
+bool HasSameSizeAndHash(const ManifestEntry* base_entry,
+                        const ScanEntry& entry) {
+  return base_entry != nullptr &&
+         (base_entry->flags & kManifestDirectory) == 0 &&
+         base_entry->size == entry.size && base_entry->hash != 0;
 }
 
-// Чтение последнего full backup
-std::string ReadLastFullBackup(file_sys::path path_to) {
-  file_sys::path parent_path_to = path_to.parent_path();
-  std::string dir_name;
-  std::ifstream last_full_file(parent_path_to.string() + "/last_full.txt");
-  std::getline(last_full_file, dir_name);
-  return dir_name;
+// Сохранять ли изменившийся файл патчем: файл не меньше --delta-threshold,
+// а в full backup лежит его прошлая копия
+bool UseDelta(const ManifestEntry* base_entry, const ScanEntry& entry,
+              const Options& options) {
+  return options.delta_threshold != 0 &&
+         entry.size >= options.delta_threshold && base_entry != nullptr &&
+         (base_entry->flags & kManifestDirectory) == 0 &&
+         (base_entry->flags & kManifestStored) != 0 &&
+         (base_entry->flags & kManifestDelta) == 0;
 }
 
-// Сравнивает директории и при различиях копирует в нужную папку
+// Сохраняет изменившийся файл в инкрементный бэкап: патчем к копии
+// delta_base, если она передана, иначе целиком. Вызывается из задач пула
+void StoreChangedFile(CopyEngine& engine, ManifestEntry& added,
+                      const file_sys::path& source,
+                      const file_sys::path& dest_path,
+                      const file_sys::path& delta_base, bool verify) {
+  uint64_t* hash = verify ? &added.hash : nullptr;
+  file_sys::create_directories(dest_path.parent_path());
+  if (delta_base.empty()) {
+    engine.CopyFileNow(source, dest_path, true, hash);
+  } else if (engine.StoreDeltaNow(delta_base, source, dest_path, hash)) {
+    added.flags |= kManifestDelta;
+  }
+  added.flags |= kManifestStored;
+}
+
+// Сравнивает директории и при различиях копирует в нужную папку. Обход
+// идёт по явному стеку, без рекурсии
 void CompareDirectorties(file_sys::path current_file,
                          file_sys::path last_backup_file,
-                         file_sys::path path_to) {
-  if (HasCopyPermission(current_file)) {
-    throw std::runtime_error(
-        "Нет права на копирование файла в директорию, в которой вы хотите "
-        "создать "
-        "резервную копию\nПоменяйте права на файлы");
-  }
-  if (file_sys::is_regular_file(current_file)) {
-    file_sys::create_directory(path_to);
-    if (!file_sys::exists(last_backup_file)) {
-      file_sys::copy_file(current_file, path_to / current_file.filename(),
-                          file_sys::copy_options::none);
-      return;
+                         file_sys::path path_to, CopyEngine& engine) {
+  struct Pending {
+    file_sys::path current;
+    file_sys::path last;
+    file_sys::path to;
+  };
+  std::vector<Pending> stack;
+  stack.push_back({std::move(current_file), std::move(last_backup_file),
+                   std::move(path_to)});
+  while (!stack.empty()) {
+    Pending item = std::move(stack.back());
+    stack.pop_back();
+    if (HasCopyPermission(item.current)) {
+      ThrowCopyPermissionError();
     }
+    file_sys::path dest_path = item.to / item.current.filename();
+    if (file_sys::is_regular_file(item.current)) {
+      engine.CreateDirectory(item.to);
+      if (!file_sys::exists(item.last)) {
+        engine.CopyFile(item.current, dest_path, file_sys::copy_options::none);
+        continue;
+      }
 
-    if (file_sys::last_write_time(current_file) !=
-            file_sys::last_write_time(last_backup_file) &&
-        file_sys::file_size(current_file) !=
-            file_sys::file_size(last_backup_file)) {
-      file_sys::create_directories(path_to);
-      file_sys::copy_file(current_file, path_to / current_file.filename(),
-                          file_sys::copy_options::overwrite_existing);
-    }
-  } else if (file_sys::is_directory(current_file)) {
-    if (!file_sys::exists(last_backup_file)) {
-      file_sys::copy(current_file, path_to, file_sys::copy_options::recursive);
-      return;
+      if (file_sys::last_write_time(item.current) !=
+              file_sys::last_write_time(item.last) ||
+          file_sys::file_size(item.current) != file_sys::file_size(item.last)) {
+        engine.CopyFile(item.current, dest_path,
+                        file_sys::copy_options::overwrite_existing);
+      }
+    } else if (file_sys::is_directory(item.current)) {
+      if (!file_sys::exists(item.last)) {
+        CopyTree(item.current, dest_path, engine);
+        continue;
+      }
+      if (file_sys::last_write_time(item.current) !=
+          file_sys::last_write_time(item.last)) {
+        for (const auto& component :
+             file_sys::directory_iterator(item.current)) {
+          stack.push_back({component.path(),
+                           item.last / component.path().filename(),
+                           dest_path});
+        }
+      }
     }
-    if (file_sys::last_write_time(current_file) !=
-        file_sys::last_write_time(last_backup_file)) {
-      for (const auto& component : file_sys::directory_iterator(current_file)) {
-        auto comp_name = component.path().filename();
-        CompareDirectorties(component.path(), last_backup_file / comp_name,
-                            path_to / current_file.filename());
+  }
+}
+
+// Инкрементный бэкап по манифесту последнего full backup: файлы источника
+// сравниваются с записями манифеста, дерево прошлого бэкапа не читается
+void ProcessIncrementalByManifest(const ScanList& entries,
+                                  file_sys::path path_from,
+                                  file_sys::path path_to,
+                                  const Manifest& base,
+                                  const std::string& base_name,
+                                  Checkpoint& checkpoint,
+                                  const Options& options) {
+  CopyEngine engine(options);
+  engine.EnableAtomicWrites();
+  // Директории, которых не оказалось в инкрементном бэкапе, проход
+  // метаданных пропускает
+  MetadataPass metadata(path_from, path_to, options);
+  ManifestBuilder manifest(BackupKind::kIncremental, base_name,
+                           entries.GetArena());
+  for (const ScanEntry& entry : entries) {
+    ManifestEntry record = ToManifestEntry(entry);
+    const ManifestEntry* base_entry = base.Find(entry.path);
+    if (!IsRegularFile(entry)) {
+      if (base_entry == nullptr) {
+        // Новые директории переносятся даже пустыми, как и раньше
+        engine.CreateDirectory(path_to / entry.path);
       }
+      metadata.Add(entry.path, true);
+      manifest.Add(entry.path, record);
+      continue;
+    }
+    if (!IsChanged(base, entry)) {
+      record.hash = base_entry->hash;
+      manifest.Add(entry.path, record);
+      CountMetric(Metric::kFilesSkipped);
+      continue;
     }
+    // Файл может оказаться сохранён целиком или патчем
+    bool delta = UseDelta(base_entry, entry, options);
+    metadata.Add(entry.path, false);
+    if (delta) {
+      metadata.Add(entry.path, std::string(entry.path) + kDeltaExtension,
+                   false);
+    }
+    if (ReuseCompleted(checkpoint, entry, record)) {
+      manifest.Add(entry.path, record);
+      continue;
+    }
+
+    file_sys::path source = path_from / entry.path;
+    file_sys::path dest_path = path_to / entry.path;
+    file_sys::path delta_base;
+    if (delta) {
+      delta_base = path_to.parent_path() / base_name / entry.path;
+    }
+    ManifestEntry& added = manifest.Entry(manifest.Add(entry.path, record));
+    if (options.verify && HasSameSizeAndHash(base_entry, entry)) {
+      // Размер совпал, а время изменения нет: файл копируется, только если
+      // изменилось содержимое
+      engine.Submit([&engine, &checkpoint, &added, path = entry.path, source,
+                     dest_path, delta_base, base_hash = base_entry->hash]() {
+        uint64_t hash = HashFile(source);
+        if (hash == base_hash) {
+          added.hash = hash;
+          CountMetric(Metric::kFilesSkipped);
+        } else {
+          CountMetric(Metric::kFilesChanged);
+          StoreChangedFile(engine, added, source, dest_path, delta_base, true);
+        }
+        checkpoint.Done(path, added);
+      });
+      continue;
+    }
+    CountMetric(Metric::kFilesChanged);
+    if (!delta_base.empty()) {
+      engine.Submit([&engine, &checkpoint, &added, path = entry.path, source,
+                     dest_path, delta_base, verify = options.verify]() {
+        StoreChangedFile(engine, added, source, dest_path, delta_base, verify);
+        checkpoint.Done(path, added);
+      });
+      continue;
+    }
+    added.flags |= kManifestStored;
+    engine.CreateDirectory(dest_path.parent_path());
+    engine.CopyFile(source, dest_path,
+                    file_sys::copy_options::overwrite_existing,
+                    options.verify ? &added.hash : nullptr,
+                    [&checkpoint, &added, path = entry.path]() {
+                      checkpoint.Done(path, added);
+                    });
   }
+  engine.Wait();
+  metadata.Apply();
+
+  CommitBackup(manifest, path_to, checkpoint, false);
 }
 
 // Обработка incremental backup
-void ProcessIncremental(file_sys::path path_from, file_sys::path path_to) {
-  std::string last_full_backup = ReadLastFullBackup(path_to);
-  if (last_full_backup.empty()) {
-    ProcessFull(path_from, path_to);
+void ProcessIncremental(const ScanList& entries, file_sys::path path_from,
+                        file_sys::path path_to, const Manifest& base,
+                        const std::string& base_name, Checkpoint& checkpoint,
+                        const Options& options) {
+  if (base_name.empty()) {
+    ProcessFull(entries, path_from, path_to, checkpoint, options);
     return;
   }
-  file_sys::path path_last_full =
-      path_to.parent_path().string() + "/" + last_full_backup;
+  if (base.IsOpen()) {
+    ProcessIncrementalByManifest(entries, path_from, path_to, base, base_name,
+                                 checkpoint, options);
+    return;
+  }
+
+  // Full backup сделан до появления манифестов: сравниваем с его деревом.
+  // Готовые файлы здесь не отмечаются, при продолжении сравнение идёт
+  // заново, а недописанных копий не остаётся благодаря переименованию
+  file_sys::path path_last_full = path_to.parent_path() / base_name;
+  CopyEngine engine(options);
+  engine.EnableAtomicWrites();
   for (const auto& component : file_sys::directory_iterator(path_from)) {
     auto path_last_full_comp = path_last_full / component.path().filename();
-    CompareDirectorties(component.path(), path_last_full_comp, path_to);
+    CompareDirectorties(component.path(), path_last_full_comp, path_to,
+                        engine);
   }
+  engine.Wait();
+  // Что скопировано, видно только по дереву бэкапа: остальные пути проход
+  // метаданных пропускает
+  MetadataPass metadata(path_from, path_to, options);
+  for (const ScanEntry& entry : entries) {
+    metadata.Add(entry.path, IsDirectory(entry));
+  }
+  metadata.Apply();
+  checkpoint.Flush();
+  checkpoint.Remove();
 }
 
-// Создаёт директорию, в которой будет хранится копия
-std::string CreateBackupDir(file_sys::path path_to) {
+// Обработка snapshot backup: новая директория — полное дерево источника.
+// Изменившиеся файлы копируются, а на остальные создаются жёсткие ссылки в
+// прошлый снимок, поэтому любой снимок восстанавливается сам по себе, а
+// места и ввода-вывода уходит как на инкрементный бэкап
+void ProcessSnapshot(const ScanList& entries, file_sys::path path_from,
+                     file_sys::path path_to, const Manifest& base,
+                     const std::string& base_name, Checkpoint& checkpoint,
+                     const Options& options) {
+  if (!base.IsOpen()) {
+    ProcessFull(entries, path_from, path_to, checkpoint, options);
+    return;
+  }
+  ManifestBuilder manifest(BackupKind::kFull, "", entries.GetArena());
+  ArenaVector<const char*> unchanged(entries.GetArena());
+  // Ссылки делят inode с прошлым снимком, и их метаданные не трогаются,
+  // поэтому файл с новыми метаданными копируется, даже если данные те же
+  MetadataPass metadata(path_from, path_to, options);
+  {
+    CopyEngine engine(options);
+    engine.EnableAtomicWrites();
+    for (const ScanEntry& entry : entries) {
+      ManifestEntry record = ToManifestEntry(entry);
+      if (!IsRegularFile(entry)) {
+        engine.CreateDirectory(path_to / entry.path);
+        metadata.Add(entry.path, true);
+        manifest.Add(entry.path, record);
+        continue;
+      }
+      record.flags |= kManifestStored;
+      if (!IsChanged(base, entry) && !IsMetadataChanged(base, entry)) {
+        record.hash = base.Find(entry.path)->hash;
+        manifest.Add(entry.path, record);
+        // Путь в аренде заканчивается '\0' и живёт до конца бэкапа
+        unchanged.PushBack(entry.path.data());
+        CountMetric(Metric::kFilesSkipped);
+        continue;
+      }
+      metadata.Add(entry.path, false);
+      if (ReuseCompleted(checkpoint, entry, record)) {
+        manifest.Add(entry.path, record);
+        continue;
+      }
+      CountMetric(Metric::kFilesChanged);
+      ManifestEntry& added = manifest.Entry(manifest.Add(entry.path, record));
+      engine.CopyFile(path_from / entry.path, path_to / entry.path,
+                      file_sys::copy_options::none,
+                      options.verify ? &added.hash : nullptr,
+                      [&checkpoint, &added, path = entry.path]() {
+                        checkpoint.Done(path, added);
+                      });
+    }
+    engine.Wait();
+  }
+
+  // Ссылки создаются, когда все директории снимка уже есть
+  LinkBatch links(path_to.parent_path() / base_name, path_from, path_to,
+                  options);
+  for (const char* path : unchanged) {
+    links.Add(path);
+  }
+  links.Wait();
+  metadata.Apply();
+
+  CommitBackup(manifest, path_to, checkpoint, true);
+}
+
+// Текущее время в формате имени бэкапа
+std::string BackupTimestamp() {
   std::time_t seconds = std::time(nullptr);
   std::tm now_time;
   localtime_r(&seconds, &now_time);
   std::ostringstream oss;
   oss << std::put_time(&now_time, "%Y-%m-%d-%H-%M-%S");
-  file_sys::path dir_name = oss.str();
+  return oss.str();
+}
+
+// Создаёт директорию, в которой будет хранится копия
+std::string CreateBackupDir(file_sys::path path_to) {
+  file_sys::path dir_name = BackupTimestamp();
   file_sys::create_directory(path_to / dir_name);
   return dir_name.string();
 }
 
-// Проверяет есть ли свободное пространство на диске для копирования
-void CheckFreeSpace(file_sys::path path_from, file_sys::path path_to) {
+// Выбирает свободное имя <время><extension> в директории dir и занимает
+// его временным файлом <имя>.tmp, созданным с O_EXCL. Готовый файл
+// получает имя только переименованием временного, поэтому имя свободно,
+// если временный файл создан, а готового ещё нет. Если в эту секунду уже
+// пишется или записан другой бэкап, выбирается время следующей
+file_sys::path ReserveTimestampFile(const file_sys::path& dir,
+                                   const std::string& extension) {
+  while (true) {
+    file_sys::path path = dir / (BackupTimestamp() + extension);
+    file_sys::path temp_path = path;
+    temp_path += ".tmp";
+    FileDescriptor fd(
+        open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+    if (fd.IsValid()) {
+      if (!file_sys::exists(path)) {
+        return path;
+      }
+      fd.Reset();
+      file_sys::remove(temp_path);
+    } else if (errno != EEXIST) {
+      ThrowCopyError(dir, temp_path, errno);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+// Удаляет временные файлы копий, оставшиеся от прерванного бэкапа. Если
+// файл источника с тех пор удалён, его копия больше не пишется, и без этого
+// временный файл попал бы в готовый бэкап
+void RemovePartialFiles(const file_sys::path& backup_dir) {
+  std::vector<file_sys::path> partials;
+  for (const auto& component :
+       file_sys::recursive_directory_iterator(backup_dir)) {
+    if (component.path().extension() == kPartialExtension &&
+        component.is_regular_file()) {
+      partials.push_back(component.path());
+    }
+  }
+  for (const file_sys::path& partial : partials) {
+    file_sys::remove(partial);
+  }
+}
+
+// Режет файл на блоки по содержимому и кладёт новые блоки в хранилище
+void StoreFileChunks(const file_sys::path& path, ChunkStore& store,
+                     SnapshotRecord& record) {
+  FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd.IsValid()) {
+    ThrowCopyError(path, store.Root(), errno);
+  }
+  record.size = 0;
+  int error = ChunkFile(fd.Get(), ChunkerLimits(),
+                        [&](const uint8_t* data, size_t size) {
+                          ChunkHash hash = Sha256::Hash(data, size);
+                          store.Put(hash, data, size);
+                          CountMetric(Metric::kBytesCopied, size);
+                          record.chunks.push_back(
+                              {hash, static_cast<uint32_t>(size)});
+                          record.size += size;
+                        });
+  if (error != 0) {
+    ThrowCopyError(path, store.Root(), error);
+  }
+  CountMetric(Metric::kFilesCopied);
+}
+
+// Обработка dedup backup: файлы режутся на блоки по содержимому, каждый
+// уникальный блок хранится один раз, а снимок — список ссылок на блоки
+void ProcessDedup(const ScanList& entries, file_sys::path path_from,
+                  file_sys::path path_to, const Options& options) {
+  ChunkStore store(path_to / "chunks");
+  file_sys::create_directories(path_to / "snapshots");
+
+  std::vector<SnapshotRecord> records;
+  std::mutex records_mutex;
+  ThreadPool pool(JobsCount(options));
+  for (const ScanEntry& entry : entries) {
+    SnapshotRecord record;
+    record.path = std::string(entry.path);
+    record.mode = entry.mode;
+    record.mtime_ns = entry.mtime_ns;
+    if (IsDirectory(entry)) {
+      record.directory = true;
+      std::lock_guard<std::mutex> lock(records_mutex);
+      records.push_back(std::move(record));
+      continue;
+    }
+    pool.Submit([&, record = std::move(record),
+                 source = path_from / entry.path]() mutable {
+      StoreFileChunks(source, store, record);
+      std::lock_guard<std::mutex> lock(records_mutex);
+      records.push_back(std::move(record));
+    });
+  }
+  pool.Wait();
+
+  // Снимок ссылается только на блоки, которые уже на диске
+  store.Sync();
+  WriteSnapshot(ReserveTimestampFile(path_to / "snapshots", ".snapshot"),
+                records);
+}
+
+// Читает и сжимает блок файла для архива
+std::vector<char> ReadArchiveBlock(const FileDescriptor& fd,
+                                   const file_sys::path& path, uint64_t offset,
+                                   size_t size) {
+  std::vector<uint8_t> data(size);
+  size_t done = 0;
+  {
+    ThrottledIo io(size);
+    while (done < size) {
+      ssize_t result = pread(fd.Get(), data.data() + done, size - done,
+                             offset + done);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result < 0) {
+        ThrowCopyError(path, path, errno);
+      }
+      if (result == 0) {
+        throw std::runtime_error("Файл " + path.string() +
+                                 " изменился во время бэкапа\nПовторите бэкап");
+      }
+      done += result;
+    }
+  }
+  CountMetric(Metric::kBytesCopied, size);
+  return EncodeArchiveBlock(data.data(), size);
+}
+
+// Записывает дерево в файл архива temp_path. Блоки сжимаются параллельно в
+// пуле, а пишутся строго по порядку; число блоков в работе ограничено,
+// поэтому память не зависит от размера файлов
+void WriteArchive(const ScanList& entries, const file_sys::path& path_from,
+                  const file_sys::path& temp_path,
+                  const file_sys::path& archive_path, const Options& options) {
+  FileDescriptor out(open(temp_path.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (!out.IsValid()) {
+    ThrowCopyError(path_from, temp_path, errno);
+  }
+  uint64_t offset = 0;
+  auto write_out = [&](const std::vector<char>& data) {
+    int error = WriteAll(out.Get(), data.data(), data.size());
+    if (error != 0) {
+      ThrowCopyError(path_from, temp_path, error);
+    }
+    offset += data.size();
+  };
+  write_out(std::vector<char>(kArchiveMagic,
+                              kArchiveMagic + sizeof(kArchiveMagic)));
+
+  // Очередь записи: заголовки готовы сразу, блоки — когда их сожмёт пул.
+  // Для заголовка запоминается номер элемента, чтобы записать его смещение
+  struct Pending {
+    std::future<std::vector<char>> data;
+    size_t entry_index;
+  };
+  constexpr size_t kNoEntry = static_cast<size_t>(-1);
+  std::vector<ArchiveEntry> archive_entries;
+  std::deque<Pending> pending;
+  ThreadPool pool(JobsCount(options));
+  size_t window = pool.Size() * 4;
+  auto flush = [&](size_t keep) {
+    while (pending.size() > keep) {
+      Pending& front = pending.front();
+      if (front.entry_index != kNoEntry) {
+        archive_entries[front.entry_index].header_offset = offset;
+      }
+      write_out(front.data.get());
+      pending.pop_front();
+    }
+  };
+
+  for (const ScanEntry& entry : entries) {
+    ArchiveEntry archive_entry;
+    archive_entry.path = std::string(entry.path);
+    archive_entry.directory = IsDirectory(entry);
+    archive_entry.mode = entry.mode;
+    archive_entry.size = entry.size;
+    archive_entry.mtime_ns = entry.mtime_ns;
+
+    std::promise<std::vector<char>> header;
+    header.set_value(EncodeArchiveHeader(archive_entry));
+    pending.push_back({header.get_future(), archive_entries.size()});
+    archive_entries.push_back(std::move(archive_entry));
+    if (IsDirectory(entry)) {
+      continue;
+    }
+    CountMetric(Metric::kFilesCopied);
+
+    file_sys::path source = path_from / entry.path;
+    auto fd = std::make_shared<FileDescriptor>(
+        open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd->IsValid()) {
+      ThrowCopyError(source, archive_path, errno);
+    }
+    for (uint64_t block = 0; block < ArchiveBlockCount(entry.size); ++block) {
+      uint64_t block_offset = block * kArchiveBlockSize;
+      size_t block_size = std::min<uint64_t>(kArchiveBlockSize,
+                                             entry.size - block_offset);
+      auto promise = std::make_shared<std::promise<std::vector<char>>>();
+      pending.push_back({promise->get_future(), kNoEntry});
+      pool.Submit([fd, source, block_offset, block_size, promise]() {
+        try {
+          promise->set_value(
+              ReadArchiveBlock(*fd, source, block_offset, block_size));
+        } catch (...) {
+          promise->set_exception(std::current_exception());
+        }
+      });
+      flush(window);
+    }
+  }
+  flush(0);
+  pool.Wait();
+
+  write_out(EncodeArchiveIndex(archive_entries, offset));
+}
+
+// Обработка archive backup: дерево записывается в один файл архива. Архив
+// получает имя, только когда записан целиком, а после ошибки
+// зарезервированный временный файл удаляется
+void ProcessArchive(const ScanList& entries, file_sys::path path_from,
+                    file_sys::path path_to, const Options& options) {
+  file_sys::path archive_path =
+      ReserveTimestampFile(path_to, kArchiveExtension);
+  file_sys::path temp_path = archive_path;
+  temp_path += ".tmp";
+  try {
+    WriteArchive(entries, path_from, temp_path, archive_path, options);
+  } catch (...) {
+    std::error_code ignored;
+    file_sys::remove(temp_path, ignored);
+    throw;
+  }
+  file_sys::rename(temp_path, archive_path);
+}
+
+// Проверяет есть ли свободное пространство на диске для копирования. Если
+// известен манифест прошлого бэкапа, учитываются только изменённые файлы.
+// Считается занятое на диске место, а не размер: дыры файлов копия
+// сохраняет. Заодно сообщает метрикам, сколько предстоит скопировать
+void CheckFreeSpace(const ScanList& entries, const Manifest& base,
+                    file_sys::path path_to) {
   uintmax_t size_dir_to = 0;
-  for (const auto& entry : file_sys::recursive_directory_iterator(path_from)) {
-    if (file_sys::is_regular_file(entry)) {
-      size_dir_to += file_sys::file_size(entry);
+  uint64_t files = 0;
+  uint64_t data_bytes = 0;
+  for (const ScanEntry& entry : entries) {
+    if (IsRegularFile(entry) && (!base.IsOpen() || IsChanged(base, entry))) {
+      size_dir_to += entry.allocated;
+      data_bytes += std::min(entry.size, entry.allocated);
+      ++files;
     }
   }
+  Metrics().SetTotals(files, data_bytes);
 
   file_sys::space_info space_to = file_sys::space(path_to);
   if (size_dir_to > space_to.free) {
@@ -146,7 +914,7 @@ void CheckFreeSpace(file_sys::path path_from, file_sys::path path_to) {
 // Выполняет проверки переданных путей, размера свободного пространства на диске
 // и обрабатывает переданный флаг
 void MyBackup(file_sys::path option, file_sys::path path_from,
-              file_sys::path path_to) {
+              file_sys::path path_to, const Options& options) {
   if (!file_sys::exists(path_from) || !file_sys::exists(path_to)) {
     throw std::runtime_error(
         "Одна из переданных директорий не существует.\nПроверьте правильно ли "
@@ -168,51 +936,372 @@ void MyBackup(file_sys::path option, file_sys::path path_from,
         " директории для копирования");
   }
 
+  if (option == "watch") {
+    ChangeWatcher(path_from, path_to, options.memory_limit).Run();
+    return;
+  }
+
+  bool checkpointed =
+      option == "full" || option == "incremental" || option == "snapshot";
+  if (options.resume && !checkpointed) {
+    throw std::runtime_error(
+        "Параметр --resume поддерживается только для full, incremental и "
+        "snapshot\nЗапустите бэкап без --resume");
+  }
+  std::string source = file_sys::absolute(path_from).lexically_normal();
+
+  // Дерево источника обходится один раз: список используется и для оценки
+  // места, и для копирования. Если за источником следит наблюдатель,
+  // инкрементный бэкап перечитывает только пути из его журнала
+  ScanList entries;
+  Manifest base;
+  std::string base_name;
+  file_sys::path interrupted;
   try {
-    CheckFreeSpace(path_from, path_to);
+    if (options.resume) {
+      // Прерванный бэкап продолжается от той же основы, что и начинался
+      interrupted = FindInterruptedBackup(path_to);
+      if (interrupted.empty()) {
+        throw std::runtime_error("Нет прерванного бэкапа в " +
+                                 path_to.string() +
+                                 "\nЗапустите бэкап без --resume");
+      }
+      CheckpointHeader header = ReadCheckpointHeader(interrupted);
+      if (header.option != option || header.source != source) {
+        throw std::runtime_error(
+            "Бэкап " + interrupted.string() + " начат командой " +
+            header.option + " для " + header.source +
+            "\nПродолжите его той же командой или удалите директорию");
+      }
+      base_name = header.base;
+    } else if (option == "incremental" || option == "snapshot") {
+      base_name = ReadLastFull(path_to);
+    }
+    if (!base_name.empty()) {
+      base.Open(ManifestPath(path_to / base_name));
+    }
+    std::optional<JournalChanges> changes;
+    if (base.IsOpen() && (!options.resume || option == "incremental")) {
+      // Снимок становится новой основой, поэтому журнал после него
+      // начинается заново. При продолжении снимка журнал уже начат заново,
+      // и дерево обходится целиком
+      changes = ReadJournal(path_to, path_from, base_name,
+                            option == "snapshot" ? BackupTimestamp() : "");
+    } else if (checkpointed && !options.resume) {
+      // Бэкап будет полным: журнал начинается заново с его начала
+      ResetJournal(path_to, BackupTimestamp(), path_from);
+    }
+    if (changes) {
+      entries = ScanChanges(path_from, base, *changes, options);
+    } else {
+      entries = ScanSource(path_from, options);
+    }
+    CheckFreeSpace(entries, base, path_to);
+
+    // Хранилище дедупликации и архив не используют last_full.txt и
+    // директории бэкапов
+    if (option == "dedup") {
+      ProcessDedup(entries, path_from, path_to, options);
+      return;
+    }
+    if (option == "archive") {
+      ProcessArchive(entries, path_from, path_to, options);
+      return;
+    }
 
     if (!file_sys::exists(path_to / "last_full.txt")) {
       std::ofstream(path_to / "last_full.txt").close();
     }
-    path_to = path_to / CreateBackupDir(path_to);
+    path_to = options.resume ? interrupted
+                             : path_to / CreateBackupDir(path_to);
+    if (options.resume) {
+      RemovePartialFiles(path_to);
+    }
   } catch (std::runtime_error& error) {
     throw;
   }
 
   try {
+    if (!checkpointed) {
+      throw std::runtime_error(
+          "Передан некорректный флаг\nВыберите full, incremental, snapshot, "
+          "dedup, archive или watch");
+    }
+    Checkpoint checkpoint(path_to, {option, base_name, source},
+                          options.memory_limit);
     if (option == "full") {
-      ProcessFull(path_from, path_to);
+      ProcessFull(entries, path_from, path_to, checkpoint, options);
     } else if (option == "incremental") {
-      ProcessIncremental(path_from, path_to);
+      ProcessIncremental(entries, path_from, path_to, base, base_name,
+                         checkpoint, options);
     } else {
-      throw std::runtime_error(
-          "Передан некорректный флаг\nВыберите или full, или incremental");
+      ProcessSnapshot(entries, path_from, path_to, base, base_name,
+                      checkpoint, options);
     }
   } catch (std::runtime_error& error) {
     throw;
   }
 }
 
+// Самый новый завершённый бэкап в корне root: у него есть манифест и нет
+// журнала контрольных точек. Пустая строка, если таких нет
+std::string LatestCompleteBackup(const file_sys::path& root) {
+  std::vector<std::string> names = ListBackupDirs(root);
+  for (auto name = names.rbegin(); name != names.rend(); ++name) {
+    file_sys::path dir = root / *name;
+    if (file_sys::exists(ManifestPath(dir)) &&
+        !file_sys::exists(CheckpointPath(dir))) {
+      return *name;
+    }
+  }
+  return "";
+}
+
+// Удаляет директорию бэкапа. Права директорий перенесены из источника, а
+// из директории без права записи файлы не удалить, поэтому сначала права
+// директорий расширяются. Файлы не трогаются: они могут быть жёсткими
+// ссылками из других бэкапов
+void RemoveBackupDir(const file_sys::path& dir) {
+  std::vector<file_sys::path> stack{dir};
+  while (!stack.empty()) {
+    file_sys::path current = std::move(stack.back());
+    stack.pop_back();
+    file_sys::permissions(current, file_sys::perms::owner_all,
+                          file_sys::perm_options::add);
+    for (const auto& component : file_sys::directory_iterator(current)) {
+      if (component.is_directory() && !component.is_symlink()) {
+        stack.push_back(component.path());
+      }
+    }
+  }
+  file_sys::remove_all(dir);
+}
+
+// Удаляет директории, оставшиеся от прерванного объединения: ссылки и
+// копии дешевле создать заново, чем продолжать
+void RemoveInterruptedCompactions(const file_sys::path& root) {
+  for (const std::string& name : ListBackupDirs(root)) {
+    file_sys::path dir = root / name;
+    if (file_sys::exists(CheckpointPath(dir)) &&
+        ReadCheckpointHeader(dir).option == "compact") {
+      RemoveBackupDir(dir);
+      file_sys::remove(CheckpointPath(dir));
+    }
+  }
+}
+
+// Собирает в path_to full backup из цепочки, которая заканчивается бэкапом
+// target, не читая источник. Неизменённые файлы становятся жёсткими
+// ссылками на копии в бэкапах цепочки, а если ссылку создать нельзя —
+// копиями, с reflink, где он есть. Файлы, сохранённые патчем, собираются
+// из копии в full backup и патча. Манифест берётся из манифеста target:
+// все файлы в нём отмечены как лежащие в новом бэкапе
+void CompactChain(const file_sys::path& target, const file_sys::path& path_to,
+                  Checkpoint& checkpoint, const Options& options) {
+  Manifest target_manifest;
+  target_manifest.Open(ManifestPath(target));
+  std::vector<ResolvedEntry> entries = ResolveChain(target);
+
+  Arena arena(options.memory_limit);
+  ManifestBuilder manifest(BackupKind::kFull, "", arena);
+  // У ссылок общий inode с копией в цепочке, их метаданные уже перенесены
+  MetadataPass metadata("", path_to, options);
+  // Файлы, которые берутся ссылкой, по директориям бэкапов цепочки
+  std::map<std::string, std::vector<const char*>> links;
+  std::vector<const ResolvedEntry*> deltas;
+  uint64_t delta_bytes = 0;
+  for (const ResolvedEntry& entry : entries) {
+    ManifestEntry record = *target_manifest.Find(entry.path);
+    record.flags &= kManifestDirectory;
+    if (entry.directory) {
+      file_sys::create_directories(path_to / entry.path);
+      if (!entry.source.empty()) {
+        metadata.Add(entry.source.string(), entry.path, true);
+      }
+      manifest.Add(entry.path, record);
+      continue;
+    }
+    record.flags |= kManifestStored;
+    record.hash = entry.hash;
+    manifest.Add(entry.path, record);
+    if (!entry.base.empty()) {
+      // Метаданные файла перенесены на его патч
+      metadata.Add(entry.source.string(), entry.path, false);
+      deltas.push_back(&entry);
+      delta_bytes += record.size;
+      continue;
+    }
+    std::string source = entry.source.string();
+    links[source.substr(0, source.size() - entry.path.size() - 1)].push_back(
+        entry.path.c_str());
+  }
+  if (delta_bytes > file_sys::space(path_to).free) {
+    throw std::runtime_error(
+        "Нет свободного пространства на диске для копирования\nОчистите "
+        "память");
+  }
+
+  for (const auto& [dir, paths] : links) {
+    LinkBatch batch(dir, dir, path_to, options);
+    for (const char* path : paths) {
+      batch.Add(path);
+    }
+    batch.Wait();
+  }
+  {
+    CopyEngine engine(options);
+    for (const ResolvedEntry* entry : deltas) {
+      engine.Submit([&engine, entry, to = path_to / entry->path]() {
+        engine.ApplyDeltaNow(entry->base, entry->source, to, false);
+        int error = SyncPath(to, false);
+        if (error != 0) {
+          ThrowCopyError(entry->source, to, error);
+        }
+      });
+    }
+    engine.Wait();
+  }
+  metadata.Apply();
+
+  CommitBackup(manifest, path_to, checkpoint, true);
+}
+
+// Оставляет keep последних full backup и бэкапы после них, более старые
+// удаляются вместе с манифестами. Инкрементный бэкап всегда сделан от full
+// backup, который старше его, поэтому всё, что старше самого старого из
+// оставленных full backup, относится к удаляемым цепочкам. Незавершённые
+// бэкапы не трогаются
+void PruneBackups(const file_sys::path& root, size_t keep) {
+  std::vector<std::string> names = ListBackupDirs(root);
+  std::vector<std::string> fulls;
+  for (const std::string& name : names) {
+    Manifest manifest;
+    if (!file_sys::exists(CheckpointPath(root / name)) &&
+        manifest.Open(ManifestPath(root / name)) &&
+        manifest.Kind() == BackupKind::kFull) {
+      fulls.push_back(name);
+    }
+  }
+  if (fulls.size() <= keep) {
+    return;
+  }
+  const std::string& oldest_kept = fulls[fulls.size() - keep];
+  for (const std::string& name : names) {
+    if (name >= oldest_kept) {
+      break;
+    }
+    file_sys::path dir = root / name;
+    if (file_sys::exists(CheckpointPath(dir))) {
+      continue;
+    }
+    // Манифест удаляется первым: если удаление прервётся, остаток
+    // директории не будет выдавать себя за целый бэкап
+    file_sys::remove(ManifestPath(dir));
+    RemoveBackupDir(dir);
+  }
+}
+
+// Объединяет последний full backup и инкрементные бэкапы после него в новый
+// full backup прямо на томе бэкапов и удаляет старые бэкапы по --keep.
+// Источник не читается, поэтому полный бэкап не нагружает рабочий сервер
+void MyCompact(file_sys::path root, const Options& options) {
+  if (!file_sys::exists(root)) {
+    throw std::runtime_error(
+        "Одна из переданных директорий не существует.\nПроверьте правильно ли "
+        "вы указали путь до нужных вам директорий либо создайте их.");
+  }
+  if (!file_sys::is_directory(root)) {
+    throw std::runtime_error(
+        "Один из переданных путей ведёт не к директории.\nПроверьте правильно "
+        "ли вы указали путь до нужных вам директорий либо создайте их.");
+  }
+
+  RemoveInterruptedCompactions(root);
+  std::string target = LatestCompleteBackup(root);
+  if (target.empty()) {
+    throw std::runtime_error("В " + root.string() +
+                             " нет завершённых бэкапов с манифестом\nСделайте "
+                             "full backup");
+  }
+  Manifest target_manifest;
+  target_manifest.Open(ManifestPath(root / target));
+  // Если последний бэкап — full backup, объединять нечего
+  if (target_manifest.Kind() != BackupKind::kFull) {
+    // Имя — время объединения. Если в эту секунду уже сделан бэкап,
+    // объединение ждёт следующей
+    std::string name = BackupTimestamp();
+    while (!file_sys::create_directory(root / name)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      name = BackupTimestamp();
+    }
+    Checkpoint checkpoint(
+        root / name,
+        {"compact", target, file_sys::absolute(root).lexically_normal()},
+        options.memory_limit);
+    CompactChain(root / target, root / name, checkpoint, options);
+  }
+  if (options.keep != 0) {
+    PruneBackups(root, options.keep);
+  }
+}
+
+// Печатает сообщение об ошибке выполнения
+void PrintError(const std::runtime_error& error) {
+  std::cerr << "Упс, кажется, программа завершилась с ошибкой!" << '\n'
+            << '\n';
+  std::cerr << error.what() << '\n' << '\n';
+  std::cerr << "Попробуйте снова после исправления ошибки!" << '\n';
+}
+
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
+  Options options;
+  std::vector<std::string> args;
+  try {
+    args = ParseOptions(argc, argv,
+                        {"--jobs", "--copy-report", "--verify", "--io-uring",
+                         "--queue-depth", "--progress", "--metrics-file",
+                         "--delta-threshold", "--memory-limit", "--resume",
+                         "--limit-mbps", "--limit-iops", "--latency-target",
+                         "--ionice", "--nice", "--keep"},
+                        options);
+  } catch (std::runtime_error& error) {
+    PrintError(error);
+    return 1;
+  }
+
+  bool compact = args.size() == 2 && args[0] == "compact";
+  if (args.size() != 3 && !compact) {
     std::cerr << "Вы неправильно используете команду." << '\n' << '\n';
     std::cerr << "Формат ввода:" << '\n';
-    std::cerr << "./my_backup [full/incremental] [path from] [path to]" << '\n'
+    std::cerr << "./my_backup [full/incremental/snapshot/dedup/archive/"
+                 "watch] [path from] [path to]"
               << '\n';
+    std::cerr << "./my_backup compact [path to]" << '\n' << '\n';
     std::cerr << "Попробуйте снова!" << '\n';
     return 1;
   }
 
-  file_sys::path path_from = argv[2];
-  file_sys::path path_to = argv[3];
+  if (compact) {
+    try {
+      ApplyThrottleOptions(options);
+      MetricsReporter reporter(options);
+      MyCompact(args[1], options);
+    } catch (std::runtime_error& error) {
+      PrintError(error);
+      return 1;
+    }
+    return 0;
+  }
+
+  file_sys::path path_from = args[1];
+  file_sys::path path_to = args[2];
 
   try {
-    MyBackup(argv[1], path_from, path_to);
+    ApplyThrottleOptions(options);
+    MetricsReporter reporter(options);
+    MyBackup(args[0], path_from, path_to, options);
   } catch (std::runtime_error& error) {
-    std::cerr << "Упс, кажется, программа завершилась с ошибкой!" << '\n'
-              << '\n';
-    std::cerr << error.what() << '\n' << '\n';
-    std::cerr << "Попробуйте снова после исправления ошибки!" << '\n';
+    PrintError(error);
     return 1;
   }
 }
\ No newline at end of file
@@ -1,9 +1,27 @@
 #include <sys/statvfs.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <ctime>
 #include <filesystem>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "../common/archive.h"
+#include "../common/chain.h"
+#include "../common/checkpoint.h"
+#include "../common/chunk_store.h"
+#include "../common/copy_engine.h"
+#include "../common/metadata.h"
+#include "../common/metrics.h"
+#include "../common/options.h"
+#include "../common/path_filter.h"
+#include "../common/scanner.h"
+#include "../common/throttle.h"
 
 namespace file_sys = std::filesystem;
 
@@ -14,38 +32,298 @@ bool HasCopyPermission(file_sys::path path) {
          file_sys::perms::none;
 }
 
-// Сравнивает директории и при различиях копирует в нужную папку
-void CopyFiles(file_sys::path current_file, file_sys::path path_to) {
-  if (HasCopyPermission(current_file)) {
-    throw std::runtime_error(
-        "Нет права на копирование файла в директорию, в которой вы хотите "
-        "создать "
-        "резервную копию\nПоменяйте права на файлы");
+// Файлы не меньше этого размера копируются первыми
+constexpr uint64_t kLargeFileSize = 1 << 20;
+
+// Восстанавливает содержимое директории бэкапа path_from в path_to. Дерево
+// читается одним проходом, затем создаётся весь скелет директорий, и только
+// после этого файлы копируются пулом потоков: копированию не нужно
+// создавать родителей, и потоки не ждут друг друга. Крупные файлы ставятся
+// в очередь первыми, от большего к меньшему, чтобы в конце восстановления
+// не копировался один большой файл, пока остальные потоки простаивают.
+// Метаданные переносятся последними
+void RestoreTree(const file_sys::path& path_from,
+                 const file_sys::path& path_to, const Options& options) {
+  ScanList entries = [&]() {
+    IoUring ring;
+    bool use_ring = options.io_uring &&
+                    ring.Init(options.queue_depth, {IORING_OP_STATX});
+    return ScanTree(path_from, use_ring ? &ring : nullptr,
+                    options.memory_limit);
+  }();
+
+  CopyEngine engine(options);
+  MetadataPass metadata(path_from, path_to, options);
+  // Крупные файлы отбираются в аренду списка обхода, чтобы и очередь не
+  // выходила за --memory-limit
+  ArenaVector<const ScanEntry*> large(entries.GetArena());
+  uint64_t files = 0;
+  uint64_t bytes = 0;
+  for (const ScanEntry& entry : entries) {
+    if (!IsReadable(entry)) {
+      throw std::runtime_error(
+          "Нет права на копирование файла в директорию, в которой вы хотите "
+          "создать "
+          "резервную копию\nПоменяйте права на файлы");
+    }
+    metadata.Add(entry.path, IsDirectory(entry));
+    if (IsDirectory(entry)) {
+      engine.CreateDirectory(path_to / entry.path);
+      continue;
+    }
+    ++files;
+    bytes += entry.size;
+    if (entry.size >= kLargeFileSize) {
+      large.PushBack(&entry);
+    }
+  }
+  Metrics().SetTotals(files, bytes);
+
+  std::sort(large.begin(), large.end(),
+            [](const ScanEntry* left, const ScanEntry* right) {
+              return left->size > right->size;
+            });
+  auto copy = [&](const ScanEntry& entry) {
+    engine.CopyFile(path_from / entry.path, path_to / entry.path,
+                    file_sys::copy_options::overwrite_existing);
+  };
+  for (const ScanEntry* entry : large) {
+    copy(*entry);
+  }
+  for (const ScanEntry& entry : entries) {
+    if (IsRegularFile(entry) && entry.size < kLargeFileSize) {
+      copy(entry);
+    }
+  }
+  engine.Wait();
+  metadata.Apply();
+}
+
+// Собирает файл снимка из блоков хранилища
+void RestoreSnapshotFile(const SnapshotRecord& record, const ChunkStore& store,
+                         const file_sys::path& dest_path) {
+  FileDescriptor fd(open(dest_path.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         record.mode & 07777));
+  if (!fd.IsValid()) {
+    ThrowCopyError(store.Root(), dest_path, errno);
+  }
+  // Нулевые блоки не пишутся: дыры исходного файла восстанавливаются
+  SparseWriter writer(fd.Get());
+  for (const SnapshotChunk& chunk : record.chunks) {
+    std::vector<uint8_t> data;
+    {
+      ThrottledIo io(chunk.size);
+      data = store.Get(chunk);
+    }
+    int error = writer.Write(data.data(), data.size());
+    if (error != 0) {
+      ThrowCopyError(store.Root(), dest_path, error);
+    }
+    CountMetric(Metric::kBytesCopied, data.size());
+  }
+  int error = writer.Finish();
+  if (error != 0) {
+    ThrowCopyError(store.Root(), dest_path, error);
+  }
+  CountMetric(Metric::kFilesCopied);
+}
+
+// Восстанавливает снимок хранилища дедупликации. Записи снимка отсортированы
+// по пути, поэтому директория всегда создаётся раньше вложенных в неё файлов
+void RestoreSnapshot(file_sys::path snapshot_path, file_sys::path path_to,
+                     const PathFilter& filter, const Options& options) {
+  ChunkStore store(snapshot_path.parent_path().parent_path() / "chunks");
+  std::vector<SnapshotRecord> records = ReadSnapshot(snapshot_path);
+  ThreadPool pool(JobsCount(options));
+  for (const SnapshotRecord& record : records) {
+    if (!filter.Matches(record.path)) {
+      continue;
+    }
+    file_sys::path dest_path = path_to / record.path;
+    if (record.directory) {
+      file_sys::create_directories(dest_path);
+      continue;
+    }
+    file_sys::create_directories(dest_path.parent_path());
+    pool.Submit([&record, &store, dest_path]() {
+      RestoreSnapshotFile(record, store, dest_path);
+    });
+  }
+  pool.Wait();
+}
+
+// Распаковывает файл архива, заголовок которого только что прочитан
+void ExtractArchiveFile(ArchiveStream& stream, const ArchiveEntry& entry,
+                        const file_sys::path& dest_path) {
+  file_sys::create_directories(dest_path.parent_path());
+  FileDescriptor fd(open(dest_path.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         entry.mode & 07777));
+  if (!fd.IsValid()) {
+    ThrowCopyError(stream.Path(), dest_path, errno);
   }
+  stream.ExtractData(entry, fd.Get(), dest_path);
+  CountMetric(Metric::kFilesCopied);
+  CountMetric(Metric::kBytesCopied, entry.size);
+}
 
-  if (file_sys::is_regular_file(current_file)) {
-    file_sys::create_directories(path_to);  // Создаём директорию, если её нет
-    file_sys::copy_file(current_file, path_to / current_file.filename(),
-                        file_sys::copy_options::overwrite_existing);
-  } else if (file_sys::is_directory(current_file)) {
-    if (!file_sys::exists(path_to / current_file.filename())) {
-      file_sys::create_directories(path_to / current_file.filename());
+// Восстанавливает архив бэкапа, читая его потоком от начала до индекса
+void RestoreArchive(file_sys::path archive_path, file_sys::path path_to) {
+  uint64_t index_offset = ReadArchiveIndexOffset(archive_path);
+  ArchiveStream stream(archive_path, sizeof(kArchiveMagic));
+  while (!stream.AtIndex(index_offset)) {
+    ArchiveEntry entry = stream.ReadHeader();
+    if (entry.directory) {
+      file_sys::create_directories(path_to / entry.path);
+      continue;
     }
-    for (const auto& component : file_sys::directory_iterator(current_file)) {
-      CopyFiles(component.path(), path_to / current_file.filename());
+    ExtractArchiveFile(stream, entry, path_to / entry.path);
+  }
+}
+
+// Выборочно восстанавливает архив: нужные элементы находятся по индексу,
+// и читаются только их заголовки и данные
+void RestoreArchiveSelected(file_sys::path archive_path,
+                            file_sys::path path_to, const PathFilter& filter) {
+  for (const ArchiveEntry& indexed : ReadArchiveIndex(archive_path)) {
+    if (!filter.Matches(indexed.path)) {
+      continue;
+    }
+    if (indexed.directory) {
+      file_sys::create_directories(path_to / indexed.path);
+      continue;
+    }
+    ArchiveStream stream(archive_path, indexed.header_offset);
+    ArchiveEntry entry = stream.ReadHeader();
+    if (entry.path != indexed.path) {
+      ThrowCorruptedArchive(archive_path);
     }
+    ExtractArchiveFile(stream, entry, path_to / entry.path);
+  }
+}
+
+// Копирует найденные в бэкапе пути и затем переносит их метаданные. Как и
+// в RestoreTree, сначала создаётся скелет директорий, затем копируются
+// файлы. При выборочном восстановлении родительские директории могут не
+// попасть в список, и они создаются вместе со скелетом
+void CopyResolved(const std::vector<ResolvedEntry>& entries,
+                  file_sys::path path_to, bool create_parents,
+                  const Options& options) {
+  CopyEngine engine(options);
+  MetadataPass metadata("", path_to, options);
+  Metrics().SetTotals(
+      std::count_if(entries.begin(), entries.end(),
+                    [](const ResolvedEntry& entry) { return !entry.directory; }),
+      0);
+  for (const ResolvedEntry& entry : entries) {
+    if (!entry.source.empty()) {
+      metadata.Add(entry.source.string(), entry.path, entry.directory);
+    }
+    if (entry.directory) {
+      engine.CreateDirectory(path_to / entry.path);
+    } else if (create_parents) {
+      engine.CreateDirectory((path_to / entry.path).parent_path());
+    }
+  }
+  for (const ResolvedEntry& entry : entries) {
+    if (entry.directory) {
+      continue;
+    }
+    if (HasCopyPermission(entry.source)) {
+      throw std::runtime_error(
+          "Нет права на копирование файла в директорию, в которой вы хотите "
+          "создать "
+          "резервную копию\nПоменяйте права на файлы");
+    }
+    if (!entry.base.empty()) {
+      engine.Submit([&engine, &entry, to = path_to / entry.path]() {
+        file_sys::create_directories(to.parent_path());
+        engine.ApplyDeltaNow(entry.base, entry.source, to, true);
+      });
+      continue;
+    }
+    engine.CopyFile(entry.source, path_to / entry.path,
+                    file_sys::copy_options::overwrite_existing);
+  }
+  engine.Wait();
+  metadata.Apply();
+}
+
+// Заново хеширует восстановленные файлы и сравнивает с хешами из манифеста.
+// Файлы без записанного хеша пропускаются
+void VerifyRestored(const std::vector<ResolvedEntry>& entries,
+                    file_sys::path path_to, const Options& options) {
+  size_t files = 0;
+  size_t checked = 0;
+  std::atomic<size_t> mismatched{0};
+  std::mutex mismatch_mutex;
+  std::string first_mismatch;
+  ThreadPool pool(JobsCount(options));
+  for (const ResolvedEntry& entry : entries) {
+    if (entry.directory) {
+      continue;
+    }
+    ++files;
+    if (entry.hash == 0) {
+      continue;
+    }
+    ++checked;
+    pool.Submit([&, path = path_to / entry.path, hash = entry.hash]() {
+      if (HashFile(path) == hash) {
+        return;
+      }
+      if (mismatched++ == 0) {
+        std::lock_guard<std::mutex> lock(mismatch_mutex);
+        first_mismatch = path.string();
+      }
+    });
+  }
+  pool.Wait();
+
+  if (files > 0 && checked == 0) {
+    throw std::runtime_error(
+        "В манифесте бэкапа нет хешей содержимого\nСделайте бэкап с "
+        "параметром --verify");
+  }
+  if (mismatched > 0) {
+    throw std::runtime_error(
+        "Восстановленный файл " + first_mismatch +
+        " не совпадает с бэкапом, всего несовпадений: " +
+        std::to_string(mismatched.load()) +
+        "\nПроверьте диск и повторите восстановление");
+  }
+  std::cout << "Проверено файлов: " << checked << " из " << files << '\n';
+}
+
+// Восстанавливает цепочку бэкапов, которая заканчивается path_from: для
+// каждого пути копируется только самая новая версия, один раз
+void RestoreChain(file_sys::path path_from, file_sys::path path_to,
+                  const PathFilter& filter, const Options& options) {
+  std::vector<ResolvedEntry> entries = ResolveChain(path_from, filter);
+  CopyResolved(entries, path_to, !filter.Empty(), options);
+  if (options.verify) {
+    VerifyRestored(entries, path_to, options);
   }
 }
 
 // Выполняет проверку переданных путей
-void MyRestore(file_sys::path path_from, file_sys::path path_to) {
+void MyRestore(file_sys::path path_from, file_sys::path path_to,
+               const Options& options) {
   if (!file_sys::exists(path_from) || !file_sys::exists(path_to)) {
     throw std::runtime_error(
         "Одна из переданных директорий не существует.\nПроверьте правильно ли "
         "вы указали путь до нужных вам директорий либо создайте их.");
   }
 
-  if (!file_sys::is_directory(path_from) || !file_sys::is_directory(path_to)) {
+  // Вместо директории бэкапа можно передать снимок из хранилища
+  // дедупликации или архив
+  bool snapshot =
+      file_sys::is_regular_file(path_from) && IsSnapshotFile(path_from);
+  bool archive =
+      file_sys::is_regular_file(path_from) && IsArchiveFile(path_from);
+  if ((!file_sys::is_directory(path_from) && !snapshot && !archive) ||
+      !file_sys::is_directory(path_to)) {
     throw std::runtime_error(
         "Один из переданных путей ведёт не к директории.\nПроверьте правильно "
         "ли вы указали путь до нужных вам директорий либо создайте их.");
@@ -60,17 +338,85 @@ void MyRestore(file_sys::path path_from, file_sys::path path_to) {
         " директории для копирования");
   }
 
-  try {
-    for (const auto& component : file_sys::directory_iterator(path_from)) {
-      CopyFiles(component.path(), path_to);
+  // Незавершённый бэкап может ссылаться на файлы, которых ещё нет
+  file_sys::path backup_dir = path_from.lexically_normal();
+  if (!backup_dir.has_filename()) {
+    backup_dir = backup_dir.parent_path();
+  }
+  if (file_sys::exists(CheckpointPath(backup_dir))) {
+    throw std::runtime_error("Бэкап " + backup_dir.string() +
+                             " не завершён\nПродолжите его через my_backup "
+                             "--resume");
+  }
+
+  // Кольцо io_uring пишет через page cache
+  if (options.direct && options.io_uring) {
+    throw std::runtime_error(
+        "Параметр --direct не сочетается с --io-uring\nУкажите только один "
+        "из них");
+  }
+
+  PathFilter filter(options.includes);
+  if (snapshot) {
+    RestoreSnapshot(path_from, path_to, filter, options);
+    return;
+  }
+  if (archive) {
+    if (options.verify) {
+      throw std::runtime_error(
+          "В архиве нет хешей содержимого\nВосстановите архив без параметра "
+          "--verify");
     }
-  } catch (std::runtime_error& error) {
-    throw;
+    if (filter.Empty()) {
+      RestoreArchive(path_from, path_to);
+    } else {
+      RestoreArchiveSelected(path_from, path_to, filter);
+    }
+    return;
+  }
+  if (options.chain) {
+    RestoreChain(path_from, path_to, filter, options);
+    return;
+  }
+  if (!filter.Empty() || options.verify || HasDeltaEntries(path_from)) {
+    // Для проверки нужны хеши из манифеста, а для патчей — ссылка на full
+    // backup, поэтому бэкап разбирается по манифесту
+    std::vector<ResolvedEntry> entries = ResolveBackupDir(path_from, filter);
+    CopyResolved(entries, path_to, true, options);
+    if (options.verify) {
+      VerifyRestored(entries, path_to, options);
+    }
+    return;
   }
+
+  RestoreTree(path_from, path_to, options);
+}
+
+// Печатает сообщение об ошибке выполнения
+void PrintError(const std::runtime_error& error) {
+  std::cerr << "Упс, кажется, программа завершилась с ошибкой!" << '\n'
+            << '\n';
+  std::cerr << error.what() << '\n' << '\n';
+  std::cerr << "Попробуйте снова после исправления ошибки!" << '\n';
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 3) {
+  Options options;
+  std::vector<std::string> args;
+  try {
+    args = ParseOptions(
+        argc, argv,
+        {"--jobs", "--copy-report", "--chain", "--include", "--verify",
+         "--io-uring", "--queue-depth", "--progress", "--metrics-file",
+         "--limit-mbps", "--limit-iops", "--latency-target", "--ionice",
+         "--nice", "--direct", "--memory-limit"},
+        options);
+  } catch (std::runtime_error& error) {
+    PrintError(error);
+    return 1;
+  }
+
+  if (args.size() != 2) {
     std::cerr << "Вы неправильно используете команду." << '\n' << '\n';
     std::cerr << "Формат ввода:" << '\n';
     std::cerr << "./my_restore [path from] [path to]" << '\n' << '\n';
@@ -78,16 +424,15 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  file_sys::path path_from = argv[1];
-  file_sys::path path_to = argv[2];
+  file_sys::path path_from = args[0];
+  file_sys::path path_to = args[1];
 
   try {
-    MyRestore(path_from, path_to);
+    ApplyThrottleOptions(options);
+    MetricsReporter reporter(options);
+    MyRestore(path_from, path_to, options);
   } catch (std::runtime_error& error) {
-    std::cerr << "Упс, кажется, программа завершилась с ошибкой!" << '\n'
-              << '\n';
-    std::cerr << error.what() << '\n' << '\n';
-    std::cerr << "Попробуйте снова после исправления ошибки!" << '\n';
+    PrintError(error);
     return 1;
   }
 }
\ No newline at end of file
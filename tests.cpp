@@ -1,12 +1,22 @@
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <unistd.h>
 
 namespace file_sys = std::filesystem;
@@ -37,12 +47,17 @@ class BackupTests : public ::testing::Test {
     file_sys::remove_all(backup);
   }
 
+  // Имя последнего бэкапа. Берётся из директории бэкапов, а не из текущего
+  // времени: бэкап мог начаться в прошлую секунду
   file_sys::path GetTimeName() {
-    std::time_t seconds = std::time(nullptr);
-    std::tm* now_time = std::localtime(&seconds);
-    std::ostringstream oss;
-    oss << std::put_time(now_time, "%Y-%m-%d-%H-%M-%S");
-    file_sys::path dir_name = oss.str();
+    file_sys::path dir_name;
+    for (const auto& entry : file_sys::directory_iterator(backup)) {
+      file_sys::path name = entry.path().filename();
+      if (entry.is_directory() && std::isdigit(name.string()[0]) &&
+          name > dir_name) {
+        dir_name = name;
+      }
+    }
     return dir_name;
   }
 
@@ -72,8 +87,9 @@ TEST_F(BackupTests, IncorrectFormatCommand) {
   std::string output = RunCommand("./bin/my_backup full " + work.string());
   std::string expected_out =
       "Вы неправильно используете команду.\n\nФормат ввода:\n./my_backup "
-      "[full/incremental] [path from] [path to]\n\nПопробуйте "
-      "снова!\n";
+      "[full/incremental/snapshot/dedup/archive/watch] [path from] [path "
+      "to]\n./my_backup compact [path to]\n\n"
+      "Попробуйте снова!\n";
   EXPECT_EQ(output, expected_out);
 }
 
@@ -117,6 +133,77 @@ TEST_F(BackupTests, FullBackup) {
   EXPECT_EQ(dir_name.string(), last_full.str());
 }
 
+// Тест на фул бэкап в несколько потоков и его восстановление
+TEST_F(BackupTests, FullBackupWithJobs) {
+  for (int i = 0; i < 50; ++i) {
+    std::ofstream(work / "subdir1" / ("many" + std::to_string(i) + ".txt"))
+        << "Many file " << i;
+  }
+  RunCommand("./bin/my_backup --jobs 4 full " + work.string() + " " +
+             backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+  ASSERT_FALSE(dir_name.empty());
+
+  EXPECT_TRUE(
+      file_sys::exists(backup / dir_name / "subdir1/subdir2/file3.txt"));
+  for (int i = 0; i < 50; ++i) {
+    EXPECT_EQ(ReadFile(backup / dir_name / "subdir1" /
+                       ("many" + std::to_string(i) + ".txt")),
+              "Many file " + std::to_string(i));
+  }
+
+  file_sys::remove_all(work / "subdir1");
+  RunCommand("./bin/my_restore --jobs=3 " + (backup / dir_name).string() +
+             " " + work.string());
+  EXPECT_EQ(ReadFile(work / "subdir1/subdir2/file3.txt"), "Test file 3");
+  EXPECT_EQ(ReadFile(work / "subdir1/many49.txt"), "Many file 49");
+}
+
+// Тест на некорректное значение параметра
+TEST_F(BackupTests, IncorrectJobsOption) {
+  std::string output = RunCommand("./bin/my_backup --jobs 0 full " +
+                                  work.string() + " " + backup.string());
+  std::string expected_out =
+      "Упс, кажется, программа завершилась с ошибкой!\n\n"
+      "Передано некорректное значение параметра --jobs\nУкажите "
+      "положительное целое число\n\nПопробуйте снова после исправления "
+      "ошибки!\n";
+  EXPECT_EQ(output, expected_out);
+
+  // Отрицательное число не должно превращаться в огромное
+  output = RunCommand("./bin/my_backup --jobs -1 full " + work.string() + " " +
+                      backup.string());
+  EXPECT_EQ(output, expected_out);
+}
+
+// Тест на отрицательный размер в параметре
+TEST_F(BackupTests, NegativeSizeOption) {
+  std::string output =
+      RunCommand("./bin/my_backup --delta-threshold -1 incremental " +
+                 work.string() + " " + backup.string());
+  std::string expected_out =
+      "Упс, кажется, программа завершилась с ошибкой!\n\n"
+      "Передано некорректное значение параметра --delta-threshold\nУкажите "
+      "размер в байтах, например 64M\n\nПопробуйте снова после исправления "
+      "ошибки!\n";
+  EXPECT_EQ(output, expected_out);
+}
+
+// Тест на отчёт о способе копирования файлов
+TEST_F(BackupTests, CopyReport) {
+  std::string output = RunCommand("./bin/my_backup --copy-report full " +
+                                  work.string() + " " + backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+
+  EXPECT_NE(output.find((backup / dir_name / "file1.txt").string()),
+            std::string::npos);
+  EXPECT_NE(output.find((backup / dir_name / "subdir1/file2.txt").string()),
+            std::string::npos);
+  EXPECT_NE(output.find("Итого:"), std::string::npos);
+  EXPECT_EQ(ReadFile(backup / dir_name / "subdir1/subdir2/file3.txt"),
+            "Test file 3");
+}
+
 // Тест на инкрементный бэкап без предыдущего фул бэкапа
 TEST_F(BackupTests, IncrementalBackupWithoutFull) {
   RunCommand("./bin/my_backup incremental " + work.string() + " " +
@@ -168,6 +255,856 @@ TEST_F(BackupTests, IncrementalBackupWithFull) {
   EXPECT_EQ(ReadFile(backup / "last_full.txt"), full_dir_name.string());
 }
 
+// Тест на инкрементный бэкап по манифесту последнего фулл бэкапа
+TEST_F(BackupTests, IncrementalBackupByManifest) {
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_dir_name = ReadFile(backup / "last_full.txt");
+  ASSERT_TRUE(file_sys::exists(backup / (full_dir_name.string() + ".manifest")));
+
+  // Дерево фулл бэкапа не читается: удалённая из него копия не влияет на
+  // инкрементный бэкап
+  file_sys::remove(backup / full_dir_name / "subdir1/file2.txt");
+  std::ofstream(work / "subdir1/subdir2/file3.txt", std::ios::out)
+      << "Changed test file 3";
+
+  sleep(1);
+  RunCommand("./bin/my_backup incremental " + work.string() + " " +
+             backup.string());
+  file_sys::path dir_name = GetTimeName();
+
+  EXPECT_TRUE(file_sys::exists(backup / (dir_name.string() + ".manifest")));
+  EXPECT_FALSE(file_sys::exists(backup / dir_name / "file1.txt"));
+  EXPECT_FALSE(file_sys::exists(backup / dir_name / "subdir1/file2.txt"));
+  EXPECT_EQ(ReadFile(backup / dir_name / "subdir1/subdir2/file3.txt"),
+            "Changed test file 3");
+}
+
+// Тест на бэкап с дедупликацией блоков и восстановление снимка
+TEST_F(BackupTests, DedupBackupAndRestore) {
+  std::string big(300 * 1024, 'x');
+  for (size_t i = 0; i < big.size(); i += 7) {
+    big[i] = static_cast<char>('a' + i % 26);
+  }
+  std::ofstream(work / "big1.bin") << big;
+  std::ofstream(work / "subdir1/big2.bin") << big;
+
+  RunCommand("./bin/my_backup dedup " + work.string() + " " + backup.string());
+  ASSERT_TRUE(file_sys::exists(backup / "snapshots"));
+  EXPECT_FALSE(file_sys::exists(backup / "last_full.txt"));
+
+  // Одинаковые файлы хранятся одним набором блоков
+  uintmax_t chunks_size = 0;
+  for (const auto& entry :
+       file_sys::recursive_directory_iterator(backup / "chunks")) {
+    if (file_sys::is_regular_file(entry)) {
+      chunks_size += file_sys::file_size(entry);
+    }
+  }
+  EXPECT_LT(chunks_size, 2 * big.size());
+
+  file_sys::path snapshot =
+      file_sys::directory_iterator(backup / "snapshots")->path();
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + snapshot.string() + " " + work.string());
+
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+  EXPECT_EQ(ReadFile(work / "subdir1/subdir2/file3.txt"), "Test file 3");
+  std::ifstream restored(work / "subdir1/big2.bin", std::ios::binary);
+  std::string restored_big((std::istreambuf_iterator<char>(restored)),
+                           std::istreambuf_iterator<char>());
+  EXPECT_EQ(restored_big, big);
+}
+
+// Тест на то, что обрезанный блок в хранилище не считается сохранённым:
+// следующий снимок записывает его заново
+TEST_F(BackupTests, DedupRewritesTruncatedChunk) {
+  RunCommand("./bin/my_backup dedup " + work.string() + " " + backup.string());
+  for (const auto& entry :
+       file_sys::recursive_directory_iterator(backup / "chunks")) {
+    if (file_sys::is_regular_file(entry)) {
+      file_sys::resize_file(entry.path(), 1);
+    }
+  }
+  RunCommand("./bin/my_backup dedup " + work.string() + " " + backup.string());
+
+  std::vector<file_sys::path> snapshots;
+  for (const auto& entry :
+       file_sys::directory_iterator(backup / "snapshots")) {
+    snapshots.push_back(entry.path());
+  }
+  ASSERT_EQ(snapshots.size(), 2u);
+  std::sort(snapshots.begin(), snapshots.end());
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  EXPECT_EQ(RunCommand("./bin/my_restore " + snapshots[1].string() + " " +
+                       work.string()),
+            "");
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+  EXPECT_EQ(ReadFile(work / "subdir1/subdir2/file3.txt"), "Test file 3");
+}
+
+// Тест на два снимка дедупликации подряд: второй не перезаписывает первый,
+// даже если оба сделаны в одну секунду
+TEST_F(BackupTests, DedupSnapshotsDoNotCollide) {
+  RunCommand("./bin/my_backup dedup " + work.string() + " " + backup.string());
+  std::ofstream(work / "file1.txt") << "Changed test file 1";
+  RunCommand("./bin/my_backup dedup " + work.string() + " " + backup.string());
+
+  std::vector<file_sys::path> snapshots;
+  for (const auto& entry :
+       file_sys::directory_iterator(backup / "snapshots")) {
+    snapshots.push_back(entry.path());
+  }
+  ASSERT_EQ(snapshots.size(), 2u);
+  std::sort(snapshots.begin(), snapshots.end());
+  EXPECT_EQ(snapshots[0].extension(), ".snapshot");
+  EXPECT_EQ(snapshots[1].extension(), ".snapshot");
+
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + snapshots[0].string() + " " +
+             work.string());
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+}
+
+// Тест на восстановление цепочки full + инкрементные бэкапы за один проход
+TEST_F(BackupTests, ChainRestore) {
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  std::ofstream(work / "file1.txt", std::ios::out) << "Changed test file 1";
+  sleep(1);
+  RunCommand("./bin/my_backup incremental " + work.string() + " " +
+             backup.string());
+  std::ofstream(work / "subdir1/file2.txt", std::ios::out)
+      << "Changed test file 2";
+  sleep(1);
+  RunCommand("./bin/my_backup incremental " + work.string() + " " +
+             backup.string());
+  file_sys::path last_dir_name = GetTimeName();
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_chain";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  RunCommand("./bin/my_restore --chain " +
+             (backup / last_dir_name).string() + " " + restored.string());
+
+  EXPECT_EQ(ReadFile(restored / "file1.txt"), "Changed test file 1");
+  EXPECT_EQ(ReadFile(restored / "subdir1/file2.txt"), "Changed test file 2");
+  EXPECT_EQ(ReadFile(restored / "subdir1/subdir2/file3.txt"), "Test file 3");
+  file_sys::remove_all(restored);
+}
+
+// Тест на то, что битая символическая ссылка не мешает бэкапу
+TEST_F(BackupTests, BrokenSymlinkSkipped) {
+  file_sys::create_symlink(work / "missing.txt", work / "subdir1/broken_link");
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+
+  EXPECT_TRUE(file_sys::exists(backup / dir_name / "subdir1/file2.txt"));
+  EXPECT_FALSE(file_sys::exists(
+      file_sys::symlink_status(backup / dir_name / "subdir1/broken_link")));
+}
+
+// Тест на бэкап в сжатый архив и потоковое восстановление из него
+TEST_F(BackupTests, ArchiveBackupAndRestore) {
+  std::string big(3 * 1024 * 1024 + 17, 'a');
+  for (size_t i = 0; i < big.size(); i += 4096) {
+    big[i] = static_cast<char>('b' + i % 20);
+  }
+  std::ofstream(work / "subdir1/big.bin") << big;
+  file_sys::create_directory(work / "empty_dir");
+
+  RunCommand("./bin/my_backup archive " + work.string() + " " +
+             backup.string());
+  file_sys::path archive;
+  for (const auto& entry : file_sys::directory_iterator(backup)) {
+    if (entry.path().extension() == ".bra") {
+      archive = entry.path();
+    }
+  }
+  ASSERT_FALSE(archive.empty());
+  EXPECT_LT(file_sys::file_size(archive), big.size() / 4);
+
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + archive.string() + " " + work.string());
+
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+  EXPECT_EQ(ReadFile(work / "subdir1/subdir2/file3.txt"), "Test file 3");
+  EXPECT_TRUE(file_sys::is_directory(work / "empty_dir"));
+  std::ifstream restored(work / "subdir1/big.bin", std::ios::binary);
+  std::string restored_big((std::istreambuf_iterator<char>(restored)),
+                           std::istreambuf_iterator<char>());
+  EXPECT_EQ(restored_big, big);
+}
+
+// Тест на два архива подряд: второй не перезаписывает первый, даже если
+// оба сделаны в одну секунду
+TEST_F(BackupTests, ArchivesDoNotCollide) {
+  RunCommand("./bin/my_backup archive " + work.string() + " " +
+             backup.string());
+  std::ofstream(work / "file1.txt") << "Changed test file 1";
+  RunCommand("./bin/my_backup archive " + work.string() + " " +
+             backup.string());
+
+  std::vector<file_sys::path> archives;
+  for (const auto& entry : file_sys::directory_iterator(backup)) {
+    archives.push_back(entry.path());
+  }
+  ASSERT_EQ(archives.size(), 2u);
+  std::sort(archives.begin(), archives.end());
+  EXPECT_EQ(archives[0].extension(), ".bra");
+  EXPECT_EQ(archives[1].extension(), ".bra");
+
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + archives[0].string() + " " +
+             work.string());
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+}
+
+// Тест на выборочное восстановление по шаблону
+TEST_F(BackupTests, SelectiveRestore) {
+  std::ofstream(work / "subdir1/subdir2/file4.conf") << "Test file 4";
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_selective";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  RunCommand("./bin/my_restore --include 'subdir1/**/*.conf' --include "
+             "file1.txt " +
+             (backup / dir_name).string() + " " + restored.string());
+
+  EXPECT_EQ(ReadFile(restored / "file1.txt"), "Test file 1");
+  EXPECT_EQ(ReadFile(restored / "subdir1/subdir2/file4.conf"), "Test file 4");
+  EXPECT_FALSE(file_sys::exists(restored / "subdir1/file2.txt"));
+  EXPECT_FALSE(file_sys::exists(restored / "subdir1/subdir2/file3.txt"));
+  file_sys::remove_all(restored);
+}
+
+// Тест на хеширование содержимого: файл с новым временем изменения, но
+// прежним содержимым не копируется, а повреждённая копия находится при
+// проверке восстановления
+TEST_F(BackupTests, VerifyBackupAndRestore) {
+  RunCommand("./bin/my_backup --verify full " + work.string() + " " +
+             backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+
+  file_sys::last_write_time(
+      work / "file1.txt",
+      file_sys::last_write_time(work / "file1.txt") + std::chrono::hours(1));
+  std::ofstream(work / "subdir1/file2.txt") << "Test file X";
+  sleep(1);
+  RunCommand("./bin/my_backup --verify incremental " + work.string() + " " +
+             backup.string());
+  file_sys::path incremental;
+  for (const auto& component : file_sys::directory_iterator(backup)) {
+    if (component.is_directory() && component.path().filename() != dir_name) {
+      incremental = component.path();
+    }
+  }
+  EXPECT_FALSE(file_sys::exists(incremental / "file1.txt"));
+  EXPECT_EQ(ReadFile(incremental / "subdir1/file2.txt"), "Test file X");
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_verify";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  std::string output = RunCommand("./bin/my_restore --verify " +
+                                  (backup / dir_name).string() + " " +
+                                  restored.string());
+  EXPECT_EQ(output, "Проверено файлов: 3 из 3\n");
+
+  std::ofstream(backup / dir_name / "file1.txt") << "Test file X";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  output = RunCommand("./bin/my_restore --verify " +
+                      (backup / dir_name).string() + " " + restored.string());
+  EXPECT_NE(output.find("не совпадает с бэкапом"), std::string::npos);
+  file_sys::remove_all(restored);
+}
+
+// Тест на бэкап и восстановление через io_uring. На ядрах без io_uring
+// утилиты копируют обычным путём, поэтому проверяется только результат
+TEST_F(BackupTests, IoUringBackupAndRestore) {
+  file_sys::create_directories(work / "empty/nested");
+  RunCommand("./bin/my_backup --io-uring --queue-depth 4 full " +
+             work.string() + " " + backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+  EXPECT_EQ(ReadFile(backup / dir_name / "subdir1/subdir2/file3.txt"),
+            "Test file 3");
+  EXPECT_TRUE(file_sys::is_directory(backup / dir_name / "empty/nested"));
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_uring";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  RunCommand("./bin/my_restore --io-uring " + (backup / dir_name).string() +
+             " " + restored.string());
+  EXPECT_EQ(ReadFile(restored / "file1.txt"), "Test file 1");
+  EXPECT_EQ(ReadFile(restored / "subdir1/file2.txt"), "Test file 2");
+  EXPECT_TRUE(file_sys::is_directory(restored / "empty/nested"));
+  file_sys::remove_all(restored);
+}
+
+// Тест на файл метрик: после бэкапа в нём итоговые счётчики в формате
+// Prometheus
+TEST_F(BackupTests, MetricsFile) {
+  file_sys::path metrics =
+      file_sys::temp_directory_path() / "test_metrics.prom";
+  RunCommand("./bin/my_backup --metrics-file " + metrics.string() + " full " +
+             work.string() + " " + backup.string());
+
+  std::ifstream file(metrics);
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  EXPECT_NE(text.find("backup_files_scanned_total 3\n"), std::string::npos);
+  EXPECT_NE(text.find("backup_files_copied_total 3\n"), std::string::npos);
+  EXPECT_NE(text.find("backup_bytes_copied_total 33\n"), std::string::npos);
+  EXPECT_NE(text.find("backup_copy_latency_seconds_count 3\n"),
+            std::string::npos);
+  file_sys::remove(metrics);
+}
+
+// Тест на файл с дырами: копия в бэкапе и восстановленный файл тоже с
+// дырами и не занимают место под всю длину файла
+TEST_F(BackupTests, SparseFileKeepsHoles) {
+  {
+    std::ofstream file(work / "disk.img", std::ios::binary);
+    file.seekp(32 << 20);
+    file << "data";
+  }
+  file_sys::resize_file(work / "disk.img", 64 << 20);
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_sparse";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  RunCommand("./bin/my_restore " + (backup / dir_name).string() + " " +
+             restored.string());
+
+  for (const file_sys::path& path :
+       {backup / dir_name / "disk.img", restored / "disk.img"}) {
+    struct stat file_stat;
+    ASSERT_EQ(stat(path.c_str(), &file_stat), 0);
+    EXPECT_EQ(file_stat.st_size, 64 << 20);
+    EXPECT_LT(file_stat.st_blocks * 512, 1 << 20);
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(32 << 20);
+    std::string data(4, '\0');
+    file.read(data.data(), data.size());
+    EXPECT_EQ(data, "data");
+  }
+  file_sys::remove_all(restored);
+}
+
+// Тест на инкрементный бэкап патчем: от большого файла с вставкой в
+// середине сохраняется только патч, а цепочка восстанавливает файл целиком
+TEST_F(BackupTests, DeltaIncrementalBackup) {
+  std::string data;
+  uint32_t state = 1;
+  for (size_t i = 0; i < (4 << 20); ++i) {
+    state = state * 1103515245 + 12345;
+    data.push_back(static_cast<char>(state >> 16));
+  }
+  std::ofstream(work / "db.bin", std::ios::binary) << data;
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+
+  data.insert(1 << 20, "inserted bytes");
+  std::ofstream(work / "db.bin", std::ios::binary) << data;
+  sleep(1);
+  RunCommand("./bin/my_backup --delta-threshold 1M incremental " +
+             work.string() + " " + backup.string());
+  file_sys::path dir_name = GetTimeName();
+  file_sys::path patch = backup / dir_name / "db.bin.brdelta";
+  ASSERT_TRUE(file_sys::exists(patch));
+  EXPECT_FALSE(file_sys::exists(backup / dir_name / "db.bin"));
+  EXPECT_LT(file_sys::file_size(patch), 1u << 20);
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_delta";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  RunCommand("./bin/my_restore --chain " + (backup / dir_name).string() +
+             " " + restored.string());
+  std::ifstream file(restored / "db.bin", std::ios::binary);
+  std::string restored_data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  EXPECT_TRUE(restored_data == data);
+  file_sys::remove_all(restored);
+}
+
+// Тест на патч к файлу, который растёт во время бэкапа: патч описывает
+// файл на момент открытия и применяется
+TEST_F(BackupTests, DeltaOfGrowingFile) {
+  std::string data;
+  uint32_t state = 1;
+  for (size_t i = 0; i < (4 << 20); ++i) {
+    state = state * 1103515245 + 12345;
+    data.push_back(static_cast<char>(state >> 16));
+  }
+  std::ofstream(work / "db.bin", std::ios::binary) << data;
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  sleep(1);
+
+  std::atomic<bool> stop{false};
+  std::thread appender([&]() {
+    std::string block(4096, 'g');
+    while (!stop) {
+      std::ofstream(work / "db.bin", std::ios::binary | std::ios::app)
+          << block;
+      usleep(20000);
+    }
+  });
+  RunCommand("./bin/my_backup --delta-threshold 1M --limit-mbps 16 "
+             "incremental " +
+             work.string() + " " + backup.string());
+  stop = true;
+  appender.join();
+
+  file_sys::path last_dir;
+  for (const auto& entry : file_sys::directory_iterator(backup)) {
+    if (entry.is_directory() && entry.path() > last_dir) {
+      last_dir = entry.path();
+    }
+  }
+  ASSERT_TRUE(file_sys::exists(last_dir / "db.bin.brdelta"));
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_delta";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  std::string output = RunCommand("./bin/my_restore --chain " +
+                                  last_dir.string() + " " + restored.string());
+  EXPECT_EQ(output, "");
+  std::ifstream restored_file(restored / "db.bin", std::ios::binary);
+  std::string restored_data((std::istreambuf_iterator<char>(restored_file)),
+                            std::istreambuf_iterator<char>());
+  std::ifstream source_file(work / "db.bin", std::ios::binary);
+  std::string source_data((std::istreambuf_iterator<char>(source_file)),
+                          std::istreambuf_iterator<char>());
+  EXPECT_GT(restored_data.size(), data.size());
+  EXPECT_TRUE(source_data.compare(0, restored_data.size(), restored_data) ==
+              0);
+  file_sys::remove_all(restored);
+}
+
+// Тест на дерево глубже лимита открытых файлов: обход идёт без рекурсии,
+// а список обхода при маленьком --memory-limit вытесняется во временный
+// файл, и при бэкапе, и при восстановлении
+TEST_F(BackupTests, DeepTreeWithMemoryLimit) {
+  file_sys::path deep = work;
+  for (int i = 0; i < 1000; ++i) {
+    deep /= "d";
+  }
+  file_sys::create_directories(deep);
+  std::ofstream(deep / "leaf.txt") << "leaf";
+
+  rlimit old_limit;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &old_limit), 0);
+  rlimit low_limit = old_limit;
+  low_limit.rlim_cur = 256;
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low_limit), 0);
+  RunCommand("./bin/my_backup --memory-limit 1K full " + work.string() + " " +
+             backup.string());
+  setrlimit(RLIMIT_NOFILE, &old_limit);
+
+  file_sys::path dir_name = ReadFile(backup / "last_full.txt");
+  file_sys::path copy = backup / dir_name / file_sys::relative(deep, work);
+  EXPECT_EQ(ReadFile(copy / "leaf.txt"), "leaf");
+  EXPECT_EQ(ReadFile(backup / dir_name / "file1.txt"),
+            ReadFile(work / "file1.txt"));
+
+  file_sys::path restored = file_sys::temp_directory_path() / "test_deep";
+  file_sys::remove_all(restored);
+  file_sys::create_directory(restored);
+  EXPECT_EQ(RunCommand("./bin/my_restore --memory-limit 1K " +
+                       (backup / dir_name).string() + " " +
+                       restored.string()),
+            "");
+  EXPECT_EQ(ReadFile(restored / file_sys::relative(deep, work) / "leaf.txt"),
+            "leaf");
+  file_sys::remove_all(restored);
+}
+
+// Тест на дерево глубже жёсткого лимита открытых файлов: бэкап завершается
+// понятной ошибкой
+TEST_F(BackupTests, TreeDeeperThanHardLimit) {
+  file_sys::path deep = work;
+  for (int i = 0; i < 300; ++i) {
+    deep /= "d";
+  }
+  file_sys::create_directories(deep);
+
+  std::string output =
+      RunCommand("ulimit -Sn 256 && ulimit -Hn 256 && ./bin/my_backup full " +
+                 work.string() + " " + backup.string());
+  EXPECT_NE(output.find("больше лимита открытых файлов"), std::string::npos)
+      << output;
+}
+
+// Тест на журнал изменений: пока работает наблюдатель, инкрементный бэкап
+// перечитывает только изменённые пути
+TEST_F(BackupTests, WatchJournalIncremental) {
+  RunCommand("(./bin/my_backup watch " + work.string() + " " +
+             backup.string() + " > /dev/null 2>&1 &)");
+  // Наблюдатель готов, когда записал в журнал первую строку
+  for (int i = 0; i < 100 && ReadFile(backup / "watch.journal").empty(); ++i) {
+    usleep(100000);
+  }
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  sleep(1);
+  std::ofstream(work / "subdir1/file2.txt") << "Changed file 2";
+  sleep(2);
+
+  file_sys::path metrics =
+      file_sys::temp_directory_path() / "test_watch_metrics.prom";
+  RunCommand("./bin/my_backup --metrics-file " + metrics.string() +
+             " incremental " + work.string() + " " + backup.string());
+  std::string pid;
+  {
+    std::ifstream lock(backup / "watch.lock");
+    std::getline(lock, pid);
+    std::getline(lock, pid);
+  }
+  RunCommand("kill " + pid);
+
+  // Инкрементный бэкап — директория, отличная от последнего full backup
+  file_sys::path full_name = ReadFile(backup / "last_full.txt");
+  file_sys::path dir_name;
+  for (const auto& component : file_sys::directory_iterator(backup)) {
+    if (component.is_directory() && component.path().filename() != full_name) {
+      dir_name = component.path().filename();
+    }
+  }
+  EXPECT_EQ(ReadFile(backup / dir_name / "subdir1/file2.txt"),
+            "Changed file 2");
+  EXPECT_FALSE(file_sys::exists(backup / dir_name / "file1.txt"));
+  std::ifstream file(metrics);
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  EXPECT_NE(text.find("backup_files_scanned_total 1\n"), std::string::npos);
+  file_sys::remove(metrics);
+}
+
+// Тест на изменение прямо перед инкрементным бэкапом: бэкап дожидается,
+// пока наблюдатель допишет накопленные события в журнал
+TEST_F(BackupTests, WatchJournalSyncBeforeBackup) {
+  RunCommand("(./bin/my_backup watch " + work.string() + " " +
+             backup.string() + " > /dev/null 2>&1 &)");
+  for (int i = 0; i < 100 && ReadFile(backup / "watch.journal").empty(); ++i) {
+    usleep(100000);
+  }
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_name = ReadFile(backup / "last_full.txt");
+  sleep(1);
+
+  std::ofstream(work / "subdir1/file2.txt", std::ios::app) << " appended";
+  file_sys::path metrics =
+      file_sys::temp_directory_path() / "test_watch_sync_metrics.prom";
+  RunCommand("./bin/my_backup --metrics-file " + metrics.string() +
+             " incremental " + work.string() + " " + backup.string());
+  std::string pid;
+  {
+    std::ifstream lock(backup / "watch.lock");
+    std::getline(lock, pid);
+    std::getline(lock, pid);
+  }
+  RunCommand("kill " + pid);
+
+  file_sys::path dir_name;
+  for (const auto& component : file_sys::directory_iterator(backup)) {
+    if (component.is_directory() && component.path().filename() != full_name) {
+      dir_name = component.path().filename();
+    }
+  }
+  EXPECT_EQ(ReadFile(backup / dir_name / "subdir1/file2.txt"),
+            "Test file 2 appended");
+  // Изменения взяты из журнала, а не обходом дерева
+  std::ifstream file(metrics);
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  EXPECT_NE(text.find("backup_files_scanned_total 1\n"), std::string::npos);
+  file_sys::remove(metrics);
+}
+
+// Тест на снимки: новый снимок — полное дерево, неизменённые файлы в нём —
+// жёсткие ссылки на файлы прошлого снимка
+TEST_F(BackupTests, SnapshotBackup) {
+  RunCommand("./bin/my_backup snapshot " + work.string() + " " +
+             backup.string());
+  file_sys::path first = ReadFile(backup / "last_full.txt");
+  sleep(1);
+  std::ofstream(work / "file1.txt") << "Changed test file 1";
+  RunCommand("./bin/my_backup snapshot " + work.string() + " " +
+             backup.string());
+  file_sys::path second = ReadFile(backup / "last_full.txt");
+  ASSERT_NE(first, second);
+
+  EXPECT_EQ(ReadFile(backup / second / "file1.txt"), "Changed test file 1");
+  EXPECT_EQ(ReadFile(backup / first / "file1.txt"), "Test file 1");
+  struct stat first_stat;
+  struct stat second_stat;
+  ASSERT_EQ(stat((backup / first / "subdir1/subdir2/file3.txt").c_str(),
+                 &first_stat),
+            0);
+  ASSERT_EQ(stat((backup / second / "subdir1/subdir2/file3.txt").c_str(),
+                 &second_stat),
+            0);
+  EXPECT_EQ(first_stat.st_ino, second_stat.st_ino);
+
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + (backup / second).string() + " " +
+             work.string());
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Changed test file 1");
+  EXPECT_EQ(ReadFile(work / "subdir1/file2.txt"), "Test file 2");
+  EXPECT_EQ(ReadFile(work / "subdir1/subdir2/file3.txt"), "Test file 3");
+}
+
+// Тест на снимок после смены прав и расширенных атрибутов без изменения
+// данных: файл не связывается с прошлым снимком, а копируется с новыми
+// метаданными
+TEST_F(BackupTests, SnapshotKeepsMetadataChanges) {
+  RunCommand("./bin/my_backup snapshot " + work.string() + " " +
+             backup.string());
+  file_sys::path first = ReadFile(backup / "last_full.txt");
+  sleep(1);
+  file_sys::permissions(work / "subdir1/subdir2/file3.txt",
+                        file_sys::perms::owner_read |
+                            file_sys::perms::owner_write);
+  bool xattrs = setxattr((work / "file1.txt").c_str(), "user.backup_test",
+                         "value", 5, 0) == 0;
+  RunCommand("./bin/my_backup snapshot " + work.string() + " " +
+             backup.string());
+  file_sys::path second = ReadFile(backup / "last_full.txt");
+  ASSERT_NE(first, second);
+
+  struct stat first_stat;
+  struct stat second_stat;
+  ASSERT_EQ(stat((backup / first / "subdir1/subdir2/file3.txt").c_str(),
+                 &first_stat),
+            0);
+  ASSERT_EQ(stat((backup / second / "subdir1/subdir2/file3.txt").c_str(),
+                 &second_stat),
+            0);
+  EXPECT_NE(first_stat.st_ino, second_stat.st_ino);
+  EXPECT_EQ(second_stat.st_mode & 07777, 0600u);
+  EXPECT_NE(first_stat.st_mode & 07777, 0600u);
+  if (xattrs) {
+    char value[16] = {};
+    EXPECT_EQ(getxattr((backup / second / "file1.txt").c_str(),
+                       "user.backup_test", value, sizeof(value)),
+              5);
+    EXPECT_LT(getxattr((backup / first / "file1.txt").c_str(),
+                       "user.backup_test", value, sizeof(value)),
+              0);
+  }
+}
+
+// Тест на продолжение бэкапа, прерванного после копирования файлов: запись
+// манифеста не удаётся, потому что на месте временного файла директория.
+// Временный файл копии, источник которой удалён, в бэкап не попадает
+TEST_F(BackupTests, ResumeInterruptedBackup) {
+  std::vector<file_sys::path> blockers;
+  std::time_t now = std::time(nullptr);
+  for (int i = 0; i <= 5; ++i) {
+    std::time_t seconds = now + i;
+    std::ostringstream name;
+    name << std::put_time(std::localtime(&seconds), "%Y-%m-%d-%H-%M-%S")
+         << ".manifest.tmp";
+    blockers.push_back(backup / name.str());
+    file_sys::create_directory(blockers.back());
+  }
+  std::string output = RunCommand("./bin/my_backup full " + work.string() +
+                                  " " + backup.string());
+  EXPECT_NE(output.find("Не удалось записать манифест"), std::string::npos);
+  EXPECT_EQ(ReadFile(backup / "last_full.txt"), "");
+  file_sys::path interrupted;
+  for (const auto& component : file_sys::directory_iterator(backup)) {
+    if (component.path().extension() == ".checkpoint") {
+      interrupted = backup / component.path().stem();
+    }
+  }
+  ASSERT_FALSE(interrupted.empty());
+  for (const file_sys::path& blocker : blockers) {
+    file_sys::remove(blocker);
+  }
+
+  output = RunCommand("./bin/my_restore " + interrupted.string() + " " +
+                      work.string());
+  EXPECT_NE(output.find("не завершён"), std::string::npos);
+
+  std::ofstream(interrupted / "subdir1/deleted.txt.brpart") << "Partial";
+  file_sys::path metrics = backup / "metrics.prom";
+  RunCommand("./bin/my_backup --resume --metrics-file " + metrics.string() +
+             " full " + work.string() + " " + backup.string());
+  EXPECT_EQ(ReadFile(backup / "last_full.txt"), interrupted.filename());
+  EXPECT_FALSE(file_sys::exists(interrupted / "subdir1/deleted.txt.brpart"));
+  EXPECT_FALSE(file_sys::exists(interrupted.string() + ".checkpoint"));
+  EXPECT_TRUE(file_sys::exists(interrupted.string() + ".manifest"));
+  std::ifstream metrics_file(metrics);
+  std::string text((std::istreambuf_iterator<char>(metrics_file)),
+                   std::istreambuf_iterator<char>());
+  EXPECT_NE(text.find("backup_files_copied_total 0\n"), std::string::npos);
+  EXPECT_NE(text.find("backup_files_skipped_total 3\n"), std::string::npos);
+  EXPECT_EQ(ReadFile(interrupted / "subdir1/subdir2/file3.txt"),
+            "Test file 3");
+}
+
+// Тест на перенос метаданных: время изменения с наносекундами у файла и
+// директории и расширенные атрибуты сохраняются в бэкапе и при
+// восстановлении
+TEST_F(BackupTests, MetadataPreserved) {
+  file_sys::path file = work / "subdir1/file2.txt";
+  file_sys::path dir = work / "subdir1/subdir2";
+  bool xattrs = setxattr(file.c_str(), "user.backup_test", "value", 5, 0) == 0;
+  struct timespec file_times[2] = {{1000000000, 123456789},
+                                   {1100000000, 987654321}};
+  struct timespec dir_times[2] = {{1200000000, 111}, {1300000000, 222}};
+  ASSERT_EQ(utimensat(AT_FDCWD, file.c_str(), file_times, 0), 0);
+  ASSERT_EQ(utimensat(AT_FDCWD, dir.c_str(), dir_times, 0), 0);
+
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_dir = backup / ReadFile(backup / "last_full.txt");
+  file_sys::remove_all(work);
+  file_sys::create_directory(work);
+  RunCommand("./bin/my_restore " + full_dir.string() + " " + work.string());
+
+  for (const file_sys::path& root : {full_dir, work}) {
+    struct stat file_stat;
+    struct stat dir_stat;
+    ASSERT_EQ(stat((root / "subdir1/file2.txt").c_str(), &file_stat), 0);
+    ASSERT_EQ(stat((root / "subdir1/subdir2").c_str(), &dir_stat), 0);
+    EXPECT_EQ(file_stat.st_mtim.tv_sec, 1100000000);
+    EXPECT_EQ(file_stat.st_mtim.tv_nsec, 987654321);
+    EXPECT_EQ(dir_stat.st_mtim.tv_sec, 1300000000);
+    EXPECT_EQ(dir_stat.st_mtim.tv_nsec, 222);
+    if (xattrs) {
+      char value[16] = {};
+      EXPECT_EQ(getxattr((root / "subdir1/file2.txt").c_str(),
+                         "user.backup_test", value, sizeof(value)),
+                5);
+      EXPECT_EQ(std::string(value), "value");
+    }
+  }
+}
+
+// Тест на метаданные символических ссылок: копия ссылки на директорию и на
+// файл получает права и время цели ссылки, а не самой ссылки
+TEST_F(BackupTests, SymlinkMetadataFollowed) {
+  file_sys::path dir = work / "subdir1/subdir2";
+  file_sys::path file = work / "file1.txt";
+  file_sys::permissions(dir, file_sys::perms::owner_all |
+                                 file_sys::perms::group_read |
+                                 file_sys::perms::group_exec);
+  struct timespec times[2] = {{1200000000, 0}, {1300000000, 333}};
+  ASSERT_EQ(utimensat(AT_FDCWD, dir.c_str(), times, 0), 0);
+  ASSERT_EQ(utimensat(AT_FDCWD, file.c_str(), times, 0), 0);
+  file_sys::create_directory_symlink(dir, work / "dir_link");
+  file_sys::create_symlink(file, work / "file_link");
+
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_dir = backup / ReadFile(backup / "last_full.txt");
+
+  for (const char* name : {"dir_link", "file_link"}) {
+    struct stat link_stat;
+    ASSERT_EQ(lstat((full_dir / name).c_str(), &link_stat), 0) << name;
+    EXPECT_FALSE(S_ISLNK(link_stat.st_mode)) << name;
+    EXPECT_EQ(link_stat.st_mtim.tv_sec, 1300000000) << name;
+    EXPECT_EQ(link_stat.st_mtim.tv_nsec, 333) << name;
+  }
+  struct stat dir_stat;
+  ASSERT_EQ(stat((full_dir / "dir_link").c_str(), &dir_stat), 0);
+  EXPECT_TRUE(S_ISDIR(dir_stat.st_mode));
+  EXPECT_EQ(dir_stat.st_mode & 07777, 0750u);
+  EXPECT_EQ(ReadFile(full_dir / "file_link"), "Test file 1");
+}
+
+// Тест на ограничение скорости: 8 МиБ при пределе 4 МиБ/с копируются не
+// быстрее чем за секунду, с пониженными приоритетами и подстройкой по
+// задержке
+TEST_F(BackupTests, ThrottledBackup) {
+  std::string data(8 << 20, 'x');
+  std::ofstream(work / "big.bin", std::ios::binary) << data;
+  auto start = std::chrono::steady_clock::now();
+  std::string output = RunCommand(
+      "./bin/my_backup --limit-mbps 4 --limit-iops 1000 --latency-target 1000 "
+      "--ionice idle --nice 5 full " +
+      work.string() + " " + backup.string());
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(output, "");
+  EXPECT_GE(elapsed, std::chrono::seconds(1));
+  file_sys::path full_dir = backup / ReadFile(backup / "last_full.txt");
+  EXPECT_EQ(file_sys::file_size(full_dir / "big.bin"), data.size());
+}
+
+// Тест на восстановление мимо page cache: хвост файла не кратен блоку
+TEST_F(BackupTests, DirectRestore) {
+  std::string data((3 << 20) + 123, '\0');
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<char>(i * 131 % 251);
+  }
+  std::ofstream(work / "big.bin", std::ios::binary) << data;
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_dir = backup / ReadFile(backup / "last_full.txt");
+  file_sys::remove(work / "big.bin");
+  file_sys::remove(work / "file1.txt");
+
+  std::string output =
+      RunCommand("./bin/my_restore --direct --copy-report " +
+                 full_dir.string() + " " + work.string());
+  EXPECT_NE(output.find("direct " + (work / "big.bin").string()),
+            std::string::npos);
+  std::ifstream file(work / "big.bin", std::ios::binary);
+  std::string restored((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ(restored, data);
+  EXPECT_EQ(ReadFile(work / "file1.txt"), "Test file 1");
+}
+
+// Тест на объединение full и инкрементного бэкапа в новый full backup и
+// удаление старой цепочки
+TEST_F(BackupTests, CompactBackups) {
+  std::string data;
+  uint32_t state = 1;
+  for (size_t i = 0; i < (4 << 20); ++i) {
+    state = state * 1103515245 + 12345;
+    data.push_back(static_cast<char>(state >> 16));
+  }
+  std::ofstream(work / "db.bin", std::ios::binary) << data;
+  RunCommand("./bin/my_backup full " + work.string() + " " + backup.string());
+  file_sys::path full_dir = backup / ReadFile(backup / "last_full.txt");
+
+  data.insert(1 << 20, "inserted bytes");
+  std::ofstream(work / "db.bin", std::ios::binary) << data;
+  std::ofstream(work / "file1.txt") << "Changed test file 1";
+  file_sys::remove(work / "subdir1/subdir2/file3.txt");
+  sleep(1);
+  RunCommand("./bin/my_backup --delta-threshold 1M incremental " +
+             work.string() + " " + backup.string());
+  file_sys::path incremental_dir = backup / GetTimeName();
+  ASSERT_TRUE(file_sys::exists(incremental_dir / "db.bin.brdelta"));
+
+  EXPECT_EQ(RunCommand("./bin/my_backup compact " + backup.string()), "");
+  file_sys::path compact_dir = backup / ReadFile(backup / "last_full.txt");
+  EXPECT_GT(compact_dir, incremental_dir);
+  EXPECT_EQ(ReadFile(compact_dir / "file1.txt"), "Changed test file 1");
+  EXPECT_FALSE(file_sys::exists(compact_dir / "subdir1/subdir2/file3.txt"));
+  // Неизменённый файл взят ссылкой на копию из full backup
+  EXPECT_EQ(file_sys::hard_link_count(compact_dir / "subdir1/file2.txt"), 2u);
+  std::ifstream file(compact_dir / "db.bin", std::ios::binary);
+  std::string compacted((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+  EXPECT_TRUE(compacted == data);
+
+  EXPECT_EQ(RunCommand("./bin/my_backup compact --keep 1 " + backup.string()),
+            "");
+  EXPECT_FALSE(file_sys::exists(full_dir));
+  EXPECT_FALSE(file_sys::exists(incremental_dir));
+  EXPECT_FALSE(file_sys::exists(backup / (full_dir.string() + ".manifest")));
+  EXPECT_EQ(ReadFile(compact_dir / "subdir1/file2.txt"), "Test file 2");
+  EXPECT_EQ(file_sys::hard_link_count(compact_dir / "subdir1/file2.txt"), 1u);
+}
+
 // Тест на ошибку доступа к файлам
 TEST_F(BackupTests, PermissionDeniedReadInWork) {
   std::ofstream test_file(work / "test_file.txt");